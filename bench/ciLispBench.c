@@ -0,0 +1,439 @@
+#include "ciLisp.h"
+#include "ciLispOutput.h"
+
+#include <time.h>
+
+// Benchmarks of the interpreter core: generated programs run through the
+// same entry points as the REPL and scripts, in both evaluation modes.
+//
+//   cilisp_bench [--json] [--filter NAME] [--reps N] [--min-time MS]
+//
+// Every benchmark is warmed up while the number of operations per repetition
+// is calibrated to take at least --min-time, then timed --reps times.
+// Allocations count the malloc, calloc and realloc calls made by the
+// interpreter (the target links with --wrap for them).
+// The report ends with the bytes allocated per AST node type.
+
+// the reentrant scanner's API, which ciLisp.h does not declare
+int yylex_init(yyscan_t *scanner);
+void yyset_in(FILE *in, yyscan_t scanner);
+int yylex_destroy(yyscan_t scanner);
+
+//*********************************
+// Allocation Counting
+//*********************************
+
+static size_t numAllocs, allocBytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    numAllocs++;
+    allocBytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    numAllocs++;
+    allocBytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    numAllocs++;
+    allocBytes += size;
+    return __real_realloc(ptr, size);
+}
+
+//*********************************
+// Workloads
+//*********************************
+
+// What one operation of a benchmark is.
+typedef enum {
+    BENCH_EVAL,     // evalCompiled() of a program compiled once
+    BENCH_COMPILE,  // compileProgram() and freeProgram() of one line
+    BENCH_BATCH     // a whole script scanned as one stream, like cilisp script
+} BENCH_KIND;
+
+typedef struct {
+    const char *name;
+    BENCH_KIND kind;
+    char *source;   // the program, or the script for BENCH_BATCH
+    size_t sourceLen;
+} BENCH;
+
+typedef struct {
+    char *text;
+    size_t len;
+    FILE *stream;
+} TEXT;
+
+static void textOpen(TEXT *text)
+{
+    if ((text->stream = open_memstream(&text->text, &text->len)) == NULL) {
+        yyerror("Memory allocation failed!");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static BENCH textBench(const char *name, BENCH_KIND kind, TEXT *text)
+{
+    fclose(text->stream);
+    return (BENCH){name, kind, text->text, text->len};
+}
+
+// A lambda whose body is one oper with width operands, all its argument,
+// so nothing is folded and resolveMultOp() does all the work.
+static BENCH wideBench(const char *name, const char *oper, int width, const char *arg)
+{
+    TEXT text;
+    textOpen(&text);
+    fprintf(text.stream, "((let (f lambda (x) (%s", oper);
+    for (int i = 0; i < width; i++)
+        fprintf(text.stream, " x");
+    fprintf(text.stream, "))) (f %s))", arg);
+    return textBench(name, BENCH_EVAL, &text);
+}
+
+// Symbols are letters only, so the nth generated one is v followed by the
+// digits of n in base 26, which never clashes with the single letter names.
+static void printSymbol(FILE *stream, int n)
+{
+    putc('v', stream);
+    do {
+        putc('a' + n % 26, stream);
+        n /= 26;
+    } while (n > 0);
+}
+
+// depth nested lets, each binding adding one to the one outside it, with a
+// body that refers to the lambda argument depth + 1 frames up. Every let is
+// directly the body of the one outside it.
+static BENCH deepLetBench(const char *name, int depth)
+{
+    TEXT text;
+    textOpen(&text);
+    fprintf(text.stream, "((let (f lambda (x) ");
+    for (int i = 0; i < depth; i++) {
+        fprintf(text.stream, "((let (");
+        printSymbol(text.stream, i);
+        fprintf(text.stream, " (add ");
+        if (i == 0)
+            putc('x', text.stream);
+        else
+            printSymbol(text.stream, i - 1);
+        fprintf(text.stream, " 1))) ");
+    }
+    fprintf(text.stream, "(add ");
+    printSymbol(text.stream, depth - 1);
+    fprintf(text.stream, " x x x)");
+    for (int i = 0; i < depth; i++)
+        putc(')', text.stream);
+    fprintf(text.stream, ")) (f 1))");
+    return textBench(name, BENCH_EVAL, &text);
+}
+
+static BENCH sourceBench(const char *name, const char *source)
+{
+    TEXT text;
+    textOpen(&text);
+    fputs(source, text.stream);
+    return textBench(name, BENCH_EVAL, &text);
+}
+
+// One line with numTokens numbers and symbols for the scanner and parser.
+static BENCH lexerBench(const char *name, int numTokens)
+{
+    TEXT text;
+    textOpen(&text);
+    fprintf(text.stream, "((let (x 2) (y 3.5)) (add");
+    for (int i = 0; i < numTokens; i++) {
+        switch (i % 4) {
+            case 0:
+                fprintf(text.stream, " %d", i);
+                break;
+            case 1:
+                fprintf(text.stream, " %d.%03d", i, i % 1000);
+                break;
+            case 2:
+                fprintf(text.stream, " x");
+                break;
+            default:
+                fprintf(text.stream, " y");
+        }
+    }
+    fprintf(text.stream, "))");
+    return textBench(name, BENCH_COMPILE, &text);
+}
+
+// A script of numLines short programs of every kind.
+static BENCH batchBench(const char *name, int numLines)
+{
+    static const char *const lines[] = {
+            "(add 1 2)",
+            "(mult (add 1.5 2) (sub 10 4) (div 9 3))",
+            "((let (a 5) (b (mult a 2))) (hypot a b))",
+            "((let (f lambda (n) (cond (less n 1) 0 (add n (f (sub n 1)))))) (f %d))",
+            "((let (f lambda (x y) (add (mult x y) (div x y)))) (f %d 3))",
+            "(cond (less %d 50) (sqrt %d) (cbrt %d))",
+    };
+    int numKinds = sizeof(lines) / sizeof(lines[0]);
+
+    TEXT text;
+    textOpen(&text);
+    for (int i = 0; i < numLines; i++) {
+        int n = i % 100;
+        fprintf(text.stream, lines[i % numKinds], n, n, n);
+        fprintf(text.stream, "\n");
+    }
+    return textBench(name, BENCH_BATCH, &text);
+}
+
+// A script of numLines programs that do little besides printing numbers.
+static BENCH resultsBench(const char *name, int numLines)
+{
+    static const char *const lines[] = {
+            "(div %d 7.0)",
+            "(mult %d 123456789)",
+            "(print (sqrt %d) %d (add %d 0.25))",
+    };
+    int numKinds = sizeof(lines) / sizeof(lines[0]);
+
+    TEXT text;
+    textOpen(&text);
+    for (int i = 0; i < numLines; i++) {
+        fprintf(text.stream, lines[i % numKinds], i, i, i);
+        fprintf(text.stream, "\n");
+    }
+    return textBench(name, BENCH_BATCH, &text);
+}
+
+//*********************************
+// Running
+//*********************************
+
+typedef struct {
+    const BENCH *bench;
+    EVAL_MODE mode;
+    long iterations;
+    int reps;
+    double nsPerOp, nsPerOpMin;
+    double allocsPerOp, bytesPerOp;
+} BENCH_RESULT;
+
+static const char *const modeNames[] = {"tree", "vm"};
+
+static FILE *devNull;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void runBatch(const BENCH *bench)
+{
+    FILE *in;
+    yyscan_t scanner;
+    if ((in = fmemopen(bench->source, bench->sourceLen, "r")) == NULL || yylex_init(&scanner) != 0) {
+        yyerror("Memory allocation failed!");
+        exit(EXIT_FAILURE);
+    }
+    yyset_in(in, scanner);
+    yyparse(scanner);
+    yylex_destroy(scanner);
+    releaseProgram();
+    fclose(in);
+}
+
+// Runs iterations operations of bench, returning the time they took in ns.
+static double runOps(const BENCH *bench, CILISP_PROGRAM *program, long iterations)
+{
+    double start = now();
+    for (long i = 0; i < iterations; i++) {
+        switch (bench->kind) {
+            case BENCH_EVAL:
+                evalCompiled(program);
+                break;
+            case BENCH_COMPILE:
+                freeProgram(compileProgram(bench->source));
+                break;
+            case BENCH_BATCH:
+                runBatch(bench);
+                break;
+        }
+    }
+    return now() - start;
+}
+
+static int compareDoubles(const void *lhs, const void *rhs)
+{
+    double a = *(const double *) lhs, b = *(const double *) rhs;
+    return (a > b) - (a < b);
+}
+
+static BENCH_RESULT runBench(const BENCH *bench, EVAL_MODE mode, int reps, double minTime)
+{
+    BENCH_RESULT result = {bench, mode, 1, reps};
+    evalMode = mode;
+    CILISP_PROGRAM *program = NULL;
+    if (bench->kind == BENCH_EVAL
+        && ((program = compileProgram(bench->source)) == NULL || isnan(asDouble(evalCompiled(program))))) {
+        fprintf(stderr, "%s does not evaluate to a number\n", bench->name);
+        exit(EXIT_FAILURE);
+    }
+
+    // warm up, doubling the operations per repetition until they take minTime
+    while (runOps(bench, program, result.iterations) < minTime)
+        result.iterations *= 2;
+
+    double times[reps];
+    size_t allocs = numAllocs, bytes = allocBytes;
+    for (int i = 0; i < reps; i++)
+        times[i] = runOps(bench, program, result.iterations) / result.iterations;
+    long ops = result.iterations * reps;
+    result.allocsPerOp = (double) (numAllocs - allocs) / ops;
+    result.bytesPerOp = (double) (allocBytes - bytes) / ops;
+
+    qsort(times, reps, sizeof(double), compareDoubles);
+    result.nsPerOp = times[reps / 2];
+    result.nsPerOpMin = times[0];
+    freeProgram(program);
+    return result;
+}
+
+static double opsPerSec(const BENCH_RESULT *result)
+{
+    return 1e9 / result->nsPerOp;
+}
+
+// Source bytes per second, for the benchmarks that scan their source.
+static double mbPerSec(const BENCH_RESULT *result)
+{
+    if (result->bench->kind == BENCH_EVAL)
+        return 0;
+    return result->bench->sourceLen / result->nsPerOp * 1e9 / (1 << 20);
+}
+
+// Bytes allocated for each kind of AST node, next to the size of the whole
+// union, so layout changes show up with the timings.
+static const struct {
+    const char *name;
+    AST_NODE_TYPE type;
+} nodeTypes[] = {
+        {"num", NUM_NODE_TYPE},
+        {"func", FUNC_NODE_TYPE},
+        {"symbol", SYMBOL_NODE_TYPE},
+        {"cond", COND_NODE_TYPE},
+};
+
+#define NUM_NODE_TYPES ((int) (sizeof(nodeTypes) / sizeof(nodeTypes[0])))
+
+static void printTable(const BENCH_RESULT *results, int numResults)
+{
+    printf("%-16s %-4s %10s %12s %12s %10s %12s %12s %8s\n", "benchmark", "mode", "iters",
+           "ns/op", "min ns/op", "allocs/op", "bytes/op", "ops/s", "MB/s");
+    for (int i = 0; i < numResults; i++) {
+        const BENCH_RESULT *r = &results[i];
+        printf("%-16s %-4s %10ld %12.1f %12.1f %10.2f %12.1f %12.0f %8.2f\n", r->bench->name, modeNames[r->mode],
+               r->iterations, r->nsPerOp, r->nsPerOpMin, r->allocsPerOp, r->bytesPerOp, opsPerSec(r), mbPerSec(r));
+    }
+
+    printf("\nnode bytes:");
+    for (int i = 0; i < NUM_NODE_TYPES; i++)
+        printf(" %s %zu", nodeTypes[i].name, astNodeSize(nodeTypes[i].type));
+    printf(" (AST_NODE %zu)\n", sizeof(AST_NODE));
+}
+
+static void printJson(const BENCH_RESULT *results, int numResults)
+{
+    printf("{\n  \"benchmarks\": [\n");
+    for (int i = 0; i < numResults; i++) {
+        const BENCH_RESULT *r = &results[i];
+        printf("    {\"name\": \"%s\", \"mode\": \"%s\", \"iterations\": %ld, \"repetitions\": %d, "
+               "\"ns_per_op\": %.3f, \"ns_per_op_min\": %.3f, \"allocs_per_op\": %.3f, \"bytes_per_op\": %.3f, "
+               "\"ops_per_sec\": %.3f, \"mb_per_sec\": %.3f}%s\n",
+               r->bench->name, modeNames[r->mode], r->iterations, r->reps, r->nsPerOp, r->nsPerOpMin,
+               r->allocsPerOp, r->bytesPerOp, opsPerSec(r), mbPerSec(r), i + 1 < numResults ? "," : "");
+    }
+    printf("  ],\n  \"node_bytes\": {");
+    for (int i = 0; i < NUM_NODE_TYPES; i++)
+        printf("\"%s\": %zu, ", nodeTypes[i].name, astNodeSize(nodeTypes[i].type));
+    printf("\"ast_node\": %zu}\n}\n", sizeof(AST_NODE));
+}
+
+int main(int argc, char **argv)
+{
+    bool json = false;
+    char *filter = NULL;
+    int reps = 5;
+    double minTime = 50e6;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            filter = argv[++i];
+        else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc)
+            reps = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+            minTime = atof(argv[++i]) * 1e6;
+        else
+            reps = 0;
+        if (reps < 1) {
+            fprintf(stderr, "usage: %s [--json] [--filter NAME] [--reps N] [--min-time MS]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // results and messages of the programs themselves are thrown away
+    if ((devNull = fopen("/dev/null", "w")) == NULL) {
+        perror("/dev/null");
+        return EXIT_FAILURE;
+    }
+    outputStream = devNull;
+    batchMode = true;
+
+    BENCH benches[] = {
+            wideBench("add_wide", "add", 512, "1.5"),
+            wideBench("mult_wide", "mult", 512, "1.0001"),
+            deepLetBench("let_deep", 64),
+            sourceBench("lambda_calls",
+                        "((let (fib lambda (n) (cond (less n 2) n (add (fib (sub n 1)) (fib (sub n 2)))))) (fib 16))"),
+            sourceBench("tail_calls",
+                        "((let (f lambda (n acc) (cond (less n 1) acc (f (sub n 1) (add acc n))))) (f 10000 0))"),
+            lexerBench("lexer", 4096),
+            batchBench("batch", 1000),
+            resultsBench("results", 1000),
+    };
+    int numBenches = sizeof(benches) / sizeof(benches[0]);
+
+    BENCH_RESULT results[2 * numBenches];
+    int numResults = 0;
+    for (int i = 0; i < numBenches; i++) {
+        if (filter != NULL && strstr(benches[i].name, filter) == NULL)
+            continue;
+        for (EVAL_MODE mode = TREE_EVAL_MODE; mode <= VM_EVAL_MODE; mode++) {
+            results[numResults++] = runBench(&benches[i], mode, reps, minTime);
+            if (!json)
+                fprintf(stderr, "%s/%s done\n", benches[i].name, modeNames[mode]);
+        }
+    }
+
+    if (json)
+        printJson(results, numResults);
+    else
+        printTable(results, numResults);
+
+    for (int i = 0; i < numBenches; i++)
+        free(benches[i].source);
+    outputRelease();
+    fclose(devNull);
+    return EXIT_SUCCESS;
+}
@@ -1,4 +1,24 @@
 #include "ciLisp.h"
+#include "ciLispVM.h"
+#include "ciLispJIT.h"
+#include "ciLispMemo.h"
+#include "ciLispCSE.h"
+#include "ciLispMetrics.h"
+#include "ciLispColumns.h"
+#include "ciLispImage.h"
+#include "ciLispSession.h"
+#include "ciLispOutput.h"
+
+EVAL_MODE evalMode = TREE_EVAL_MODE;
+bool batchMode = false;
+_Thread_local FILE *outputStream = NULL;
+
+#ifdef CILISP_TRACE
+TRACE_LEVEL traceLevel = TRACE_OFF;
+FILE *traceFile = NULL;
+#endif
+
+_Thread_local ARENA programArena;
 
 void yyerror(char *s) {
     fprintf(stderr, "\nERROR: %s\n", s);
@@ -6,57 +26,241 @@ void yyerror(char *s) {
     // CLion will display stderr in a different color from stdin and stdout
 }
 
-// Array of string values for operations.
-// Must be in sync with funcs in the OPER_TYPE enum in order for resolveFunc to work.
-char *funcNames[] = {
-        "neg",
-        "abs",
-        "exp",
-        "sqrt",
-        "add",
-        "sub",
-        "mult",
-        "div",
-        "remainder",
-        "log",
-        "pow",
-        "max",
-        "min",
-        "exp2",
-        "cbrt",
-        "hypot",
-        "read",
-        "rand",
-        "print",
-        "equal",
-        "less",
-        "greater",
+// Array of string values for operations, indexed by OPER_TYPE.
+char *const funcNames[] = {
+#define X(oper, name, arity) name,
+        CILISP_OPERS(X)
+#undef X
         ""
 };
 
-OPER_TYPE resolveFunc(char *funcName)
+// Perfect hash of the operator names: no two of them share a slot of
+// operTable, which holds oper + 1 (0 for an empty slot). initOperTable()
+// fills it before main and refuses a list of names that collide.
+#define OPER_TABLE_SIZE 64
+
+static unsigned char operTable[OPER_TABLE_SIZE];
+
+static unsigned operHash(const char *name, size_t len)
 {
-    int i = 0;
-    while (funcNames[i][0] != '\0')
-    {
-        if (strcmp(funcNames[i], funcName) == 0)
-            return i;
-        i++;
+    const unsigned char *s = (const unsigned char *) name;
+    return (len + 3u * s[0] + 6u * s[len > 1] + 7u * s[len - 1]) % OPER_TABLE_SIZE;
+}
+
+__attribute__((constructor))
+static void initOperTable(void)
+{
+    for (int oper = 0; oper < NUM_OPERS; oper++) {
+        unsigned slot = operHash(funcNames[oper], strlen(funcNames[oper]));
+        if (operTable[slot] != 0) {
+            fprintf(stderr, "operators %s and %s have the same hash\n", funcNames[operTable[slot] - 1], funcNames[oper]);
+            abort();
+        }
+        operTable[slot] = oper + 1;
     }
+}
+
+OPER_TYPE resolveFunc(const char *name, size_t len)
+{
+    if (len == 0)
+        return CUSTOM_OPER;
+
+    int entry = operTable[operHash(name, len)];
+    if (entry != 0 && strncmp(funcNames[entry - 1], name, len) == 0 && funcNames[entry - 1][len] == '\0')
+        return entry - 1;
     return CUSTOM_OPER;
 }
 
-NUM_TYPE resolveType(char *type){
-    if(type == NULL){
-        return NO_TYPE;
-    }
-    else if(strcmp(type, "double") == 0){
+NUM_TYPE resolveType(const char *name, size_t len)
+{
+    if (len == 3 && memcmp(name, "int", 3) == 0)
+        return INT_TYPE;
+    if (len == 6 && memcmp(name, "double", 6) == 0)
         return DOUBLE_TYPE;
+    return NO_TYPE;
+}
+
+//*********************************
+// Number Literals
+//*********************************
+
+// Significant digits a uint64_t always holds.
+#define LITERAL_MAX_DIGITS 19
+// 2^53: every integer up to it is exact as a double.
+#define LITERAL_MAX_MANTISSA ((uint64_t) 1 << 53)
+
+// Powers of ten that are exact as doubles.
+static const double literalPowers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// strtod() of the literal, which the input buffer does not end after.
+static double readDouble(const char *text, size_t len)
+{
+    char copy[64];
+    if (len < sizeof(copy)) {
+        memcpy(copy, text, len);
+        copy[len] = '\0';
+        return strtod(copy, NULL);
     }
-    else if(strcmp(type, "int") == 0){
-        return INT_TYPE;
+
+    char *heap;
+    if ((heap = malloc(len + 1)) == NULL) {
+        yyerror("Memory allocation failed!");
+        return NAN;
     }
-    return NO_TYPE;
+    memcpy(heap, text, len);
+    heap[len] = '\0';
+    double val = strtod(heap, NULL);
+    free(heap);
+    return val;
+}
+
+RET_VAL parseInt(const char *text, size_t len)
+{
+    bool negative = text[0] == '-';
+    size_t i = text[0] == '-' || text[0] == '+';
+    uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : INT64_MAX;
+    uint64_t mag = 0;
+    for (; i < len; i++) {
+        unsigned digit = text[i] - '0';
+        if (mag > (limit - digit) / 10)
+            return typedVal(INT_TYPE, readDouble(text, len));
+        mag = mag * 10 + digit;
+    }
+    return intVal(negative ? (int64_t) (0 - mag) : (int64_t) mag);
+}
+
+// A literal with up to 2^53 as its digits and at most 22 of them after the
+// point is the quotient of two exact doubles, which IEEE division rounds
+// correctly, so it reads the same as with strtod(), which the others take.
+RET_VAL parseDouble(const char *text, size_t len)
+{
+    bool negative = text[0] == '-';
+    size_t i = text[0] == '-' || text[0] == '+';
+    uint64_t mantissa = 0;
+    int digits = 0, decimals = 0;
+    bool fraction = false;
+    for (; i < len; i++) {
+        if (text[i] == '.') {
+            fraction = true;
+            continue;
+        }
+        if (digits == LITERAL_MAX_DIGITS)
+            return typedVal(DOUBLE_TYPE, readDouble(text, len));
+        mantissa = mantissa * 10 + (unsigned) (text[i] - '0');
+        digits += mantissa != 0;
+        decimals += fraction;
+    }
+
+    if (mantissa > LITERAL_MAX_MANTISSA || decimals >= (int) (sizeof(literalPowers) / sizeof(double)))
+        return typedVal(DOUBLE_TYPE, readDouble(text, len));
+    double val = (double) mantissa / literalPowers[decimals];
+    return typedVal(DOUBLE_TYPE, negative ? -val : val);
+}
+
+char *traceLevelNames[] = {
+        "off",
+        "tokens",
+        "reductions",
+        "eval",
+        ""
+};
+
+// Selects the trace level by name, returns false if it is unknown or
+// tracing was not compiled in (see CILISP_TRACE).
+bool setTraceLevel(char *name)
+{
+#ifdef CILISP_TRACE
+    for (int i = 0; traceLevelNames[i][0] != '\0'; i++) {
+        if (strcmp(traceLevelNames[i], name) == 0) {
+            traceLevel = i;
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+//*********************************
+// Arena Functions
+//*********************************
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_RETAIN_LIMIT (1024 * 1024)
+
+// Returns size bytes of zeroed memory from the arena, or NULL if out of memory.
+void *arenaAlloc(ARENA *arena, size_t size)
+{
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+    ARENA_BLOCK *block = arena->head;
+    if (block == NULL || block->used + size > block->size) {
+        size_t blockSize = arena->reserve > ARENA_BLOCK_SIZE ? arena->reserve : ARENA_BLOCK_SIZE;
+        if (blockSize < size)
+            blockSize = size;
+        if ((block = malloc(sizeof(ARENA_BLOCK) + blockSize)) == NULL)
+            return NULL;
+
+        block->next = arena->head;
+        block->size = blockSize;
+        block->used = 0;
+        arena->head = block;
+    }
+
+    void *mem = (char *) block->data + block->used;
+    block->used += size;
+    arena->allocated += size;
+    METRIC_ADD(bytesAllocated, size);
+    return memset(mem, 0, size);
+}
+
+char *arenaStrdup(ARENA *arena, const char *str, size_t len)
+{
+    char *copy;
+    if ((copy = arenaAlloc(arena, len + 1)) == NULL)
+        yyerror("Memory allocation failed!");
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Releases everything allocated since the last reset.
+// One block is kept for the next program; a program that spilled into several
+// blocks gets a single block big enough for it, up to ARENA_RETAIN_LIMIT.
+void arenaReset(ARENA *arena)
+{
+    size_t total = 0;
+    memoRelease(&arena->memo);
+    if (arena->head != NULL && arena->head->next == NULL && arena->head->size <= ARENA_RETAIN_LIMIT) {
+        arena->head->used = 0;
+    }
+    else {
+        while (arena->head != NULL) {
+            ARENA_BLOCK *next = arena->head->next;
+            total += arena->head->size;
+            free(arena->head);
+            arena->head = next;
+        }
+        arena->reserve = total <= ARENA_RETAIN_LIMIT ? total : 0;
+    }
+    arena->allocated = 0;
+    jitFreeBlocks(&arena->jit);
+}
+
+// Returns every block of the arena to malloc.
+void arenaFree(ARENA *arena)
+{
+    memoRelease(&arena->memo);
+    while (arena->head != NULL) {
+        ARENA_BLOCK *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    jitFreeBlocks(&arena->jit);
+    *arena = (ARENA){0};
 }
 
 //*********************************
@@ -68,28 +272,26 @@ NUM_TYPE resolveType(char *type){
 // Sets the AST_NODE's type to .
 // Populates the value of the contained NUMBER_AST_NODE with the argument value.
 // SEE: AST_NODE, NUM_AST_NODE, AST_NODE_TYPE.
-AST_NODE *createNumberNode(double value, NUM_TYPE type)
+AST_NODE *createNumberNode(NUM_AST_NODE value)
 {
     AST_NODE *node;
     size_t nodeSize;
 
-    // allocate space for the fixed sie and the variable part (union)
-    nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    // allocate space for the fixed part and the number member of the union
+    nodeSize = astNodeSize(NUM_NODE_TYPE);
+    if ((node = arenaAlloc(&programArena, nodeSize)) == NULL)
         yyerror("Memory allocation failed!");
 
     node->type = NUM_NODE_TYPE;
-    switch (type){
+    switch (value.type){
         case INT_TYPE:
-            node->data.number.type = INT_TYPE;
-            node->data.number.val = floor(value);
+            node->data.number = value.isInt ? value : typedVal(INT_TYPE, floor(value.dval));
             break;
         case DOUBLE_TYPE:
-            node->data.number.type = DOUBLE_TYPE;
-            node->data.number.val = value;
+            node->data.number = value;
             break;
         default:
-            printf("Invalid NUM_TYPE type!");
+            fprintf(OUTPUT, "Invalid NUM_TYPE type!");
             break;
     }
 
@@ -101,65 +303,66 @@ AST_NODE *createNumberNode(double value, NUM_TYPE type)
 // Sets the created AST_NODE's type to function.
 // Populates the contained FUNC_AST_NODE with:
 //      - An OPER_TYPE (the enum identifying the specific function being called)
-//      - 2 AST_NODEs, the operands
+//      - The array of operand AST_NODEs
 // SEE: AST_NODE, FUNC_AST_NODE, AST_NODE_TYPE.
-AST_NODE *createFunctionNode(char *funcName, AST_NODE *opList)
+AST_NODE *createFunctionNode(OPER_TYPE oper, AST_LIST ops)
 {
     AST_NODE *node;
     size_t nodeSize;
 
     // allocate space (or error)
-    nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    nodeSize = astNodeSize(FUNC_NODE_TYPE);
+    if ((node = arenaAlloc(&programArena, nodeSize)) == NULL)
         yyerror("Memory allocation failed!");
 
-    // TODO set the AST_NODE's type, populate contained FUNC_AST_NODE
     // NOTE: you do not need to populate the "ident" field unless the function is type CUSTOM_OPER.
-    // When you do have a CUSTOM_OPER, you do NOT need to allocate and strcpy here.
-    // The funcName will be a string identifier for which space should be allocated in the tokenizer.
-    // For CUSTOM_OPER functions, you should simply assign the "ident" pointer to the passed in funcName.
-    // For functions other than CUSTOM_OPER, you should free the funcName after you're assigned the OPER_TYPE.
+    // Builtin operators are resolved by the scanner, which hands over the OPER_TYPE.
 
     node->type = FUNC_NODE_TYPE;
-    node->data.function.oper = resolveFunc(funcName);
-    node->data.function.opList = opList;
-
-    AST_NODE *setParentTemp = opList;
-    while (setParentTemp != NULL){
-        setParentTemp->parent = node;
-        setParentTemp = setParentTemp->next;
-    }
+    node->data.function.oper = oper;
+    node->data.function.ops = ops.ops;
+    node->data.function.numOps = ops.numOps;
 
     return node;
 }
 
+// ident is interned by the scanner.
 AST_NODE *createSymbolNode(char *ident){
     AST_NODE *node;
     size_t nodeSize;
 
-    // allocate space for the fixed sie and the variable part (union)
-    nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    // allocate space for the fixed part and the symbol member of the union
+    nodeSize = astNodeSize(SYMBOL_NODE_TYPE);
+    if ((node = arenaAlloc(&programArena, nodeSize)) == NULL)
         yyerror("Memory allocation failed!");
 
     node->type = SYMBOL_NODE_TYPE;
-    node->data.symbol.ident = malloc(sizeof(ident) + 1);
-    strcpy(node->data.symbol.ident, ident);
+    node->data.symbol.ident = ident;
 
     return node;
 }
 
-AST_NODE *createFuncList(AST_NODE *node, AST_NODE *next){
+// Appends node to the operands of an f_expr being parsed, doubling the array
+// when it is full. The arrays left behind stay in the arena with the program.
+AST_LIST addToFuncList(AST_LIST list, AST_NODE *node){
     if(node == NULL){
-        return NULL;
-    }
-    if(next == NULL){
-        node->next = NULL;
-        return node;
+        return list;
+    }
+    if(list.numOps == list.cap){
+        int cap = list.cap ? list.cap * 2 : 2;
+        AST_NODE **ops;
+        if((ops = arenaAlloc(&programArena, cap * sizeof(AST_NODE *))) == NULL){
+            yyerror("Memory allocation failed!");
+            return list;
+        }
+        if(list.numOps > 0){
+            memcpy(ops, list.ops, list.numOps * sizeof(AST_NODE *));
+        }
+        list.ops = ops;
+        list.cap = cap;
     }
-    node->next = next;
-
-    return node;
+    list.ops[list.numOps++] = node;
+    return list;
 }
 
 AST_NODE *createConditionNode(AST_NODE *condition, AST_NODE *trueExpr, AST_NODE *falseExpr){
@@ -167,43 +370,38 @@ AST_NODE *createConditionNode(AST_NODE *condition, AST_NODE *trueExpr, AST_NODE
     size_t nodeSize;
 
     // allocate space (or error)
-    nodeSize = sizeof(AST_NODE);
-    if ((node = calloc(nodeSize, 1)) == NULL)
+    nodeSize = astNodeSize(COND_NODE_TYPE);
+    if ((node = arenaAlloc(&programArena, nodeSize)) == NULL)
         yyerror("Memory allocation failed!");
 
 
     node->type = COND_NODE_TYPE;
     node->data.condition.cond = condition;
-    condition->parent = node;
-
     node->data.condition.trueCond = trueExpr;
-    trueExpr->parent = node;
-
     node->data.condition.falseCond = falseExpr;
-    falseExpr->parent = node;
 
 
     return node;
 }
 
-SYMBOL_TABLE_NODE *createSymbolTableNode(char *type, AST_NODE *symNode, char *lambda, STACK_NODE *stackNode, AST_NODE *node){
+SYMBOL_TABLE_NODE *createSymbolTableNode(NUM_TYPE type, AST_NODE *symNode, bool lambda, STACK_NODE *stackNode, AST_NODE *node){
     SYMBOL_TABLE_NODE *symbolTableNode;
     size_t nodeSize;
 
     nodeSize = sizeof(SYMBOL_TABLE_NODE);
-    if ((symbolTableNode = calloc(nodeSize, 1)) == NULL)
+    if ((symbolTableNode = arenaAlloc(&programArena, nodeSize)) == NULL)
         yyerror("Memory allocation failed!");
 
     symbolTableNode->ident = symNode->data.symbol.ident;
-    symbolTableNode->val_type = resolveType(type);
+    symbolTableNode->val_type = type;
     symbolTableNode->val = node;
-    if(lambda == NULL){
-        symbolTableNode->type = VARIABLE_TYPE;
-    }
-    else if(strcmp(lambda, "lambda") == 0){
+    if(lambda){
         symbolTableNode->type = LAMBDA_TYPE;
         symbolTableNode->stack = stackNode;
     }
+    else{
+        symbolTableNode->type = VARIABLE_TYPE;
+    }
 
     return symbolTableNode;
 }
@@ -214,7 +412,7 @@ STACK_NODE *createStackNodes(AST_NODE *head, STACK_NODE *next){
     size_t nodeSize;
 
     nodeSize = sizeof(STACK_NODE);
-    if ((headNode = calloc(nodeSize, 1)) == NULL)
+    if ((headNode = arenaAlloc(&programArena, nodeSize)) == NULL)
         yyerror("Memory allocation failed!");
 
     if(head == NULL){
@@ -222,8 +420,9 @@ STACK_NODE *createStackNodes(AST_NODE *head, STACK_NODE *next){
     }
     headNode->type = ARG_TYPE;
     headNode->ident = head->data.symbol.ident;
-    nodeSize = sizeof(AST_NODE);
-    headNode->val = calloc(nodeSize, 1);
+    nodeSize = astNodeSize(NUM_NODE_TYPE);
+    if ((headNode->val = arenaAlloc(&programArena, nodeSize)) == NULL)
+        yyerror("Memory allocation failed!");
 
    if(next != NULL){
        headNode->next = next;
@@ -232,266 +431,346 @@ STACK_NODE *createStackNodes(AST_NODE *head, STACK_NODE *next){
 
 }
 
+//*********************************
+// Environment Frames
+//*********************************
+
+#define MAX_ENV_FRAMES (1 << 14)
+#define MAX_ENV_CELLS (1 << 16)
+#define MAX_EVAL_DEPTH 10000
+
+// Frames live in a pool used as a stack: a frame is released when the eval()
+// that pushed it returns, or earlier when that eval() makes a tail call.
+// Every thread evaluates with its own pool.
+static _Thread_local ENV_FRAME envFrames[MAX_ENV_FRAMES];
+static _Thread_local ENV_CELL envCells[MAX_ENV_CELLS];
+static _Thread_local ENV_FRAME *frameTop;
+static _Thread_local ENV_CELL *cellTop;
+static _Thread_local int evalDepth;
+static _Thread_local bool stackOverflow; // abandons the rest of the program once set
+
+// Points the pool tops at this thread's pool on its first use.
+static inline void initFrames(void){
+    if(frameTop == NULL){
+        frameTop = envFrames;
+        cellTop = envCells;
+    }
+}
+
+ENV_FRAME *pushFrame(SCOPE *scope, ENV_FRAME *parent){
+    initFrames();
+    if(frameTop == envFrames + MAX_ENV_FRAMES || cellTop + scope->numSlots > envCells + MAX_ENV_CELLS){
+        fprintf(OUTPUT, "ERROR: stack overflow\n");
+        stackOverflow = true;
+        return NULL;
+    }
+
+    ENV_FRAME *frame = frameTop++;
+    frame->parent = parent;
+    frame->scope = scope;
+    frame->cells = cellTop;
+    cellTop += scope->numSlots;
+    for(int i = 0; i < scope->numSlots; i++){
+        frame->cells[i].ready = false;
+        frame->cells[i].forcing = false;
+    }
+    return frame;
+}
+
+// Releases top and every frame pushed after it.
+void popFrames(ENV_FRAME *top){
+    if(top < frameTop){
+        frameTop = top;
+        cellTop = top->cells;
+    }
+}
+
+// Returns the frame holding the binding at addr, or NULL if it is undeclared.
+ENV_FRAME *findFrame(ENV_FRAME *env, LEXICAL_ADDRESS *addr){
+    if(addr->depth < 0){
+        return NULL;
+    }
+
+    METRIC_ADD(lookups, 1);
+    METRIC_ADD(lookupDepth, addr->depth);
+    for(int depth = addr->depth; depth > 0 && env != NULL; depth--){
+        env = env->parent;
+    }
+    return env;
+}
+
+// Returns the value of a let binding or argument, evaluating a let binding
+// in its own frame the first time it is used. A binding that needs its own
+// value is an error, as in the VM and the session.
+RET_VAL forceCell(ENV_FRAME *frame, int slot){
+    ENV_CELL *cell = &frame->cells[slot];
+    if(!cell->ready){
+        SYMBOL_TABLE_NODE *symbol = frame->scope->slots[slot];
+        if(cell->forcing){
+            fprintf(OUTPUT, "ERROR: circular definition of %s\n", symbol->ident);
+            return NAN_VAL;
+        }
+        cell->forcing = true;
+        RET_VAL val = eval(symbol->val, frame);
+        cell->forcing = false;
+        cell->val = checkType(symbol->val_type, val, symbol->ident);
+        cell->ready = true;
+    }
+    return cell->val;
+}
+
 //*********************************
 // Evaluation Functions
 //*********************************
 
-// Evaluates an AST_NODE.
+// Evaluates the s_expr of a program with the selected evaluator.
+RET_VAL evalProgram(AST_NODE *node)
+{
+    prepareProgram(node, NULL);
+    return evalPrepared(node);
+}
+
+// Evaluates an s_expr that prepareProgram() already ran on, such as one
+// loaded from a program image, after the passes selected on the command line.
+RET_VAL evalPrepared(AST_NODE *node)
+{
+    if (jitEnabled)
+        jitProgram(node, &programArena);
+    cseProgram(node, NULL);
+    if (memoEnabled)
+        memoProgram(node, &programArena);
+
+    if (evalMode == TREE_EVAL_MODE || !node) {
+        stackOverflow = false;
+        return eval(node, NULL);
+    }
+
+    VM_PROGRAM *prog = vmCompile(node, NULL);
+    RET_VAL result = vmRun(prog, NULL);
+    vmFreeProgram(prog);
+    return result;
+}
+
+// Evaluates a resolved s_expr with the tree evaluator in an outer frame that
+// the caller has filled in, such as one row of input columns.
+RET_VAL evalInFrame(AST_NODE *node, ENV_FRAME *globals)
+{
+    stackOverflow = false;
+    return eval(node, globals);
+}
+
+// Evaluates an AST_NODE in the environment env.
 // returns a RET_VAL storing the the resulting value and type.
-// You'll need to update and expand eval (and the more specific eval functions below)
-// as the project develops.
-RET_VAL eval(AST_NODE *node)
+// Cond branches and lambda calls are evaluated in the same loop rather than
+// recursively, so tail calls run in constant C stack and frame pool space.
+RET_VAL eval(AST_NODE *node, ENV_FRAME *env)
 {
     if (!node){
-        printf("Invalid expression");
-        return (RET_VAL){INT_TYPE, NAN};
+        fprintf(OUTPUT, "Invalid expression");
+        return NAN_VAL;
     }
+    if (evalDepth == MAX_EVAL_DEPTH && !stackOverflow){
+        fprintf(OUTPUT, "ERROR: stack overflow\n");
+        stackOverflow = true;
+    }
+    if (stackOverflow)
+        return NAN_VAL;
 
+    RET_VAL result = NAN_VAL; // see NUM_AST_NODE, because RET_VAL is just an alternative name for it.
+    initFrames();
+    ENV_FRAME *mark = frameTop;
+    evalDepth++;
 
-    RET_VAL result = {INT_TYPE, NAN}; // see NUM_AST_NODE, because RET_VAL is just an alternative name for it.
-
-    // TODO complete the switch.
-    // Make calls to other eval functions based on node type.
-    // Use the results of those calls to populate result.
-    switch (node->type)
+    while (node != NULL)
     {
-        case NUM_NODE_TYPE:
-            result = evalNumNode(&node->data.number);
-            break;
-        case FUNC_NODE_TYPE:
-            result = evalFuncNode(&node->data.function);
+        if (node->scope != NULL && (env = pushFrame(node->scope, env)) == NULL)
             break;
-        case SYMBOL_NODE_TYPE:
-            //printf("Resolving Symbol ");
-            result = evalSymbolNode(node);
-            break;
-        case COND_NODE_TYPE:
-            result = evalConditionNode(&node->data.condition);
-            break;
-        default:
-            yyerror("Invalid AST_NODE_TYPE, probably invalid writes somewhere!");
+
+        switch (node->type)
+        {
+            case NUM_NODE_TYPE:
+                TRACE(TRACE_EVAL, "eval: number %lf\n", asDouble(node->data.number));
+                METRIC_ADD(nodeVisits[NUM_NODE_TYPE], 1);
+                result = evalNumNode(&node->data.number);
+                node = NULL;
+                break;
+            case FUNC_NODE_TYPE:
+                TRACE(TRACE_EVAL, "eval: call %s\n", node->data.function.oper == CUSTOM_OPER
+                      ? node->data.function.ident : funcNames[node->data.function.oper]);
+                METRIC_ADD(nodeVisits[FUNC_NODE_TYPE], 1);
+                if (node->data.function.oper == CUSTOM_OPER) {
+                    node = callCustomFunc(&node->data.function, &env, mark, &result);
+                }
+                else {
+                    METRIC_ADD(operCalls[node->data.function.oper], 1);
+                    result = evalFuncNode(&node->data.function, env);
+                    node = NULL;
+                }
+                break;
+            case SYMBOL_NODE_TYPE:
+                TRACE(TRACE_EVAL, "eval: symbol %s\n", node->data.symbol.ident);
+                METRIC_ADD(nodeVisits[SYMBOL_NODE_TYPE], 1);
+                result = evalSymbolNode(node, env);
+                node = NULL;
+                break;
+            case COND_NODE_TYPE:
+                TRACE(TRACE_EVAL, "eval: cond\n");
+                METRIC_ADD(nodeVisits[COND_NODE_TYPE], 1);
+                node = evalConditionNode(&node->data.condition, env);
+                break;
+            default:
+                yyerror("Invalid AST_NODE_TYPE, probably invalid writes somewhere!");
+                node = NULL;
+        }
     }
 
+    if (stackOverflow)
+        result = NAN_VAL;
+    popFrames(mark);
+    evalDepth--;
     return result;
-}  
+}
 
 // returns a pointer to the NUM_AST_NODE (aka RET_VAL) referenced by node.
 // DOES NOT allocate space for a new RET_VAL.
 RET_VAL evalNumNode(NUM_AST_NODE *numNode)
 {
     if (!numNode)
-        return (RET_VAL){INT_TYPE, NAN};
-
-    RET_VAL result = {INT_TYPE, NAN};
+        return NAN_VAL;
 
     // SEE: AST_NODE, AST_NODE_TYPE, NUM_AST_NODE
-    if(numNode->type == INT_TYPE){
-        result.type = INT_TYPE;
-        result.val  = floor(numNode->val);
+    if(numNode->isInt){
+        return *numNode;
     }
-    else{
-        result.type = DOUBLE_TYPE;
-        result.val  = numNode->val;
+    if(numNode->type == INT_TYPE){
+        return typedVal(INT_TYPE, floor(numNode->dval));
     }
-
-    return result;
+    return typedVal(DOUBLE_TYPE, numNode->dval);
 }
 
-RET_VAL evalFuncNode(FUNC_AST_NODE *funcNode)
+RET_VAL evalFuncNode(FUNC_AST_NODE *funcNode, ENV_FRAME *env)
 {
     if (!funcNode){
-        printf("Function not specified \n");
-        return (RET_VAL){INT_TYPE, NAN};
+        fprintf(OUTPUT, "Function not specified \n");
+        return NAN_VAL;
     }
-    RET_VAL result = {INT_TYPE, NAN};
+    RET_VAL result = NAN_VAL;
+    RET_VAL op[2];
 
     switch (funcNode->oper){
         case NEG_OPER :
-            funcNode->opList = resolveOneOp(funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = -funcNode->opList->data.number.val;
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveOneOp(funcNode, env, op)) return result;
+            result = numNeg(op[0]);
             break;
         case ABS_OPER:
-            funcNode->opList = resolveOneOp(funcNode->opList );
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = fabs(funcNode->opList->data.number.val);
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveOneOp(funcNode, env, op)) return result;
+            result = numAbs(op[0]);
             break;
         case EXP_OPER:
-            funcNode->opList = resolveOneOp(funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = exp(funcNode->opList->data.number.val);
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveOneOp(funcNode, env, op)) return result;
+            result = typedVal(op[0].type, exp(asDouble(op[0])));
             break;
         case SQRT_OPER:
-            funcNode->opList = resolveOneOp(funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = sqrt(funcNode->opList->data.number.val);
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveOneOp(funcNode, env, op)) return result;
+            result = typedVal(op[0].type, sqrt(asDouble(op[0])));
             break;
         case SUB_OPER:
-            funcNode->opList = resolveTwoOp(funcNode->oper, funcNode->opList );
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = funcNode->opList->data.number.val -
-                         funcNode->opList->next->data.number.val;
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveTwoOp(funcNode, env, op)) return result;
+            result = numSub(op[0].type, op[0], op[1]);
             break;
         case ADD_OPER:
-            funcNode->opList = resolveMultOp(funcNode->oper, funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            result = funcNode->opList->data.number;
-            break;
         case MULT_OPER:
-            funcNode->opList = resolveMultOp(funcNode->oper, funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            result = funcNode->opList->data.number;
+            resolveMultOp(funcNode, env, &result);
             break;
         case DIV_OPER:
-            if(funcNode->opList->next != NULL && funcNode->opList->next->data.number.val != 0) {
-                funcNode->opList = resolveTwoOp(funcNode->oper, funcNode->opList);
-                if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-                result.val = funcNode->opList->data.number.val /
-                             funcNode->opList->next->data.number.val;
-                result.type = funcNode->opList->data.number.type;
-            }
+            if(!resolveTwoOp(funcNode, env, op)) return result;
+            result = numDiv(op[0].type, op[0], op[1]);
             break;
         case REMAINDER_OPER:
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            if(funcNode->opList->next != NULL && funcNode->opList->next->data.number.val != 0) {
-                funcNode->opList = resolveTwoOp(funcNode->oper, funcNode->opList);
-                result.val = remainder(funcNode->opList->data.number.val ,
-                                       funcNode->opList->next->data.number.val);
-            }
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveTwoOp(funcNode, env, op)) return result;
+            result = numRemainder(op[0].type, op[0], op[1]);
             break;
         case LOG_OPER:
-            funcNode->opList = resolveOneOp(funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = log(funcNode->opList->data.number.val);
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveOneOp(funcNode, env, op)) return result;
+            result = typedVal(op[0].type, log(asDouble(op[0])));
             break;
         case POW_OPER:
-            funcNode->opList = resolveTwoOp(funcNode->oper, funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            if(checkOpNull(funcNode->opList->next)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = pow(funcNode->opList->data.number.val ,
-                             funcNode->opList->next->data.number.val);
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveTwoOp(funcNode, env, op)) return result;
+            result = typedVal(op[0].type, pow(asDouble(op[0]), asDouble(op[1])));
             break;
         case MAX_OPER:
-            funcNode->opList = resolveTwoOp(funcNode->oper, funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            if(checkOpNull(funcNode->opList->next)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = fmax(funcNode->opList->data.number.val ,
-                              funcNode->opList->next->data.number.val);
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveTwoOp(funcNode, env, op)) return result;
+            result = numMax(op[0].type, op[0], op[1]);
             break;
         case MIN_OPER:
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            funcNode->opList = resolveTwoOp(funcNode->oper, funcNode->opList);
-            result.val = fmin(funcNode->opList->data.number.val ,
-                              funcNode->opList->next->data.number.val);
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveTwoOp(funcNode, env, op)) return result;
+            result = numMin(op[0].type, op[0], op[1]);
             break;
         case EXP2_OPER:
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            funcNode->opList = resolveOneOp(funcNode->opList);
-            result.val = exp2(funcNode->opList->data.number.val);
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveOneOp(funcNode, env, op)) return result;
+            result = typedVal(op[0].type, exp2(asDouble(op[0])));
             break;
         case CBRT_OPER:
-            funcNode->opList = resolveOneOp(funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = cbrt(funcNode->opList->data.number.val);
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveOneOp(funcNode, env, op)) return result;
+            result = typedVal(op[0].type, cbrt(asDouble(op[0])));
             break;
         case HYPOT_OPER:
-            funcNode->opList = resolveTwoOp(funcNode->oper, funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            if(checkOpNull(funcNode->opList->next)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = hypot(funcNode->opList->data.number.val ,
-                               funcNode->opList->next->data.number.val);
-            result.type = funcNode->opList->data.number.type;
+            if(!resolveTwoOp(funcNode, env, op)) return result;
+            result = typedVal(op[0].type, hypot(asDouble(op[0]), asDouble(op[1])));
             break;
         case PRINT_OPER:
-            result = printExpr(funcNode->opList);
+            result = printExpr(funcNode, env);
             break;
         case READ_OPER:
-            result = *readVal();
+            result = readVal();
             break;
         case RAND_OPER:
             result = randVal();
             break;
         case EQUAL_OPER:
-            funcNode->opList = resolveTwoOp(funcNode->oper, funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            if(checkOpNull(funcNode->opList->next)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = (funcNode->opList->data.number.val == funcNode->opList->next->data.number.val);
+            if(!resolveTwoOp(funcNode, env, op)) return result;
+            result = numEqual(op[0], op[1]);
             break;
         case LESS_OPER:
-            funcNode->opList = resolveTwoOp(funcNode->oper, funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            if(checkOpNull(funcNode->opList->next)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = (funcNode->opList->data.number.val < funcNode->opList->next->data.number.val);
+            if(!resolveTwoOp(funcNode, env, op)) return result;
+            result = numLess(op[0], op[1]);
             break;
         case GREATER_OPER:
-            funcNode->opList = resolveTwoOp(funcNode->oper, funcNode->opList);
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            if(checkOpNull(funcNode->opList->next)) return (RET_VAL){INT_TYPE, NAN};
-            result.val = (funcNode->opList->data.number.val > funcNode->opList->next->data.number.val);
-            break;
-        case CUSTOM_OPER:
-            if(checkOpNull(funcNode->opList)) return (RET_VAL){INT_TYPE, NAN};
-            result = callCustomFunc(funcNode);
+            if(!resolveTwoOp(funcNode, env, op)) return result;
+            result = numGreater(op[0], op[1]);
             break;
         default:
-            printf("Invalid function or not implemented yet...");
+            fprintf(OUTPUT, "Invalid function or not implemented yet...");
             break;
     }
 
     return result;
 }
 
-RET_VAL evalSymbolNode(AST_NODE *node){
+RET_VAL evalSymbolNode(AST_NODE *node, ENV_FRAME *env){
     if(node == NULL){
-        return (RET_VAL){INT_TYPE, NAN};
+        return NAN_VAL;
     }
-    SYMBOL_TABLE_NODE *val = findSymbol(node->data.symbol.ident, node);
-    if(val == NULL){
-        printf("Symbol Not Declared: %s\n", node->data.symbol.ident);
-        return (RET_VAL){INT_TYPE, NAN};
+    if(node->data.symbol.addr.depth == SESSION_DEPTH){
+        return sessionValue(node->data.symbol.addr.slot, node->data.symbol.ident);
     }
-
-    if(val == NULL){
-        return (RET_VAL){INT_TYPE, NAN};
-    }
-    RET_VAL retVal;
-    if(val->val->type != NUM_NODE_TYPE){
-        retVal  = eval(val->val);
-        retVal = checkType(val->val_type, retVal, val->ident);
-        //(*node).data.number = retVal;
-        (*val).val->type = NUM_NODE_TYPE;
-        (*val).val->data.number.val = retVal.val;
-        (*val).val->data.number.type = retVal.type;
-
+    ENV_FRAME *frame = findFrame(env, &node->data.symbol.addr);
+    if(frame == NULL || frame->scope->slots[node->data.symbol.addr.slot]->type == LAMBDA_TYPE){
+        fprintf(OUTPUT, "Symbol Not Declared: %s\n", node->data.symbol.ident);
+        return NAN_VAL;
     }
-    else{
-        retVal.val = val->val->data.number.val;
-        retVal = checkType(val->val_type, retVal, val->ident);
 
-    }
-
-    return retVal;
+    return forceCell(frame, node->data.symbol.addr.slot);
 }
 
-RET_VAL evalConditionNode(COND_AST_NODE *condNode){
+// Returns the branch of the cond to evaluate next.
+AST_NODE *evalConditionNode(COND_AST_NODE *condNode, ENV_FRAME *env){
 
-    if(eval(condNode->cond).val != 0){
-        return eval(condNode->trueCond);
+    if(asDouble(eval(condNode->cond, env)) != 0){
+        return condNode->trueCond;
     }
     else{
-        return eval(condNode->falseCond);
+        return condNode->falseCond;
     }
 
 }
@@ -500,11 +779,10 @@ RET_VAL evalConditionNode(COND_AST_NODE *condNode){
 // Utility Functions
 //********************************
 
-AST_NODE *linkCustomFunc(AST_NODE *funcName, AST_NODE *funcData){
+AST_NODE *linkCustomFunc(AST_NODE *funcName, AST_LIST funcData){
 
-    AST_NODE *customFunc = createFunctionNode(funcName->data.symbol.ident, funcData);
+    AST_NODE *customFunc = createFunctionNode(CUSTOM_OPER, funcData);
     customFunc->data.function.ident = funcName->data.symbol.ident;
-    customFunc->data.function.opList->parent = customFunc;
 
     return customFunc;
 }
@@ -512,20 +790,20 @@ AST_NODE *linkCustomFunc(AST_NODE *funcName, AST_NODE *funcData){
 AST_NODE *linkSymbolTable(SYMBOL_TABLE_NODE *symbolNode, AST_NODE *node){
 
     if(node == NULL){
-        printf("Error: invalid or no s_expression\n");
+        fprintf(OUTPUT, "Error: invalid or no s_expression\n");
         return node;
     }
     if(symbolNode == NULL){
-        printf("Invalid Expression or Symbol\n");
+        fprintf(OUTPUT, "Invalid Expression or Symbol\n");
         return node;
     }
 
-    node->table = symbolNode;
-    SYMBOL_TABLE_NODE *temp = symbolNode;
-    while(temp != NULL){
-        temp->val->parent = node;
-        temp = temp->next;
+    // a node holds one let_list, so a let directly in another let's body
+    // gets a cond that always takes it to hold the outer let_list
+    if(node->table != NULL){
+        node = createConditionNode(createNumberNode(intVal(1)), node, createNumberNode(NAN_VAL));
     }
+    node->table = symbolNode;
     return node;
 }
 
@@ -538,263 +816,925 @@ SYMBOL_TABLE_NODE *addToSymbolTable(SYMBOL_TABLE_NODE *head, SYMBOL_TABLE_NODE *
     return newNode;
 }
 
-SYMBOL_TABLE_NODE *findSymbol(char *ident, AST_NODE *s_expr){
-    if(s_expr == NULL){
-        return NULL;
+//*********************************
+// Symbol Resolution
+//*********************************
+
+#define INTERN_MIN_CAP 64
+
+// Identifiers of the current program, deduplicated so symbols can be
+// compared by pointer. Lives in programArena and is cleared with it.
+typedef struct {
+    char **entries;
+    size_t cap;
+    size_t count;
+} INTERN_TABLE;
+
+static _Thread_local INTERN_TABLE internTable;
+
+static size_t hashIdent(const char *ident, size_t len){
+    size_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++){
+        hash = (hash ^ (unsigned char) ident[i]) * 16777619u;
     }
-    else if(s_expr->table == NULL && s_expr->parent != NULL){
-        s_expr->table = findSymbol(ident, s_expr->parent);
+    return hash;
+}
+
+// Returns the slot holding the len characters at ident, or the empty slot
+// they go in. NULL if the table could not grow.
+static char **findIdent(const char *ident, size_t len){
+    if(internTable.count * 2 >= internTable.cap){
+        size_t cap = internTable.cap ? internTable.cap * 2 : INTERN_MIN_CAP;
+        char **entries;
+        if((entries = arenaAlloc(&programArena, cap * sizeof(char *))) == NULL){
+            yyerror("Memory allocation failed!");
+            return NULL;
+        }
+        for(size_t i = 0; i < internTable.cap; i++){
+            if(internTable.entries[i] != NULL){
+                char *entry = internTable.entries[i];
+                size_t j = hashIdent(entry, strlen(entry)) & (cap - 1);
+                while(entries[j] != NULL){
+                    j = (j + 1) & (cap - 1);
+                }
+                entries[j] = entry;
+            }
+        }
+        internTable.entries = entries;
+        internTable.cap = cap;
     }
 
-    SYMBOL_TABLE_NODE *node = s_expr->table;
+    size_t i = hashIdent(ident, len) & (internTable.cap - 1);
+    while(internTable.entries[i] != NULL){
+        char *entry = internTable.entries[i];
+        if(strncmp(entry, ident, len) == 0 && entry[len] == '\0'){
+            break;
+        }
+        i = (i + 1) & (internTable.cap - 1);
+    }
+    return &internTable.entries[i];
+}
 
-    while (node != NULL && strcmp(ident, node->ident) != 0){
-        node = node->next;
+// Returns the canonical copy of ident for this program.
+char *internIdent(char *ident){
+    char **slot;
+    if((slot = findIdent(ident, strlen(ident))) == NULL){
+        return ident;
+    }
+    if(*slot == NULL){
+        *slot = ident;
+        internTable.count++;
     }
+    return *slot;
+}
+
+// Returns the canonical copy of the len characters at name, which is only
+// copied into programArena the first time the program uses it.
+char *internName(const char *name, size_t len){
+    char **slot;
+    if((slot = findIdent(name, len)) == NULL){
+        return arenaStrdup(&programArena, name, len);
+    }
+    if(*slot == NULL && (*slot = arenaStrdup(&programArena, name, len)) != NULL){
+        internTable.count++;
+    }
+    return *slot;
+}
+
+SCOPE *createScope(SYMBOL_TABLE_NODE *table, SCOPE *parent){
+    SCOPE *scope;
+    if((scope = arenaAlloc(&programArena, sizeof(SCOPE))) == NULL){
+        yyerror("Memory allocation failed!");
+        return parent;
+    }
+    scope->parent = parent;
 
-    if(node == NULL && s_expr->table != NULL){
-        node = s_expr->table->stack;
-        while (node != NULL && strcmp(ident, node->ident) != 0){
-            node = node->next;
+    for(SYMBOL_TABLE_NODE *temp = table; temp != NULL; temp = temp->next){
+        scope->numSlots++;
+    }
+    if((scope->slots = arenaAlloc(&programArena, scope->numSlots * sizeof(SYMBOL_TABLE_NODE *))) == NULL){
+        yyerror("Memory allocation failed!");
+        scope->numSlots = 0;
+        return scope;
+    }
+    int slot = 0;
+    for(SYMBOL_TABLE_NODE *temp = table; temp != NULL; temp = temp->next){
+        scope->slots[slot++] = temp;
+    }
+    return scope;
+}
+
+// Finds the binding of ident as seen from scope, then in the session, with
+// depth -1 if there is none.
+void resolveAddress(char *ident, SCOPE *scope, LEXICAL_ADDRESS *addr){
+    addr->depth = 0;
+    for(SCOPE *temp = scope; temp != NULL; temp = temp->parent, addr->depth++){
+        for(addr->slot = 0; addr->slot < temp->numSlots; addr->slot++){
+            if(temp->slots[addr->slot]->ident == ident){
+                return;
+            }
         }
     }
+    addr->slot = sessionLookup(ident);
+    addr->depth = addr->slot < 0 ? -1 : SESSION_DEPTH;
+}
+
+static void resolveNode(AST_NODE *node, SCOPE *scope){
     if(node == NULL){
-        node = findSymbol(ident, s_expr->parent);
+        return;
+    }
+
+    // let bindings see their own let_list, lambda bodies see their arg_list first
+    if(node->table != NULL){
+        scope = node->scope = createScope(node->table, scope);
+        for(SYMBOL_TABLE_NODE *temp = node->table; temp != NULL; temp = temp->next){
+            if(temp->type == LAMBDA_TYPE){
+                temp->scope = createScope(temp->stack, scope);
+                resolveNode(temp->val, temp->scope);
+            }
+            else{
+                resolveNode(temp->val, scope);
+            }
+        }
+    }
+
+    switch (node->type){
+        case SYMBOL_NODE_TYPE:
+            resolveAddress(node->data.symbol.ident, scope, &node->data.symbol.addr);
+            break;
+        case FUNC_NODE_TYPE:
+            if(node->data.function.oper == CUSTOM_OPER){
+                resolveAddress(node->data.function.ident, scope, &node->data.function.addr);
+            }
+            for(int i = 0; i < node->data.function.numOps; i++){
+                resolveNode(node->data.function.ops[i], scope);
+            }
+            break;
+        case COND_NODE_TYPE:
+            resolveNode(node->data.condition.cond, scope);
+            resolveNode(node->data.condition.trueCond, scope);
+            resolveNode(node->data.condition.falseCond, scope);
+            break;
+        default:
+            break;
     }
-    return node;
 }
 
-// Called after execution is done on the base of the tree.
-// (see the program production in ciLisp.y)
-// Recursively frees the whole abstract syntax tree.
-// You'll need to update and expand freeNode as the project develops.
-void freeNode(AST_NODE *node)
-{
-    if (!node)
+// Binds every symbol reference of a parsed program to the let_list or
+// arg_list entry it refers to, so evaluation never compares strings.
+// globals, if not NULL, is an outermost scope that the program is evaluated in.
+void resolveProgram(AST_NODE *root, SCOPE *globals){
+    resolveNode(root, globals);
+}
+
+static void rebindNode(AST_NODE *node, SCOPE *scope){
+    if(node == NULL){
         return;
+    }
 
-    if (node->type == FUNC_NODE_TYPE && node->data.function.opList != NULL)
-    {
-        // Recursive calls to free child nodes
-        freeNode(node->data.function.opList->next);
+    if(node->scope != NULL){
+        node->scope->parent = scope;
+        scope = node->scope;
+        for(SYMBOL_TABLE_NODE *temp = node->table; temp != NULL; temp = temp->next){
+            if(temp->type != LAMBDA_TYPE){
+                rebindNode(temp->val, scope);
+            }
+            else if(temp->scope != NULL){
+                temp->scope->parent = scope;
+                rebindNode(temp->val, temp->scope);
+            }
+        }
+    }
 
-        // Free up identifier string if necessary
-        if (node->data.function.oper == CUSTOM_OPER)
-        {
-            free(node->data.function.ident);
+    switch (node->type){
+        case SYMBOL_NODE_TYPE:
+            resolveAddress(node->data.symbol.ident, scope, &node->data.symbol.addr);
+            break;
+        case FUNC_NODE_TYPE:
+            if(node->data.function.oper == CUSTOM_OPER){
+                resolveAddress(node->data.function.ident, scope, &node->data.function.addr);
+            }
+            for(int i = 0; i < node->data.function.numOps; i++){
+                rebindNode(node->data.function.ops[i], scope);
+            }
+            break;
+        case COND_NODE_TYPE:
+            rebindNode(node->data.condition.cond, scope);
+            rebindNode(node->data.condition.trueCond, scope);
+            rebindNode(node->data.condition.falseCond, scope);
+            break;
+        default:
+            break;
+    }
+}
+
+// Points every reference of a resolved program at its binding again once
+// bindings were added to or removed from its scopes. The existing scopes are
+// kept and relinked, so scopes that were added or dropped are accounted for.
+void rebindProgram(AST_NODE *root, SCOPE *globals){
+    rebindNode(root, globals);
+}
+
+// Releases everything allocated for the current program.
+void releaseProgram(void){
+    arenaReset(&programArena);
+    memset(&internTable, 0, sizeof(internTable));
+}
+
+//*********************************
+// Constant Folding
+//*********************************
+
+// Operators whose result depends only on their operands.
+static bool isPureOper(OPER_TYPE oper){
+    return oper != READ_OPER && oper != RAND_OPER && oper != PRINT_OPER && oper != CUSTOM_OPER;
+}
+
+// Turns node into a number node holding val. Fails for INT_TYPE values with a
+// fraction, such as (div 7 2), since number nodes floor their int values.
+static bool foldToNumber(AST_NODE *node, RET_VAL val){
+    if(val.type == INT_TYPE && !val.isInt && val.dval != floor(val.dval) && !isnan(val.dval)){
+        return false;
+    }
+    node->type = NUM_NODE_TYPE;
+    node->data.number = val;
+    node->scope = NULL; // the let_list is never used again
+    return true;
+}
+
+static void foldNode(AST_NODE *node, SCOPE *scope, bool keepSymbol);
+
+// Replaces a reference to a let binding that folded to a number with the
+// number itself, unless the assignment would warn about precision loss.
+static void foldSymbol(AST_NODE *node, SCOPE *scope){
+    LEXICAL_ADDRESS *addr = &node->data.symbol.addr;
+    if(addr->depth < 0){
+        return;
+    }
+    for(int depth = addr->depth; depth > 0; depth--){
+        scope = scope->parent;
+    }
+
+    SYMBOL_TABLE_NODE *symbol = scope->slots[addr->slot];
+    if(symbol->type != VARIABLE_TYPE || symbol->val == NULL || symbol->val->type != NUM_NODE_TYPE){
+        return;
+    }
+    RET_VAL val = evalNumNode(&symbol->val->data.number);
+    if(symbol->val_type == INT_TYPE && !val.isInt && val.dval != (long)val.dval){
+        return;
+    }
+    foldToNumber(node, checkType(symbol->val_type, val, symbol->ident));
+}
+
+// Folds the leading constant operands of add or mult into the first one.
+// Only a prefix is folded so the values are combined in the same order as at run time.
+static void foldMultOp(FUNC_AST_NODE *func, AST_NODE *node){
+    if(func->numOps < 2 || func->ops[0]->type != NUM_NODE_TYPE){
+        return;
+    }
+
+    RET_VAL result = evalNumNode(&func->ops[0]->data.number);
+    int rest = 1;
+    for(; rest < func->numOps && func->ops[rest]->type == NUM_NODE_TYPE; rest++){
+        RET_VAL retVal = evalNumNode(&func->ops[rest]->data.number);
+        NUM_TYPE type = retVal.type == DOUBLE_TYPE ? DOUBLE_TYPE : result.type;
+        result = func->oper == ADD_OPER ? numAdd(type, result, retVal) : numMult(type, result, retVal);
+    }
+
+    if(rest == func->numOps){
+        foldToNumber(node, result);
+    }
+    else if(rest > 1 && foldToNumber(func->ops[0], result)){
+        memmove(&func->ops[1], &func->ops[rest], (func->numOps - rest) * sizeof(AST_NODE *));
+        func->numOps -= rest - 1;
+    }
+}
+
+static void foldFunction(AST_NODE *node){
+    FUNC_AST_NODE *func = &node->data.function;
+    if(!isPureOper(func->oper)){
+        return;
+    }
+    if(func->oper == ADD_OPER || func->oper == MULT_OPER){
+        foldMultOp(func, node);
+        return;
+    }
+
+    // the runtime messages about operand counts still appear
+    if(!validOperandCount(func->oper, func->numOps)){
+        return;
+    }
+    for(int i = 0; i < operArity(func->oper); i++){
+        if(func->ops[i]->type != NUM_NODE_TYPE){
+            return;
+        }
+    }
+    foldToNumber(node, evalFuncNode(func, NULL));
+}
+
+// Replaces a cond whose condition is constant with the branch it selects.
+static void foldCondition(AST_NODE *node){
+    COND_AST_NODE *cond = &node->data.condition;
+    if(cond->cond->type != NUM_NODE_TYPE){
+        return;
+    }
+    AST_NODE *branch = asDouble(evalNumNode(&cond->cond->data.number)) != 0 ? cond->trueCond : cond->falseCond;
+
+    if(node->table == NULL){
+        node->table = branch->table;
+        node->scope = branch->scope;
+    }
+    else if(branch->table != NULL){
+        return; // both have a let_list, which one node cannot hold
+    }
+    node->type = branch->type;
+    memcpy(&node->data, &branch->data, astNodeSize(branch->type) - offsetof(AST_NODE, data));
+}
+
+static void foldNode(AST_NODE *node, SCOPE *scope, bool keepSymbol){
+    if(node == NULL){
+        return;
+    }
+
+    // bindings first, in source order, so later ones and the body see their values
+    if(node->table != NULL){
+        scope = node->scope;
+        for(int slot = scope->numSlots - 1; slot >= 0; slot--){
+            SYMBOL_TABLE_NODE *temp = scope->slots[slot];
+            foldNode(temp->val, temp->type == LAMBDA_TYPE ? temp->scope : scope, false);
+        }
+    }
+
+    switch (node->type){
+        case SYMBOL_NODE_TYPE:
+            if(!keepSymbol){
+                foldSymbol(node, scope);
+            }
+            break;
+        case FUNC_NODE_TYPE:
+            // print shows the names of symbols it is given, so keep those
+            for(int i = 0; i < node->data.function.numOps; i++){
+                foldNode(node->data.function.ops[i], scope, node->data.function.oper == PRINT_OPER);
+            }
+            foldFunction(node);
+            break;
+        case COND_NODE_TYPE:
+            foldNode(node->data.condition.cond, scope, false);
+            foldNode(node->data.condition.trueCond, scope, false);
+            foldNode(node->data.condition.falseCond, scope, false);
+            foldCondition(node);
+            break;
+        default:
+            break;
+    }
+}
+
+// Evaluates the constant parts of a resolved program ahead of time: pure
+// operators on numbers, references to let bindings that are numbers, and
+// conds with a constant condition. Must run after resolveProgram().
+void foldProgram(AST_NODE *root, SCOPE *globals){
+    foldNode(root, globals, false);
+}
+
+//*********************************
+// Dead Bindings
+//*********************************
+
+static void markNode(AST_NODE *node, SCOPE *scope);
+
+// Marks the binding at addr as used, and everything its value uses.
+static void markAddress(LEXICAL_ADDRESS *addr, SCOPE *scope){
+    if(addr->depth < 0){
+        return;
+    }
+    for(int depth = addr->depth; depth > 0 && scope != NULL; depth--){
+        scope = scope->parent;
+    }
+    if(scope == NULL){
+        return;
+    }
+
+    SYMBOL_TABLE_NODE *sym = scope->slots[addr->slot];
+    if(sym->live){
+        return;
+    }
+    sym->live = true;
+    markNode(sym->val, sym->type == LAMBDA_TYPE ? sym->scope : scope);
+}
+
+// Marks the bindings that node refers to. Bindings of its let_list are only
+// visited through references, so values nothing refers to are never marked.
+static void markNode(AST_NODE *node, SCOPE *scope){
+    if(node == NULL){
+        return;
+    }
+    if(node->table != NULL && node->scope == NULL){
+        return; // folded to a number, its bindings are never evaluated
+    }
+    if(node->scope != NULL){
+        scope = node->scope;
+    }
+
+    switch (node->type){
+        case SYMBOL_NODE_TYPE:
+            markAddress(&node->data.symbol.addr, scope);
+            break;
+        case FUNC_NODE_TYPE:
+            if(node->data.function.oper == CUSTOM_OPER){
+                markAddress(&node->data.function.addr, scope);
+            }
+            for(int i = 0; i < node->data.function.numOps; i++){
+                markNode(node->data.function.ops[i], scope);
+            }
+            break;
+        case COND_NODE_TYPE:
+            markNode(node->data.condition.cond, scope);
+            markNode(node->data.condition.trueCond, scope);
+            markNode(node->data.condition.falseCond, scope);
+            break;
+        default:
+            break;
+    }
+}
+
+// Unlinks the unmarked bindings of every let_list that node and the marked
+// bindings reach, compacting their scopes. A let_list left empty is removed.
+static int sweepNode(AST_NODE *node){
+    if(node == NULL || (node->table != NULL && node->scope == NULL)){
+        return 0;
+    }
+
+    int dropped = 0;
+    if(node->scope != NULL){
+        SCOPE *scope = node->scope;
+        SYMBOL_TABLE_NODE **link = &node->table;
+        int kept = 0;
+        for(int slot = 0; slot < scope->numSlots; slot++){
+            SYMBOL_TABLE_NODE *temp = scope->slots[slot];
+            if(!temp->live){
+                dropped++;
+                continue;
+            }
+            scope->slots[kept++] = temp;
+            *link = temp;
+            link = &temp->next;
+            dropped += sweepNode(temp->val);
+        }
+        *link = NULL;
+        scope->numSlots = kept;
+        if(kept == 0){
+            node->table = NULL;
+            node->scope = NULL;
+        }
+    }
+
+    switch (node->type){
+        case FUNC_NODE_TYPE:
+            for(int i = 0; i < node->data.function.numOps; i++){
+                dropped += sweepNode(node->data.function.ops[i]);
+            }
+            break;
+        case COND_NODE_TYPE:
+            dropped += sweepNode(node->data.condition.cond);
+            dropped += sweepNode(node->data.condition.trueCond);
+            dropped += sweepNode(node->data.condition.falseCond);
+            break;
+        default:
+            break;
+    }
+    return dropped;
+}
+
+// Removes the let bindings that the body of a resolved and folded program
+// can never evaluate: ones nothing refers to, including the ones only other
+// removed bindings refer to, and the ones whose references were all folded.
+// Bindings are forced lazily, so a removed binding never ran even if it
+// would read or print.
+void dropDeadBindings(AST_NODE *root, SCOPE *globals){
+    markNode(root, globals);
+    int dropped = sweepNode(root);
+    if(dropped > 0){
+        TRACE(TRACE_EVAL, "dead bindings: %d dropped\n", dropped);
+        rebindProgram(root, globals);
+    }
+}
+
+// Runs the passes that do not depend on the command line settings: symbol
+// resolution, constant folding and dead binding removal.
+void prepareProgram(AST_NODE *root, SCOPE *globals){
+    resolveProgram(root, globals);
+    foldProgram(root, globals);
+    dropDeadBindings(root, globals);
+}
+
+//*********************************
+// Compiled Programs
+//*********************************
+
+// Set while compileProgram() runs the parser, so the program rule hands the
+// AST over instead of evaluating and releasing it.
+static _Thread_local CILISP_PROGRAM *pendingProgram;
+static _Thread_local const CILISP_OPTIONS *pendingOptions;
+
+// Called by the program rule for every parsed s_expr.
+void programParsed(AST_NODE *root){
+    if(pendingProgram != NULL){
+        pendingProgram->root = root;
+        return;
+    }
+    if(imageCompiling){
+        imageAddProgram(root);
+        releaseProgram();
+        return;
+    }
+    runProgram(root, false);
+}
+
+// Evaluates and prints a program, then releases it. prepared programs were
+// already run through prepareProgram(), like the ones of a program image.
+void runProgram(AST_NODE *root, bool prepared){
+    double start = metricsEnabled ? metricsNow() : 0;
+    if(root != NULL && columnTable != NULL){
+        evalColumns(columnTable, root);
+        metricsProgramDone(start);
+    }
+    else if(root != NULL){
+        printRetVal(prepared ? evalPrepared(root) : evalProgram(root));
+        metricsProgramDone(start);
+        if(batchMode){
+            outputChar('\n');
+        }
+    }
+    releaseProgram();
+    metricsPoll();
+}
+
+// Called by the define rule. The session takes over the program arena
+// with the definitions, compileProgram() leaves it empty.
+void programDefined(SYMBOL_TABLE_NODE *defs){
+    if(imageCompiling){
+        fprintf(OUTPUT, "ERROR: define cannot be compiled into a program image\n");
+    }
+    else if(sessionDisabled){
+        fprintf(OUTPUT, "ERROR: define is not supported with --threads\n");
+    }
+    else if(pendingProgram != NULL){
+        sessionDefine(defs, pendingOptions);
+        return;
+    }
+    else{
+        CILISP_OPTIONS options = {evalMode, jitEnabled, memoEnabled, NULL, numberFormat};
+        sessionDefine(defs, &options);
+    }
+    releaseProgram();
+    metricsPoll();
+}
+
+// Called by the error rule once a malformed line was skipped: what was
+// parsed of it is dropped, like the s_expr compileProgram() had so far.
+void programFailed(void){
+    if(pendingProgram != NULL){
+        // the arena goes with the program, which is freed on failure
+        pendingProgram->root = NULL;
+        return;
+    }
+    releaseProgram();
+}
+
+// Called by the quit rule: ends the process, unless compileProgram() is
+// running the parser, where quit is just not a program. A program image
+// being compiled ends with the programs before it.
+void programQuit(void){
+    if(imageCompiling){
+        imageQuit();
+    }
+    else if(pendingProgram == NULL){
+        exit(EXIT_SUCCESS);
+    }
+}
+
+// Parses and resolves one s_expr with the command line settings.
+CILISP_PROGRAM *compileProgram(char *source){
+    CILISP_OPTIONS options = {evalMode, jitEnabled, memoEnabled, NULL, numberFormat};
+    return compileWithOptions(source, &options, NULL, 0);
+}
+
+// Binds names, in order, in an outermost scope of the program being compiled.
+static SCOPE *createGlobals(const char *const *names, int numNames){
+    SYMBOL_TABLE_NODE *table = NULL;
+    for(int i = numNames - 1; i >= 0; i--){
+        SYMBOL_TABLE_NODE *symbol;
+        if((symbol = arenaAlloc(&programArena, sizeof(SYMBOL_TABLE_NODE))) == NULL){
+            yyerror("Memory allocation failed!");
+            return NULL;
+        }
+        symbol->type = VARIABLE_TYPE;
+        symbol->val_type = NO_TYPE;
+        symbol->ident = internIdent(arenaStrdup(&programArena, names[i], strlen(names[i])));
+        table = addToSymbolTable(table, symbol);
+    }
+    return createScope(table, NULL);
+}
+
+// Parses and resolves one s_expr (and compiles it for the VM in VM_EVAL_MODE)
+// so that evalCompiled() can run it any number of times. Symbols it leaves
+// free may be among names, which evalWithBindings() gives values.
+// Returns NULL if source does not contain a valid s_expr.
+CILISP_PROGRAM *compileWithOptions(char *source, const CILISP_OPTIONS *options, const char *const *names, int numNames){
+    CILISP_PROGRAM *program;
+    size_t len = strlen(source);
+    char *line;
+    if((program = calloc(sizeof(CILISP_PROGRAM), 1)) == NULL || (line = malloc(len + 2)) == NULL){
+        yyerror("Memory allocation failed!");
+        free(program);
+        return NULL;
+    }
+    // the grammar needs the EOL that ends a REPL line
+    memcpy(line, source, len);
+    line[len] = '\n';
+    line[len + 1] = '\0';
+
+    // parse into a fresh arena and intern table that the program keeps
+    ARENA savedArena = programArena;
+    INTERN_TABLE savedIntern = internTable;
+    programArena = (ARENA){0};
+    memset(&internTable, 0, sizeof(internTable));
+
+    pendingProgram = program;
+    pendingOptions = options;
+    parseString(line);
+    pendingProgram = NULL;
+    free(line);
+
+    if(program->root != NULL && numNames > 0 && (program->globals = createGlobals(names, numNames)) == NULL){
+        program->root = NULL;
+    }
+    if(program->root != NULL){
+        prepareProgram(program->root, program->globals);
+        if(options->jit){
+            jitProgram(program->root, &programArena);
+        }
+        cseProgram(program->root, program->globals);
+        if(options->memo){
+            memoProgram(program->root, &programArena);
+        }
+        if(options->mode == VM_EVAL_MODE){
+            program->vm = vmCompile(program->root, program->globals);
+        }
+        // its session entries only mean something in this thread's session
+        if(sessionReferenced(program->root)){
+            program->session = sessionId();
+            program->generation = sessionGeneration();
         }
     }
 
-    free(node);
+    program->arena = programArena;
+    programArena = savedArena;
+    internTable = savedIntern;
+
+    if(program->root == NULL){
+        freeProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+// Parses source for defines and installs them in the session of the calling
+// thread with options. Returns false if nothing was defined.
+bool defineWithOptions(char *source, const CILISP_OPTIONS *options){
+    unsigned long generation = sessionGeneration();
+    freeProgram(compileWithOptions(source, options, NULL, 0));
+    return sessionGeneration() != generation;
+}
+
+// Evaluates a compiled program. The AST is never modified by evaluation,
+// so each call starts from the same state and sees fresh read and rand values.
+RET_VAL evalCompiled(CILISP_PROGRAM *program){
+    return evalWithBindings(program, NULL);
+}
+
+// Evaluates a compiled program with values[i] as the value of the i-th name
+// it was compiled with. values may be NULL if there were none.
+RET_VAL evalWithBindings(CILISP_PROGRAM *program, const RET_VAL *values){
+    if(program->session != 0 && program->session != sessionId()){
+        fprintf(OUTPUT, "ERROR: program refers to the session of another thread or one that was released\n");
+        return NAN_VAL;
+    }
+    // the VM binds session lambdas when it compiles, so after a define it
+    // compiles again to call the current definitions like the tree evaluator
+    if(program->vm != NULL && program->session != 0 && program->generation != sessionGeneration()){
+        vmFreeProgram(program->vm);
+        program->vm = vmCompile(program->root, program->globals);
+        program->generation = sessionGeneration();
+    }
+
+    double start = metricsEnabled ? metricsNow() : 0;
+    RET_VAL result;
+    if(program->vm != NULL){
+        result = vmRun(program->vm, values);
+    }
+    else if(program->globals != NULL){
+        ENV_FRAME *globals = pushFrame(program->globals, NULL);
+        if(globals == NULL){
+            return NAN_VAL;
+        }
+        for(int i = 0; i < program->globals->numSlots; i++){
+            globals->cells[i] = (ENV_CELL){values[i], true};
+        }
+        result = evalInFrame(program->root, globals);
+        popFrames(globals);
+    }
+    else{
+        stackOverflow = false;
+        result = eval(program->root, NULL);
+    }
+    metricsProgramDone(start);
+    return result;
+}
+
+void freeProgram(CILISP_PROGRAM *program){
+    if(program == NULL){
+        return;
+    }
+    vmFreeProgram(program->vm);
+    arenaFree(&program->arena);
+    free(program);
 }
 
 // prints the type and value of a RET_VAL
 void printRetVal(RET_VAL val)
 {
     if (val.type == INT_TYPE){
-        //int printVal =
-        printf("INT_TYPE: %.f", round(val.val ));
+        outputString("INT_TYPE: ");
+        if(!val.isInt){
+            val.dval = round(val.dval);
+        }
+        outputInt(val);
     }
     else if(val.type == DOUBLE_TYPE){
-        printf("DOUBLE_TYPE: %.2f", val.val );
+        outputString("DOUBLE_TYPE: ");
+        outputDouble(asDouble(val));
     }
     else {
-        printf("NO_TYPE: %.f", val.val );
+        outputString("NO_TYPE: ");
+        outputInt(typedVal(NO_TYPE, asDouble(val)));
     }
 
 }
 
-RET_VAL printSymbol(AST_NODE *symASTNode){
-    RET_VAL result = {INT_TYPE, NAN};
+RET_VAL printSymbol(AST_NODE *symASTNode, ENV_FRAME *env){
+    RET_VAL result = NAN_VAL;
 
-    SYMBOL_TABLE_NODE *symbol  = findSymbol(symASTNode->data.symbol.ident, symASTNode->parent);
+    LEXICAL_ADDRESS *addr = &symASTNode->data.symbol.addr;
+    ENV_FRAME *frame = findFrame(env, addr);
+    SYMBOL_TABLE_NODE *symbol = NULL;
+    if(addr->depth == SESSION_DEPTH){
+        symbol = sessionSymbol(addr->slot);
+    }
+    else if(frame != NULL){
+        symbol = frame->scope->slots[addr->slot];
+    }
     if(symbol == NULL){
-        printf("Symbol Not Declared: %s\n", symASTNode->data.symbol.ident);
-        return (RET_VAL){INT_TYPE, NAN};
+        fprintf(OUTPUT, "Symbol Not Declared: %s\n", symASTNode->data.symbol.ident);
+        return NAN_VAL;
     }
-    result = eval(symbol->val);
-    result = checkType(symbol->val_type, result, symbol->ident);
+    result = evalSymbolNode(symASTNode, env);
 
+    outputString("Symbol: ");
+    outputString(symbol->ident);
+    outputString(" = ");
     if(symbol->val_type == INT_TYPE){
-        printf("Symbol: %s = %.f ", symbol->ident, result.val);
+        outputInt(result);
     }
     else{
-        printf("Symbol: %s = %.2f ", symbol->ident, result.val);
+        outputDouble(asDouble(result));
     }
+    outputChar(' ');
 
     return result;
 }
 
-RET_VAL printExpr(AST_NODE *node){
-    if (!node)
-        return (RET_VAL){INT_TYPE, NAN};
-
-    RET_VAL result = {INT_TYPE, NAN};
-    AST_NODE *iterator = node;
-    printf("=> ");
+RET_VAL printExpr(FUNC_AST_NODE *func, ENV_FRAME *env){
+    if (func->numOps == 0)
+        return NAN_VAL;
 
-    while (iterator != NULL){
+    RET_VAL result = NAN_VAL;
+    outputString("=> ");
 
+    for (int i = 0; i < func->numOps; i++){
+        AST_NODE *iterator = func->ops[i];
         if (iterator->type == SYMBOL_NODE_TYPE){
-            result = printSymbol(iterator);
+            result = printSymbol(iterator, env);
         }
         else{
-            result = eval(iterator);
+            result = eval(iterator, env);
+            outputString("Number: ");
             if(result.type == INT_TYPE){
-                printf("Number: %.f ", result.val);
+                outputInt(result);
             }
             else{
-                printf("Number: %.2f ", result.val);
+                outputDouble(asDouble(result));
             }
+            outputChar(' ');
         }
-        iterator = iterator->next;
     }
-    printf("\n");
+    outputChar('\n');
 
     return result;
 }
 
-RET_VAL *readVal(){
+RET_VAL readVal(){
     double input;
-    printf("read ::= ");
+    fprintf(OUTPUT, "read ::= ");
     scanf("%lf", &input);
-    RET_VAL *node;
-
-    size_t nodeSize;
-
-    // allocate space for the fixed sie and the variable part (union)
-    nodeSize = sizeof(RET_VAL);
-    if ((node = calloc(nodeSize, 1)) == NULL)
-        yyerror("Memory allocation failed!");
-
     //if the entered value includes a dot, then the type of the variable should be set to double
     if(input != (long)input){
-        node->type = DOUBLE_TYPE;
-        node->val = input;
+        return typedVal(DOUBLE_TYPE, input);
     }
-    else{
-        node->type = INT_TYPE;
-        node->val = floor(input);
-    }
-
-    return node;
+    return typedVal(INT_TYPE, floor(input));
 }
 
 //*********************************
 // HELPER FUNCTIONS
 //*********************************
 
-AST_NODE *resolveOneOp(AST_NODE *op){
-    RET_VAL retVal = {INT_TYPE, NAN};
-    if(op == NULL){
-        printf("No arguments given\n");
-        return NULL;
-    }
-    if(op->next != NULL){
-        printf("Too many arguments: Taking first val\n");
-        return op;
+// Evaluates the operand of a unary function into val.
+// Returns false if there is no operand.
+bool resolveOneOp(FUNC_AST_NODE *func, ENV_FRAME *env, RET_VAL *val){
+    if(func->numOps == 0){
+        fprintf(OUTPUT, "No arguments given\n");
+        return false;
     }
-    if(op->type != NUM_NODE_TYPE){
-        retVal = eval(op);
-        op->data.number = retVal;
+    if(func->numOps > 1){
+        fprintf(OUTPUT, "Too many arguments: Taking first val\n");
     }
-    return op;
+    *val = eval(func->ops[0], env);
+    return true;
 }
 
-AST_NODE *resolveTwoOp(OPER_TYPE type, AST_NODE *op){
-    RET_VAL retVal = {INT_TYPE, NAN};
-    if(op == NULL){
-        printf("ERROR: too few parameters for the function %s\n", funcNames[type]);
-        return NULL;
-    }
-    if(op->next == NULL){
-        printf("ERROR: too few parameters for the function %s\n", funcNames[type]);
-        return NULL;
-    }
-    if(op->type != NUM_NODE_TYPE){
-        retVal = eval(op);
-        op->data.number.val = retVal.val;
-        op->data.number.type = retVal.type;
-    }
-    if(op->next->type != NUM_NODE_TYPE){
-        retVal = eval(op->next);
-        op->next->data.number.type = retVal.type;
-        op->next->data.number.val = retVal.val;
+// Evaluates the two operands of a binary function into vals.
+// The first value's type is promoted to DOUBLE_TYPE if either operand is a double.
+// Returns false if there are too few operands.
+bool resolveTwoOp(FUNC_AST_NODE *func, ENV_FRAME *env, RET_VAL vals[2]){
+    if(func->numOps < 2){
+        fprintf(OUTPUT, "ERROR: too few parameters for the function %s\n", funcNames[func->oper]);
+        return false;
     }
-    if(op->data.number.type == DOUBLE_TYPE || op->next->data.number.type == DOUBLE_TYPE){
-        op->data.number.type = DOUBLE_TYPE;
+    vals[0] = eval(func->ops[0], env);
+    vals[1] = eval(func->ops[1], env);
+    if(vals[0].type == DOUBLE_TYPE || vals[1].type == DOUBLE_TYPE){
+        vals[0] = castVal(DOUBLE_TYPE, vals[0]);
     }
     else{
-        op->data.number.type = INT_TYPE;
+        vals[0] = castVal(INT_TYPE, vals[0]);
     }
-    return op;
+    return true;
 }
 
-AST_NODE *resolveMultOp(OPER_TYPE type, AST_NODE *opList){
-    RET_VAL retVal = {INT_TYPE, NAN};
-    if(opList == NULL ){
-        printf("ERROR: too few parameters for the function %s\n", funcNames[type]);
-        return NULL;
+// Folds add or mult over the whole operand list into result.
+// Returns false if there are too few operands.
+bool resolveMultOp(FUNC_AST_NODE *func, ENV_FRAME *env, RET_VAL *result){
+    if(func->numOps < 2){
+        fprintf(OUTPUT, "ERROR: too few parameters for the function %s\n", funcNames[func->oper]);
+        return false;
     }
 
-    AST_NODE *iterator = opList;
-
-    if(iterator->next == NULL){
-        printf("ERROR: too few parameters for the function %s\n", funcNames[type]);
-        return NULL;
-    }
-    retVal = eval(iterator);
-    iterator->data.number.val = retVal.val;
-    iterator->data.number.type = retVal.type;
-    iterator = iterator->next;
-    while (iterator != NULL){
-        if(iterator->type != NUM_NODE_TYPE){
-            retVal = eval(iterator);
-            iterator->data.number.val = retVal.val;
-            iterator->data.number.type = retVal.type;
-        }
-        switch (type){
+    *result = eval(func->ops[0], env);
+    for(int i = 1; i < func->numOps; i++){
+        RET_VAL retVal = eval(func->ops[i], env);
+        NUM_TYPE resultType = retVal.type == DOUBLE_TYPE ? DOUBLE_TYPE : result->type;
+        switch (func->oper){
             case ADD_OPER:
-                (*opList).data.number.val += iterator->data.number.val;
-                if(iterator->data.number.type == DOUBLE_TYPE){
-                    opList->data.number.type = iterator->data.number.type;
-                }
+                *result = numAdd(resultType, *result, retVal);
                 break;
             case MULT_OPER:
-                opList->data.number.val *= iterator->data.number.val;
-                if(iterator->data.number.type == DOUBLE_TYPE){
-                    opList->data.number.type = iterator->data.number.type;
-                }
+                *result = numMult(resultType, *result, retVal);
                 break;
             default:
-                printf("should not be here\n");
-
+                fprintf(OUTPUT, "should not be here\n");
         }
-        iterator = iterator->next;
     }
 
-    return opList;
+    return true;
 }
 
 RET_VAL randVal(){
     if(arc4random_uniform(2) == 0){
-        return (RET_VAL){INT_TYPE, 0};
+        return intVal(0);
     }
     else{
-        return (RET_VAL){INT_TYPE, 1};
+        return intVal(1);
     }
 }
 
 RET_VAL checkType(NUM_TYPE givenType, RET_VAL val, char *var){
     if(givenType == DOUBLE_TYPE){
-        val.type = DOUBLE_TYPE;
-        return val;
+        return castVal(DOUBLE_TYPE, val);
     }
     if(givenType == INT_TYPE){
-        if(val.val != (long)val.val){
-            printf("WARNING: precision loss in the assignment for variable \"%s\"\n", var);
-            val.val = round(val.val);
-            val.type = INT_TYPE;
+        if(!val.isInt && val.dval != (long)val.dval){
+            fprintf(OUTPUT, "WARNING: precision loss in the assignment for variable \"%s\"\n", var);
+            return typedVal(INT_TYPE, round(val.dval));
         }
         return val;
     }
@@ -804,48 +1744,79 @@ RET_VAL checkType(NUM_TYPE givenType, RET_VAL val, char *var){
 
 }
 
-RET_VAL callCustomFunc(FUNC_AST_NODE *func){
-    SYMBOL_TABLE_NODE *tableNode = findSymbol(func->ident, func->opList->parent);
-    if(tableNode == NULL){
-        printf("Symbol Not Declared: %s\n", func->ident);
-        return (RET_VAL){INT_TYPE, NAN};
+// Evaluates the arguments of a lambda call and pushes the callee's frame.
+// Returns the lambda body for eval() to continue with in *env, or NULL with
+// an error printed. Frames that eval() pushed since mark and that the callee
+// cannot reach are released first, which makes every call a tail call.
+// Lambdas with native code are run directly, and pure lambdas are answered
+// from or evaluated into their cache, returning NULL with the value in *result.
+AST_NODE *callCustomFunc(FUNC_AST_NODE *func, ENV_FRAME **env, ENV_FRAME *mark, RET_VAL *result){
+    METRIC_ADD(lambdaCalls, 1);
+    // session lambdas are defined outside every frame
+    ENV_FRAME *defFrame = findFrame(*env, &func->addr);
+    SYMBOL_TABLE_NODE *lambda = NULL;
+    if(func->addr.depth == SESSION_DEPTH){
+        lambda = sessionSymbol(func->addr.slot);
+    }
+    else if(defFrame != NULL){
+        lambda = defFrame->scope->slots[func->addr.slot];
     }
-
-    if(tableNode->type != LAMBDA_TYPE || tableNode == NULL){
-        printf("Function not defined %s\n", func->ident);
-        return (RET_VAL){INT_TYPE, NAN};
+    if(lambda == NULL){
+        fprintf(OUTPUT, "Symbol Not Declared: %s\n", func->ident);
+        return NULL;
     }
 
-    RET_VAL replace = {INT_TYPE, NAN};
-    if(tableNode->stack == NULL){
-        return eval(tableNode->val);
+    if(lambda->type != LAMBDA_TYPE){
+        fprintf(OUTPUT, "Function not defined %s\n", func->ident);
+        return NULL;
     }
 
-    STACK_NODE *temp = tableNode->stack;
-    while(func->opList != NULL){
-        if(func->opList != NULL && tableNode->stack == NULL){
-            printf("Too many arguments\n!");
-            return (RET_VAL){INT_TYPE, NAN};
+    int numArgs = lambda->scope->numSlots;
+    RET_VAL args[numArgs + 1];
+    for(int i = 0; i < func->numOps && i < numArgs; i++){
+        args[i] = eval(func->ops[i], *env);
+    }
+    if(func->numOps > numArgs){
+        fprintf(OUTPUT, "Too many arguments calling %s\n", func->ident);
+        return NULL;
+    }
+    if(func->numOps < numArgs){
+        fprintf(OUTPUT, "Too few arguments calling %s\n", func->ident);
+        return NULL;
+    }
+    if(lambda->memo != NULL && memoLookup(lambda->memo, args, result)){
+        return NULL;
+    }
+    if(lambda->jit != NULL && jitCall(lambda->jit, args, result)){
+        if(lambda->memo != NULL){
+            memoStore(lambda->memo, args, *result);
         }
-        replace = eval(func->opList);
-        (*temp).val->data.number = replace;
-        temp->val->type = NUM_NODE_TYPE;
-        func->opList = func->opList->next;
-        temp = temp->next;
+        return NULL;
     }
-    replace = eval(tableNode->val);
 
-    if(temp != NULL){
-        printf("Too few arguments\n!");
-        return (RET_VAL){INT_TYPE, NAN};
+    // a cached call needs its value, so it is evaluated recursively rather
+    // than as a tail call while there is room on the C stack
+    bool cached = lambda->memo != NULL && evalDepth < MAX_EVAL_DEPTH / 2;
+    if(!cached){
+        popFrames(defFrame != NULL && defFrame >= mark ? defFrame + 1 : mark);
+    }
+    ENV_FRAME *frame = pushFrame(lambda->scope, defFrame);
+    if(frame == NULL){
+        return NULL;
+    }
+    for(int i = 0; i < numArgs; i++){
+        frame->cells[i] = (ENV_CELL){args[i], true};
+    }
+    if(cached){
+        *result = eval(lambda->val, frame);
+        popFrames(frame);
+        if(!stackOverflow){
+            memoStore(lambda->memo, args, *result);
+        }
+        return NULL;
     }
 
-    return replace;
-}
-
-int checkOpNull(AST_NODE *op){
-    if(op == NULL) return 1;
-    else return 0;
+    *env = frame;
+    return lambda->val;
 }
 
-
@@ -4,47 +4,132 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
 #include <stdbool.h>
+#include <inttypes.h>
 
-#include "ciLispParser.h"
-
-int yyparse(void);
+#include "libcilisp.h"
+#include "ciLispNum.h"
 
-int yylex(void);
-
-void yyerror(char *);
+// Every builtin operator, its name and its arity, in OPER_TYPE order. The
+// enum, funcNames[], operArity() and the scanner's operator lookup are all
+// built from this list. Unary operators warn about extra operands and use
+// the first; binary ones need two, of which add and mult fold any number;
+// read, rand and print take none.
+#define CILISP_OPERS(X) \
+    X(NEG_OPER, "neg", 1) \
+    X(ABS_OPER, "abs", 1) \
+    X(EXP_OPER, "exp", 1) \
+    X(SQRT_OPER, "sqrt", 1) \
+    X(ADD_OPER, "add", 2) \
+    X(SUB_OPER, "sub", 2) \
+    X(MULT_OPER, "mult", 2) \
+    X(DIV_OPER, "div", 2) \
+    X(REMAINDER_OPER, "remainder", 2) \
+    X(LOG_OPER, "log", 1) \
+    X(POW_OPER, "pow", 2) \
+    X(MAX_OPER, "max", 2) \
+    X(MIN_OPER, "min", 2) \
+    X(EXP2_OPER, "exp2", 1) \
+    X(CBRT_OPER, "cbrt", 1) \
+    X(HYPOT_OPER, "hypot", 2) \
+    X(READ_OPER, "read", 0) \
+    X(RAND_OPER, "rand", 0) \
+    X(PRINT_OPER, "print", 0) \
+    X(EQUAL_OPER, "equal", 2) \
+    X(LESS_OPER, "less", 2) \
+    X(GREATER_OPER, "greater", 2)
 
 // Enum of all operators.
-// must be in sync with funcs in resolveFunc()
 typedef enum oper {
-    NEG_OPER, // 0
-    ABS_OPER,
-    EXP_OPER,
-    SQRT_OPER,
-    ADD_OPER,
-    SUB_OPER,
-    MULT_OPER,
-    DIV_OPER,
-    REMAINDER_OPER,
-    LOG_OPER,
-    POW_OPER,
-    MAX_OPER,
-    MIN_OPER,
-    EXP2_OPER,
-    CBRT_OPER,
-    HYPOT_OPER,
-    READ_OPER,
-    RAND_OPER,
-    PRINT_OPER,
-    EQUAL_OPER,
-    LESS_OPER,
-    GREATER_OPER,
+#define X(oper, name, arity) oper,
+    CILISP_OPERS(X)
+#undef X
     CUSTOM_OPER =255
 } OPER_TYPE;
 
-OPER_TYPE resolveFunc(char *);
+// Number of builtin operators.
+enum {
+    NUM_OPERS = 0
+#define X(oper, name, arity) + 1
+    CILISP_OPERS(X)
+#undef X
+};
+
+// Operands a builtin operator needs, see CILISP_OPERS. 0 for lambdas.
+static inline int operArity(OPER_TYPE oper)
+{
+    switch (oper) {
+#define X(oper, name, arity) case oper: return arity;
+        CILISP_OPERS(X)
+#undef X
+        default:
+            return 0;
+    }
+}
+
+// False if a call of oper with numOps operands prints a message about them
+// when it runs, which keeps the call out of folding, CSE, memoization, native
+// code and the column kernels.
+static inline bool validOperandCount(OPER_TYPE oper, int numOps)
+{
+    return operArity(oper) == 1 ? numOps == 1 : numOps >= operArity(oper);
+}
+
+// Operands of an f_expr while it is parsed, grown in the program's arena.
+typedef struct {
+    struct ast_node **ops;
+    int numOps;
+    int cap;
+} AST_LIST;
+
+#include "ciLispParser.h"
+
+int yyparse(yyscan_t scanner);
+
+int yylex(YYSTYPE *lval, yyscan_t scanner);
+
+void yyerror(char *);
+
+// Bump allocator for everything belonging to one parsed program: AST nodes,
+// symbol tables, lambda stacks and the identifier strings from the lexer.
+// It is released in one shot once the program has been evaluated.
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+} ARENA_BLOCK;
+
+typedef struct {
+    ARENA_BLOCK *head;
+    size_t reserve; // size of the block to start with after a reset
+    size_t allocated;
+    struct jit_block *jit; // native code for the program's lambdas, see ciLispJIT.c
+    struct memo_cache *memo; // result caches of the program's lambdas, see ciLispMemo.c
+} ARENA;
+
+extern _Thread_local ARENA programArena; // one per thread, see ciLispThreads.c
+
+void *arenaAlloc(ARENA *arena, size_t size);
+char *arenaStrdup(ARENA *arena, const char *str, size_t len);
+void arenaReset(ARENA *arena);
+void arenaFree(ARENA *arena);
+
+extern char *const funcNames[];
+
+// Returns the builtin operator named by the len characters at name, or CUSTOM_OPER.
+OPER_TYPE resolveFunc(const char *name, size_t len);
+// Returns the type named by the len characters at name: int or double.
+NUM_TYPE resolveType(const char *name, size_t len);
+
+// Values of the int_literal and double_literal in the len characters at
+// text, read where the scanner matched them. Ints past the int64 range are
+// held as doubles.
+RET_VAL parseInt(const char *text, size_t len);
+RET_VAL parseDouble(const char *text, size_t len);
 
 // Types of Abstract Syntax Tree nodes.
 // Initially, there are only numbers and functions.
@@ -56,31 +141,7 @@ typedef enum {
     COND_NODE_TYPE
 } AST_NODE_TYPE;
 
-// Types of numeric values
-typedef enum {
-    NO_TYPE,
-    INT_TYPE,
-    DOUBLE_TYPE
-} NUM_TYPE;
-
-// Node to store a number.
-typedef struct {
-    NUM_TYPE type;
-    double val;
-} NUM_AST_NODE;
-
-// Node to store a function call with its inputs
-typedef struct {
-    OPER_TYPE oper;
-    char* ident; // only needed for custom functions
-    struct ast_node *opList; //now points to a list of operators
-} FUNC_AST_NODE;
-
-// Values returned by eval function will be numbers with a type.
-// They have the same structure as a NUM_AST_NODE.
-// The line below allows us to give this struct another name for readability.
-typedef NUM_AST_NODE RET_VAL;
-
+// NUM_TYPE, NUM_AST_NODE and RET_VAL are declared in libcilisp.h.
 
 typedef enum { VARIABLE_TYPE, LAMBDA_TYPE, ARG_TYPE } SYMBOL_TYPE;
 
@@ -92,15 +153,47 @@ typedef struct symbol_table_node {
     char *ident;
     struct ast_node *val;
     STACK_NODE *stack;
+    struct scope *scope; // layout of the arg_list frame, for lambdas
+    struct jit_func *jit; // native code for lambdas, set by jitProgram()
+    struct memo_cache *memo; // result cache for pure lambdas, set by memoProgram()
+    bool live; // reachable from the program body, set by dropDeadBindings()
     struct symbol_table_node *next;
 } SYMBOL_TABLE_NODE;
 
 
 
+// Contiguous layout of a let_list or lambda arg_list, built by resolveProgram().
+typedef struct scope {
+    struct scope *parent;
+    int numSlots;
+    SYMBOL_TABLE_NODE **slots;
+} SCOPE;
+
+// Where a symbol reference is bound: walk depth frames up from the frame
+// the reference is evaluated in, then take the cell at slot.
+// depth is -1 for undeclared symbols, and SESSION_DEPTH for the ones
+// defined in the session (see ciLispSession.h), with slot the entry.
+typedef struct {
+    int depth;
+    int slot;
+} LEXICAL_ADDRESS;
+
+#define SESSION_DEPTH (-2)
+
 typedef struct symbol_ast_node {
     char *ident;
+    LEXICAL_ADDRESS addr;
 } SYMBOL_AST_NODE;
 
+// Node to store a function call with its inputs
+typedef struct {
+    OPER_TYPE oper;
+    int numOps;
+    char* ident; // only needed for custom functions
+    LEXICAL_ADDRESS addr; // lambda being called, for custom functions
+    struct ast_node **ops; // the operands, in order
+} FUNC_AST_NODE;
+
 
 typedef struct cond_ast_node{
     struct ast_node *cond; // this is the node that checks for non-zero or zero value
@@ -111,50 +204,162 @@ typedef struct cond_ast_node{
 
 // Generic Abstract Syntax Tree node. Stores the type of node,
 // and reference to the corresponding specific node (initially a number or function call).
+// Nodes are only allocated up to the member of data their type uses, see astNodeSize().
 typedef struct ast_node {
     AST_NODE_TYPE type;
     SYMBOL_TABLE_NODE  *table;
-    struct ast_node *parent;
-    struct {
+    SCOPE *scope; // layout of the let_list frame, set by resolveProgram()
+    union {
         NUM_AST_NODE number;
         FUNC_AST_NODE function;
         COND_AST_NODE condition;
         SYMBOL_AST_NODE symbol;
     } data;
-    struct ast_node *next;
 } AST_NODE;
 
-AST_NODE *createNumberNode(double value, NUM_TYPE type);
-AST_NODE *createFunctionNode(char *funcName, AST_NODE *opList);
+// Bytes allocated for a node of type. Folding may turn a node into a number
+// and CSE a call into a symbol, which are no larger; a folded cond takes the
+// place of its branch, so conds get a whole AST_NODE.
+static inline size_t astNodeSize(AST_NODE_TYPE type)
+{
+    switch (type) {
+        case NUM_NODE_TYPE:
+            return offsetof(AST_NODE, data) + sizeof(NUM_AST_NODE);
+        case FUNC_NODE_TYPE:
+            return offsetof(AST_NODE, data) + sizeof(FUNC_AST_NODE);
+        case SYMBOL_NODE_TYPE:
+            return offsetof(AST_NODE, data) + sizeof(SYMBOL_AST_NODE);
+        default:
+            return sizeof(AST_NODE);
+    }
+}
+
+AST_NODE *createNumberNode(NUM_AST_NODE value);
+AST_NODE *createFunctionNode(OPER_TYPE oper, AST_LIST ops);
 AST_NODE *createSymbolNode(char *ident);
-AST_NODE *createFuncList(AST_NODE *node, AST_NODE *next);
+AST_LIST addToFuncList(AST_LIST list, AST_NODE *node);
 AST_NODE *createConditionNode(AST_NODE *condition, AST_NODE *trueExpr, AST_NODE *falseExpr);
-SYMBOL_TABLE_NODE *createSymbolTableNode(char *type, AST_NODE *symNode, char *lambda, STACK_NODE *stackNode, AST_NODE *node);
+SYMBOL_TABLE_NODE *createSymbolTableNode(NUM_TYPE type, AST_NODE *symNode, bool lambda, STACK_NODE *stackNode, AST_NODE *node);
 STACK_NODE *createStackNodes(AST_NODE *head, STACK_NODE *next);
 
-RET_VAL eval(AST_NODE *node);
+// Command line evaluation mode, see EVAL_MODE in libcilisp.h.
+extern EVAL_MODE evalMode;
+
+// Set when a script is run: no prompts, each result on its own line and
+// stdout fully buffered in OUTPUT_BUFFER_SIZE chunks.
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+extern bool batchMode;
+
+// Where results and messages are printed: stdout, unless a worker thread is
+// collecting the output of one expression (see ciLispThreads.c). Results go
+// through the buffer of ciLispOutput.c, which outputFile() flushes before
+// returning the stream, so fprintf(OUTPUT, ...) keeps everything in order.
+extern _Thread_local FILE *outputStream;
+FILE *outputFile(void);
+#define OUTPUT outputFile()
+
+// Set by --jit: lambdas made only of arithmetic on their arguments are
+// compiled to native code (ciLispJIT.c) before the program is evaluated.
+extern bool jitEnabled;
+
+// Debug tracing of tokens, parser reductions and evaluation steps.
+// Levels are cumulative: TRACE_EVAL also prints reductions and tokens.
+// TRACE() compiles to nothing unless CILISP_TRACE is defined; when it is,
+// traceLevel (--trace=LEVEL) selects what is written to traceFile.
+typedef enum {
+    TRACE_OFF,
+    TRACE_TOKENS,
+    TRACE_REDUCTIONS,
+    TRACE_EVAL
+} TRACE_LEVEL;
+
+#ifdef CILISP_TRACE
+extern TRACE_LEVEL traceLevel;
+extern FILE *traceFile;
+#define TRACE(level, ...) \
+    do { if (traceLevel >= (level)) fprintf(traceFile, __VA_ARGS__); } while (0)
+#else
+#define TRACE(level, ...) ((void) 0)
+#endif
+
+bool setTraceLevel(char *name);
+
+// Storage for one let binding or lambda argument of a running frame.
+typedef struct {
+    RET_VAL val;
+    bool ready;
+    bool forcing; // its let binding is being evaluated
+} ENV_CELL;
+
+// Runtime instance of a SCOPE. A let section pushes one each time it is
+// evaluated and every lambda call pushes one for its arguments.
+typedef struct env_frame {
+    struct env_frame *parent;
+    SCOPE *scope;
+    ENV_CELL *cells;
+} ENV_FRAME;
+
+ENV_FRAME *pushFrame(SCOPE *scope, ENV_FRAME *parent);
+void popFrames(ENV_FRAME *top);
+ENV_FRAME *findFrame(ENV_FRAME *env, LEXICAL_ADDRESS *addr);
+RET_VAL forceCell(ENV_FRAME *frame, int slot);
+
+RET_VAL evalProgram(AST_NODE *node);
+RET_VAL evalPrepared(AST_NODE *node);
+RET_VAL evalInFrame(AST_NODE *node, ENV_FRAME *globals);
+RET_VAL eval(AST_NODE *node, ENV_FRAME *env);
 RET_VAL evalNumNode(NUM_AST_NODE *numNode);
-RET_VAL evalFuncNode(FUNC_AST_NODE *funcNode);
-RET_VAL evalSymbolNode(AST_NODE *node);
-RET_VAL evalConditionNode(COND_AST_NODE *condNode);
+RET_VAL evalFuncNode(FUNC_AST_NODE *funcNode, ENV_FRAME *env);
+RET_VAL evalSymbolNode(AST_NODE *node, ENV_FRAME *env);
+AST_NODE *evalConditionNode(COND_AST_NODE *condNode, ENV_FRAME *env);
 
-AST_NODE *linkCustomFunc(AST_NODE *funcName, AST_NODE *funcData);
+AST_NODE *linkCustomFunc(AST_NODE *funcName, AST_LIST funcData);
 AST_NODE *linkSymbolTable(SYMBOL_TABLE_NODE *symbolNode, AST_NODE *node);
 SYMBOL_TABLE_NODE *addToSymbolTable(SYMBOL_TABLE_NODE *head, SYMBOL_TABLE_NODE *newNode);
-SYMBOL_TABLE_NODE *findSymbol(char *ident, AST_NODE *s_expr);
-void freeNode(AST_NODE *node);
+char *internIdent(char *ident);
+char *internName(const char *name, size_t len);
+SCOPE *createScope(SYMBOL_TABLE_NODE *table, SCOPE *parent);
+void resolveAddress(char *ident, SCOPE *scope, LEXICAL_ADDRESS *addr);
+void resolveProgram(AST_NODE *root, SCOPE *globals);
+void rebindProgram(AST_NODE *root, SCOPE *globals);
+void foldProgram(AST_NODE *root, SCOPE *globals);
+void dropDeadBindings(AST_NODE *root, SCOPE *globals);
+void prepareProgram(AST_NODE *root, SCOPE *globals);
+void releaseProgram(void);
+void programParsed(AST_NODE *root);
+void programDefined(SYMBOL_TABLE_NODE *defs);
+void runProgram(AST_NODE *root, bool prepared);
+void programQuit(void);
+void programFailed(void);
+void parseString(char *source);
+
+// A parsed s_expr that owns its AST and can be evaluated repeatedly.
+struct cilisp_program {
+    AST_NODE *root;
+    ARENA arena;
+    struct vm_program *vm; // bytecode when compiled in VM_EVAL_MODE
+    SCOPE *globals;        // names given values by evalWithBindings(), or NULL
+    unsigned long session; // sessionId() of the session it refers to, or 0
+    unsigned long generation; // sessionGeneration() vm was compiled at
+};
+
+CILISP_PROGRAM *compileProgram(char *source);
+CILISP_PROGRAM *compileWithOptions(char *source, const CILISP_OPTIONS *options, const char *const *names, int numNames);
+bool defineWithOptions(char *source, const CILISP_OPTIONS *options);
+RET_VAL evalCompiled(CILISP_PROGRAM *program);
+RET_VAL evalWithBindings(CILISP_PROGRAM *program, const RET_VAL *values);
+void freeProgram(CILISP_PROGRAM *program);
 void printRetVal(RET_VAL val);
-NUM_AST_NODE *readVal();
-RET_VAL printExpr(AST_NODE *node);
+RET_VAL readVal();
+RET_VAL printExpr(FUNC_AST_NODE *func, ENV_FRAME *env);
 
 
 /*  HELPER FUNCTIONS  */
-AST_NODE *resolveOneOp(AST_NODE *op);
-AST_NODE *resolveTwoOp(OPER_TYPE type, AST_NODE *op);
-AST_NODE *resolveMultOp(OPER_TYPE type, AST_NODE *opList);
+bool resolveOneOp(FUNC_AST_NODE *func, ENV_FRAME *env, RET_VAL *val);
+bool resolveTwoOp(FUNC_AST_NODE *func, ENV_FRAME *env, RET_VAL vals[2]);
+bool resolveMultOp(FUNC_AST_NODE *func, ENV_FRAME *env, RET_VAL *result);
 RET_VAL randVal();
 RET_VAL checkType(NUM_TYPE type, RET_VAL val, char *var);
-RET_VAL callCustomFunc(FUNC_AST_NODE *func);
-int checkOpNull(AST_NODE *op);
+AST_NODE *callCustomFunc(FUNC_AST_NODE *func, ENV_FRAME **env, ENV_FRAME *mark, RET_VAL *result);
 
 #endif
@@ -1,66 +1,106 @@
 %{
     #include "ciLisp.h"
+
+    // the pure parser hands its scanner to yyerror as well
+    #define yyerror(scanner, msg) yyerror(msg)
 %}
 
+%code requires {
+    #ifndef YY_TYPEDEF_YY_SCANNER_T
+    #define YY_TYPEDEF_YY_SCANNER_T
+    typedef void *yyscan_t;
+    #endif
+}
+
+%define api.pure full
+%param {yyscan_t scanner}
+
 %union {
-    double dval;
+    NUM_AST_NODE number;
+    OPER_TYPE oper;
     char *sval;
+    NUM_TYPE type;
     struct ast_node *astNode;
     struct symbol_table_node *symNode;
+    AST_LIST astList;
 };
 
-%token <sval> FUNC SYMBOL TYPE LAMBDA
-%token <dval> INT DOUBLE
-%token LPAREN RPAREN EOL QUIT LET COND
+%token <oper> FUNC
+%token <sval> SYMBOL
+%token <type> TYPE
+%token <number> INT DOUBLE
+%token LPAREN RPAREN EOL QUIT LET COND DEFINE LAMBDA
 
 
-%type <astNode> s_expr_list s_expr symbol f_expr number
-%type <symNode> let_elem let_list let_section arg_list
+%type <astNode> s_expr symbol f_expr number
+%type <astList> s_expr_list
+%type <symNode> let_elem let_list let_section arg_list define_list
 %%
 
+programs:
+    /* EMPTY */
+    | programs program;
+
 program:
     s_expr EOL {
-        fprintf(stderr, "yacc: program ::= s_expr EOL\n");
-        if ($1) {
-            printRetVal(eval($1));
-            freeNode($1);
-        }
+        TRACE(TRACE_REDUCTIONS, "yacc: program ::= s_expr EOL\n");
+        programParsed($1);
+    }
+    | LPAREN DEFINE define_list RPAREN EOL {
+        TRACE(TRACE_REDUCTIONS, "yacc: program ::= LPAREN DEFINE define_list RPAREN EOL\n");
+        programDefined($3);
+    }
+    | EOL {
+        TRACE(TRACE_REDUCTIONS, "yacc: program ::= EOL\n");
+    }
+    | error EOL {
+        // a malformed line is skipped up to its EOL, so the next line parses
+        // on its own; bison has reported the syntax error already
+        TRACE(TRACE_REDUCTIONS, "yacc: program ::= error EOL\n");
+        yyerrok;
+        programFailed();
+    };
+
+define_list:
+    let_elem {
+        TRACE(TRACE_REDUCTIONS, "yacc: define_list ::= let_elem\n");
+        $$ = $1;
+    }
+    | define_list let_elem {
+        TRACE(TRACE_REDUCTIONS, "yacc: define_list ::= define_list let_elem\n");
+        $$ = addToSymbolTable($1, $2);
     };
 
 s_expr:
     number {
-        fprintf(stderr, "yacc: s_expr ::= number\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: s_expr ::= number\n");
         $$ = $1;
     }
     | LPAREN let_section s_expr RPAREN{
-        fprintf(stderr, "yacc: s_expr ::= LET\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: s_expr ::= LET\n");
         $$ = linkSymbolTable($2, $3);
     }
     | f_expr {
-        fprintf(stderr, "yacc: f_expr ::= FUNC\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: f_expr ::= FUNC\n");
         $$ = $1;
     }
     | LPAREN COND s_expr s_expr s_expr RPAREN {
-        fprintf(stderr, "yacc: COND ::= COND s_expr s_expr s_expr\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: COND ::= COND s_expr s_expr s_expr\n");
          $$ = createConditionNode($3, $4, $5);
     }
         | symbol {
-            fprintf(stderr, "yacc: symbol ::= SYMBOL\n");
+            TRACE(TRACE_REDUCTIONS, "yacc: symbol ::= SYMBOL\n");
             $$ = $1;
         }
     | QUIT {
-        fprintf(stderr, "yacc: s_expr ::= QUIT\n");
-        exit(EXIT_SUCCESS);
-    }
-    | error {
-        fprintf(stderr, "yacc: s_expr ::= error\n");
-        yyerror("unexpected token");
+        TRACE(TRACE_REDUCTIONS, "yacc: s_expr ::= QUIT\n");
+        programQuit();
         $$ = NULL;
     };
 
 f_expr:
     LPAREN FUNC s_expr_list RPAREN {
-        fprintf(stderr, "yacc: f_expr ::= LPAREN FUNC expr_list RPAREN\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: f_expr ::= LPAREN FUNC expr_list RPAREN\n");
         $$ = createFunctionNode($2, $3);
     }
     | LPAREN symbol s_expr_list RPAREN {
@@ -69,79 +109,74 @@ f_expr:
 
 s_expr_list:
     /* EMPTY */ {
-        fprintf(stderr, "yacc: s_expr_list ::= s_expr s_expr_list\n");
-      $$ = NULL;
+        TRACE(TRACE_REDUCTIONS, "yacc: s_expr_list ::= empty\n");
+        $$ = (AST_LIST){NULL, 0, 0};
     }
     |
-    s_expr s_expr_list {
-        fprintf(stderr, "yacc: s_expr_list ::= s_expr s_expr_list\n");
-        $$ = createFuncList($1, $2);
-    }
-    |
-    s_expr {
-        fprintf(stderr, "yacc: s_expr_list ::= s_expr_list\n");
-        $$ = createFuncList($1, NULL);
+    s_expr_list s_expr {
+        TRACE(TRACE_REDUCTIONS, "yacc: s_expr_list ::= s_expr_list s_expr\n");
+        $$ = addToFuncList($1, $2);
     };
 
 let_section:
     /* EMPTY */ {
-        fprintf(stderr, "yacc: let_section ::= empty\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: let_section ::= empty\n");
         $$ = NULL;
     }
     | LPAREN let_list RPAREN {
-        fprintf(stderr, "yacc: let_section ::= let_list\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: let_section ::= let_list\n");
         $$ = $2;
     };
 
 let_list:
     LET let_elem {
-        fprintf(stderr, "yacc: let_list ::= LET let_elem\n");
-        $$ = $2
+        TRACE(TRACE_REDUCTIONS, "yacc: let_list ::= LET let_elem\n");
+        $$ = $2;
     }
     | let_list let_elem{
-        fprintf(stderr, "yacc: let_elem ::= let_list let_elem\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: let_elem ::= let_list let_elem\n");
         $$ = addToSymbolTable($1, $2);
     };
 
 let_elem:
     LPAREN symbol s_expr RPAREN{
-        fprintf(stderr, "yacc: let_elem ::= SYMBOL s_expr\n");
-        $$ = createSymbolTableNode(NULL, $2, NULL, NULL, $3);
+        TRACE(TRACE_REDUCTIONS, "yacc: let_elem ::= SYMBOL s_expr\n");
+        $$ = createSymbolTableNode(NO_TYPE, $2, false, NULL, $3);
     }
     | LPAREN TYPE symbol s_expr RPAREN{
-        fprintf(stderr, "yacc: let_elem ::= TYPE SYMBOL s_expr\n");
-        $$ = createSymbolTableNode($2, $3, NULL, NULL, $4);
+        TRACE(TRACE_REDUCTIONS, "yacc: let_elem ::= TYPE SYMBOL s_expr\n");
+        $$ = createSymbolTableNode($2, $3, false, NULL, $4);
     }
     | LPAREN symbol LAMBDA LPAREN arg_list RPAREN s_expr RPAREN{
-        $$ = createSymbolTableNode(NULL, $2, $3, $5, $7);
+        $$ = createSymbolTableNode(NO_TYPE, $2, true, $5, $7);
     }
     | LPAREN TYPE symbol LAMBDA LPAREN arg_list RPAREN s_expr RPAREN{
-        $$ = createSymbolTableNode($2, $3, $4, $6, $8);
+        $$ = createSymbolTableNode($2, $3, true, $6, $8);
   };
 
 arg_list:
     symbol arg_list {
-        fprintf(stderr, "yacc: arg_list ::= SYMBOL arg_list\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: arg_list ::= SYMBOL arg_list\n");
         $$ = createStackNodes($1, $2);
     }
     | symbol {
-        fprintf(stderr, "yacc: arg_list ::= SYMBOL\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: arg_list ::= SYMBOL\n");
         $$ = createStackNodes($1, NULL);
     };
 
 number:
     INT {
-        fprintf(stderr, "yacc: number ::= INT\n");
-        $$ = createNumberNode($1, INT_TYPE);
+        TRACE(TRACE_REDUCTIONS, "yacc: number ::= INT\n");
+        $$ = createNumberNode($1);
     }
     | DOUBLE {
-        fprintf(stderr, "yacc: number ::= DOUBLE\n");
-        $$ = createNumberNode($1, DOUBLE_TYPE);
+        TRACE(TRACE_REDUCTIONS, "yacc: number ::= DOUBLE\n");
+        $$ = createNumberNode($1);
     };
 
 symbol:
     SYMBOL {
-        fprintf(stderr, "yacc: symbol ::= SYMBOL\n");
+        TRACE(TRACE_REDUCTIONS, "yacc: symbol ::= SYMBOL\n");
         $$ = createSymbolNode($1);
     }
 
@@ -0,0 +1,445 @@
+#include "ciLispCSE.h"
+
+#include <stdint.h>
+
+#define CSE_MIN_CAP 64
+
+typedef enum {
+    CSE_KEPT,     // still evaluated where it is
+    CSE_SHARED,   // moved into a hidden binding, along with its operands
+    CSE_REPLACED  // turned into a reference, its operands are gone
+} CSE_STATE;
+
+// A number, symbol or builtin call met on the way down. Equal subtrees get
+// the same value number; symbols are equal if they refer to the same binding.
+typedef struct {
+    AST_NODE *node;
+    AST_NODE *owner;  // node whose let_list holds the innermost binding used below
+    int parent;       // enclosing call, -1 at the top of an expression
+    int level;        // scope level of that binding, -1 if no symbol is used
+    int size;         // nodes in the subtree
+    int vn;           // value number, -1 if the node cannot be shared
+    size_t hash;
+    SYMBOL_TABLE_NODE *binding; // for symbols
+    int args;         // operand value numbers in argVns, for calls
+    int numArgs;
+    bool printed;     // operand of print, which shows the names of symbols
+    CSE_STATE state;
+} CSE_EXPR;
+
+// A let_list or arg_list entered on the way down, and the node that gets
+// the hidden bindings for expressions using it: the let itself, the lambda
+// body for arguments, and the root for the globals.
+typedef struct {
+    SCOPE *scope;
+    AST_NODE *owner;
+} CSE_LEVEL;
+
+// Expressions sharing a value number, largest first.
+typedef struct {
+    int size;
+    int vn;
+    int expr;
+} CSE_ORDER;
+
+typedef struct {
+    CSE_EXPR *exprs;
+    int numExprs, exprCap;
+    int *argVns;
+    int numArgVns, argVnCap;
+    int *vnTable;     // open addressing, expression holding each value number
+    int vnCap;
+    int numVns;
+    CSE_LEVEL *levels;
+    int numLevels, levelCap;
+    int numShared;
+    bool failed;
+} CSE;
+
+static bool cseGrow(CSE *cse, void **array, int *cap, int len, size_t elemSize)
+{
+    if (len < *cap)
+        return true;
+
+    int newCap = *cap ? *cap * 2 : CSE_MIN_CAP;
+    void *grown = realloc(*array, newCap * elemSize);
+    if (grown == NULL) {
+        yyerror("Memory allocation failed!");
+        cse->failed = true;
+        return false;
+    }
+    *array = grown;
+    *cap = newCap;
+    return true;
+}
+
+//*********************************
+// Value Numbering
+//*********************************
+
+static size_t mixHash(size_t hash, uint64_t bits)
+{
+    hash = (hash ^ bits) * 0x9E3779B97F4A7C15;
+    return hash ^ (hash >> 32);
+}
+
+static bool sameExpr(CSE *cse, CSE_EXPR *a, CSE_EXPR *b)
+{
+    if (a->node->type != b->node->type)
+        return false;
+    switch (a->node->type) {
+        case NUM_NODE_TYPE:
+            return a->node->data.number.type == b->node->data.number.type
+                   && a->node->data.number.isInt == b->node->data.number.isInt
+                   && memcmp(&a->node->data.number.ival, &b->node->data.number.ival, sizeof(int64_t)) == 0;
+        case SYMBOL_NODE_TYPE:
+            return a->binding == b->binding;
+        default:
+            return a->node->data.function.oper == b->node->data.function.oper && a->numArgs == b->numArgs
+                   && memcmp(&cse->argVns[a->args], &cse->argVns[b->args], a->numArgs * sizeof(int)) == 0;
+    }
+}
+
+static bool growVnTable(CSE *cse)
+{
+    int cap = cse->vnCap ? cse->vnCap * 2 : CSE_MIN_CAP;
+    int *table;
+    if ((table = malloc(cap * sizeof(int))) == NULL) {
+        yyerror("Memory allocation failed!");
+        cse->failed = true;
+        return false;
+    }
+    memset(table, -1, cap * sizeof(int));
+    for (int i = 0; i < cse->vnCap; i++) {
+        if (cse->vnTable[i] >= 0) {
+            size_t j = cse->exprs[cse->vnTable[i]].hash & (cap - 1);
+            while (table[j] >= 0)
+                j = (j + 1) & (cap - 1);
+            table[j] = cse->vnTable[i];
+        }
+    }
+    free(cse->vnTable);
+    cse->vnTable = table;
+    cse->vnCap = cap;
+    return true;
+}
+
+// Gives expr the value number of an equal expression seen before, or a new one.
+static void numberExpr(CSE *cse, int index)
+{
+    if (cse->numVns * 2 >= cse->vnCap && !growVnTable(cse))
+        return;
+
+    CSE_EXPR *expr = &cse->exprs[index];
+    size_t i = expr->hash & (cse->vnCap - 1);
+    while (cse->vnTable[i] >= 0) {
+        CSE_EXPR *seen = &cse->exprs[cse->vnTable[i]];
+        if (seen->hash == expr->hash && sameExpr(cse, seen, expr)) {
+            expr->vn = seen->vn;
+            return;
+        }
+        i = (i + 1) & (cse->vnCap - 1);
+    }
+    cse->vnTable[i] = index;
+    expr->vn = cse->numVns++;
+}
+
+//*********************************
+// Collecting Expressions
+//*********************************
+
+static int addExpr(CSE *cse, AST_NODE *node, int parent, bool printed)
+{
+    if (!cseGrow(cse, (void **) &cse->exprs, &cse->exprCap, cse->numExprs, sizeof(CSE_EXPR)))
+        return -1;
+    cse->exprs[cse->numExprs] = (CSE_EXPR){node, NULL, parent, -1, 1, -1, 0, NULL, 0, 0, printed, CSE_KEPT};
+    return cse->numExprs++;
+}
+
+static bool enterLevel(CSE *cse, SCOPE *scope, AST_NODE *owner)
+{
+    if (!cseGrow(cse, (void **) &cse->levels, &cse->levelCap, cse->numLevels, sizeof(CSE_LEVEL)))
+        return false;
+    cse->levels[cse->numLevels++] = (CSE_LEVEL){scope, owner};
+    return true;
+}
+
+static int collectNode(CSE *cse, AST_NODE *node, int parent, bool printed);
+
+// Symbols are shareable unless they are undeclared or name a lambda.
+static bool collectSymbol(CSE *cse, int index)
+{
+    CSE_EXPR *expr = &cse->exprs[index];
+    LEXICAL_ADDRESS *addr = &expr->node->data.symbol.addr;
+    int level = cse->numLevels - 1 - addr->depth;
+    if (addr->depth < 0 || level < 0)
+        return false;
+
+    SYMBOL_TABLE_NODE *binding = cse->levels[level].scope->slots[addr->slot];
+    if (binding->type == LAMBDA_TYPE)
+        return false;
+    expr->binding = binding;
+    expr->level = level;
+    expr->owner = cse->levels[level].owner;
+    expr->hash = mixHash((size_t) binding, SYMBOL_NODE_TYPE);
+    return true;
+}
+
+// Builtin calls without side effects or runtime messages are shareable
+// if all their operands are.
+static bool collectCall(CSE *cse, int index)
+{
+    FUNC_AST_NODE *func = &cse->exprs[index].node->data.function;
+    bool printArgs = func->oper == PRINT_OPER;
+    bool shareable = func->oper != CUSTOM_OPER && func->oper != READ_OPER
+                     && func->oper != RAND_OPER && func->oper != PRINT_OPER;
+    int count = func->numOps;
+
+    // operands add their own value numbers to argVns on the way down
+    int vns[count + 1];
+    for (int i = 0; i < count; i++) {
+        int arg = collectNode(cse, func->ops[i], index, printArgs);
+        if (cse->failed)
+            return false;
+        if (arg < 0 || cse->exprs[arg].vn < 0) {
+            shareable = false;
+            continue;
+        }
+
+        CSE_EXPR *expr = &cse->exprs[index];
+        CSE_EXPR *operand = &cse->exprs[arg];
+        expr->size += operand->size;
+        if (operand->level > expr->level) {
+            expr->level = operand->level;
+            expr->owner = operand->owner;
+        }
+        vns[i] = operand->vn;
+    }
+
+    if (!shareable || !validOperandCount(func->oper, count))
+        return false;
+
+    CSE_EXPR *expr = &cse->exprs[index];
+    expr->args = cse->numArgVns;
+    expr->numArgs = count;
+    expr->hash = mixHash(FUNC_NODE_TYPE, func->oper);
+    for (int i = 0; i < count; i++) {
+        if (!cseGrow(cse, (void **) &cse->argVns, &cse->argVnCap, cse->numArgVns, sizeof(int)))
+            return false;
+        cse->argVns[cse->numArgVns++] = vns[i];
+        expr->hash = mixHash(expr->hash, vns[i]);
+    }
+    return true;
+}
+
+// Collects the shareable expressions below node and returns the index of
+// node's own, or -1 if it has none (conds and lets are never shared).
+static int collectNode(CSE *cse, AST_NODE *node, int parent, bool printed)
+{
+    if (node == NULL || cse->failed)
+        return -1;
+
+    // a folded let keeps its let_list, which is never evaluated again
+    if (node->table != NULL && node->scope == NULL)
+        return -1;
+
+    if (node->scope != NULL) {
+        if (!enterLevel(cse, node->scope, node))
+            return -1;
+        for (SYMBOL_TABLE_NODE *sym = node->table; sym != NULL; sym = sym->next) {
+            // native lambdas never run their AST
+            if (sym->type != LAMBDA_TYPE)
+                collectNode(cse, sym->val, -1, false);
+            else if (sym->scope != NULL && sym->jit == NULL && enterLevel(cse, sym->scope, sym->val)) {
+                collectNode(cse, sym->val, -1, false);
+                cse->numLevels--;
+            }
+        }
+    }
+
+    int index = -1;
+    bool shareable = false;
+    switch (node->type) {
+        case NUM_NODE_TYPE:
+            if ((index = addExpr(cse, node, parent, printed)) >= 0) {
+                uint64_t bits;
+                memcpy(&bits, &node->data.number.ival, sizeof(bits));
+                cse->exprs[index].hash = mixHash(mixHash(NUM_NODE_TYPE, node->data.number.type), bits);
+                shareable = true;
+            }
+            break;
+        case SYMBOL_NODE_TYPE:
+            if ((index = addExpr(cse, node, parent, printed)) >= 0)
+                shareable = collectSymbol(cse, index);
+            break;
+        case FUNC_NODE_TYPE:
+            if ((index = addExpr(cse, node, parent, printed)) >= 0)
+                shareable = collectCall(cse, index);
+            break;
+        case COND_NODE_TYPE:
+            collectNode(cse, node->data.condition.cond, -1, false);
+            collectNode(cse, node->data.condition.trueCond, -1, false);
+            collectNode(cse, node->data.condition.falseCond, -1, false);
+            break;
+        default:
+            break;
+    }
+
+    if (node->scope != NULL) {
+        cse->numLevels--;
+        return -1;
+    }
+    if (shareable)
+        numberExpr(cse, index);
+    return index;
+}
+
+//*********************************
+// Sharing
+//*********************************
+
+static int compareOrder(const void *a, const void *b)
+{
+    const CSE_ORDER *x = a, *y = b;
+    if (x->size != y->size)
+        return y->size - x->size;
+    if (x->vn != y->vn)
+        return x->vn - y->vn;
+    return x->expr - y->expr;
+}
+
+// Whether expr still stands where it was collected.
+static bool isLive(CSE *cse, int index)
+{
+    if (cse->exprs[index].state != CSE_KEPT)
+        return false;
+    for (int parent = cse->exprs[index].parent; parent >= 0; parent = cse->exprs[parent].parent) {
+        if (cse->exprs[parent].state == CSE_REPLACED)
+            return false;
+    }
+    return true;
+}
+
+// Adds sym to the let_list of owner, giving owner one if it has none.
+// Slots are appended, so the addresses of existing bindings do not change.
+static bool addBinding(AST_NODE *owner, SYMBOL_TABLE_NODE *sym)
+{
+    if (owner->scope == NULL) {
+        if (owner->table != NULL)
+            return false;
+        owner->table = sym;
+        owner->scope = createScope(sym, NULL);
+        return owner->scope != NULL && owner->scope->numSlots == 1;
+    }
+
+    SCOPE *scope = owner->scope;
+    SYMBOL_TABLE_NODE **slots;
+    if ((slots = arenaAlloc(&programArena, (scope->numSlots + 1) * sizeof(SYMBOL_TABLE_NODE *))) == NULL) {
+        yyerror("Memory allocation failed!");
+        return false;
+    }
+    memcpy(slots, scope->slots, scope->numSlots * sizeof(SYMBOL_TABLE_NODE *));
+    slots[scope->numSlots] = sym;
+    scope->slots = slots;
+    scope->numSlots++;
+
+    SYMBOL_TABLE_NODE *last = owner->table;
+    while (last->next != NULL)
+        last = last->next;
+    last->next = sym;
+    return true;
+}
+
+// Moves the first of uses into a hidden binding and makes every use refer to it.
+static bool shareExpr(CSE *cse, int *uses, int numUses)
+{
+    CSE_EXPR *first = &cse->exprs[uses[0]];
+    SYMBOL_TABLE_NODE *sym;
+    AST_NODE *val;
+    if ((sym = arenaAlloc(&programArena, sizeof(SYMBOL_TABLE_NODE))) == NULL
+        || (val = arenaAlloc(&programArena, astNodeSize(FUNC_NODE_TYPE))) == NULL) {
+        yyerror("Memory allocation failed!");
+        return false;
+    }
+
+    // symbols are letters only, so the name cannot clash with one
+    char name[16];
+    int len = snprintf(name, sizeof(name), "#%d", cse->numShared + 1);
+    sym->type = VARIABLE_TYPE;
+    sym->val_type = NO_TYPE;
+    sym->ident = internIdent(arenaStrdup(&programArena, name, len));
+    sym->val = val;
+    if (!addBinding(first->owner, sym))
+        return false;
+    cse->numShared++;
+
+    memcpy(val, first->node, astNodeSize(FUNC_NODE_TYPE));
+
+    for (int i = 0; i < numUses; i++) {
+        CSE_EXPR *use = &cse->exprs[uses[i]];
+        use->node->type = SYMBOL_NODE_TYPE;
+        use->node->data.symbol.ident = sym->ident;
+        use->state = i == 0 ? CSE_SHARED : CSE_REPLACED;
+    }
+    return true;
+}
+
+// Shares every call that is still used more than once, largest first, so
+// the operands of a shared call are only considered where they remain.
+static void shareExprs(CSE *cse)
+{
+    if (cse->numExprs == 0)
+        return;
+
+    CSE_ORDER *order;
+    int *uses;
+    if ((order = malloc(cse->numExprs * sizeof(CSE_ORDER))) == NULL
+        || (uses = malloc(cse->numExprs * sizeof(int))) == NULL) {
+        yyerror("Memory allocation failed!");
+        free(order);
+        return;
+    }
+
+    int count = 0;
+    for (int i = 0; i < cse->numExprs; i++) {
+        CSE_EXPR *expr = &cse->exprs[i];
+        if (expr->node->type == FUNC_NODE_TYPE && expr->vn >= 0 && expr->level >= 0 && !expr->printed)
+            order[count++] = (CSE_ORDER){expr->size, expr->vn, i};
+    }
+    qsort(order, count, sizeof(CSE_ORDER), compareOrder);
+
+    for (int start = 0, end; start < count; start = end) {
+        int numUses = 0;
+        for (end = start; end < count && order[end].vn == order[start].vn; end++) {
+            if (isLive(cse, order[end].expr))
+                uses[numUses++] = order[end].expr;
+        }
+        if (numUses >= 2 && !shareExpr(cse, uses, numUses))
+            break;
+    }
+    free(order);
+    free(uses);
+}
+
+// Shares the repeated pure subexpressions of a resolved and folded program.
+// Lambdas that already have native code are left alone.
+void cseProgram(AST_NODE *root, SCOPE *globals)
+{
+    if (root == NULL)
+        return;
+
+    CSE cse = {0};
+    if (globals == NULL || enterLevel(&cse, globals, root))
+        collectNode(&cse, root, -1, false);
+    if (!cse.failed)
+        shareExprs(&cse);
+    if (cse.numShared > 0) {
+        TRACE(TRACE_EVAL, "cse: %d shared expressions\n", cse.numShared);
+        rebindProgram(root, globals);
+    }
+
+    free(cse.exprs);
+    free(cse.argVns);
+    free(cse.vnTable);
+    free(cse.levels);
+}
@@ -0,0 +1,14 @@
+#ifndef __cilisp_cse_h_
+#define __cilisp_cse_h_
+
+#include "ciLisp.h"
+
+// Common subexpression elimination. Pure builtin calls that occur more than
+// once with the same operands, down to the bindings their symbols refer to,
+// become one hidden let binding of the innermost let_list or arg_list those
+// symbols are bound in. Let bindings are evaluated lazily and once per frame,
+// so each shared expression is computed at most once per evaluation of that
+// scope, by either evaluator.
+void cseProgram(AST_NODE *root, SCOPE *globals);
+
+#endif
@@ -0,0 +1,833 @@
+#include "ciLispColumns.h"
+#include "ciLispMemo.h"
+#include "ciLispCSE.h"
+#include "ciLispOutput.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define COLUMN_AVX2
+#endif
+
+COLUMN_TABLE *columnTable = NULL;
+
+// Let bindings may refer to each other; deeper chains than this (or cycles)
+// are left to the row by row evaluator, which reports them.
+#define MAX_BINDING_DEPTH 64
+
+// The batch kernels compute in doubles, which hold every int up to 2^53
+// exactly; past it the int64 arithmetic of the tree evaluator differs.
+#define COLUMN_INT_LIMIT (INT64_C(1) << 53)
+
+// Values and types of one expression for every row of a batch.
+typedef struct {
+    double *val;
+    unsigned char *isDouble;
+} VEC;
+
+typedef struct {
+    SYMBOL_TABLE_NODE *sym;
+    VEC vec;
+} VEC_BINDING;
+
+// What an expression can hold in its INT_TYPE rows.
+typedef struct {
+    double bound; // no INT_TYPE value is further from 0
+    bool whole;   // every INT_TYPE value is an integer, so a divisor is 0 or at least 1
+} INT_RANGE;
+
+typedef struct {
+    COLUMN_TABLE *table;
+    size_t row;     // first row of the batch
+    size_t n;       // rows in the batch
+    ARENA arena;    // vectors of the current batch
+    VEC_BINDING *bindings; // let bindings computed for the current batch
+    int numBindings, bindingCap;
+} VEC_CONTEXT;
+
+//*********************************
+// Loading Columns
+//*********************************
+
+static bool addColumn(COLUMN_TABLE *table, char *name)
+{
+    COLUMN *columns = realloc(table->columns, (table->numColumns + 1) * sizeof(COLUMN));
+    if (columns == NULL)
+        return false;
+    table->columns = columns;
+    columns[table->numColumns++] = (COLUMN){strdup(name), NULL, NULL, NULL, 0};
+    return columns[table->numColumns - 1].name != NULL;
+}
+
+static bool addRow(COLUMN_TABLE *table)
+{
+    if (table->numRows == table->rowCap) {
+        table->rowCap = table->rowCap ? table->rowCap * 2 : COLUMN_BATCH;
+        for (int i = 0; i < table->numColumns; i++) {
+            COLUMN *column = &table->columns[i];
+            double *val = realloc(column->val, table->rowCap * sizeof(double));
+            if (val == NULL)
+                return false;
+            column->val = val;
+            unsigned char *isDouble = realloc(column->isDouble, table->rowCap);
+            if (isDouble == NULL)
+                return false;
+            column->isDouble = isDouble;
+            int64_t *ival = realloc(column->ival, table->rowCap * sizeof(int64_t));
+            if (ival == NULL)
+                return false;
+            column->ival = ival;
+        }
+    }
+    table->numRows++;
+    return true;
+}
+
+// Magnitude of an int for the bounds the batch evaluator checks; INFINITY
+// if a double does not hold it exactly.
+static double intMagnitude(RET_VAL val)
+{
+    if (!val.isInt || val.ival > COLUMN_INT_LIMIT || val.ival < -COLUMN_INT_LIMIT)
+        return INFINITY;
+    return fabs((double) val.ival);
+}
+
+// Parses one row of comma separated numbers. Numbers written like int
+// literals are INT_TYPE, read exactly as int64s like the literals of a
+// program. Anything else (2.5, 1e3, nan) is DOUBLE_TYPE.
+static bool parseRow(COLUMN_TABLE *table, char *line)
+{
+    size_t row = table->numRows - 1;
+    char *pos = line;
+    for (int i = 0; i < table->numColumns; i++) {
+        char *end;
+        double val = strtod(pos, &end);
+        if (end == pos)
+            return false;
+
+        bool isDouble = false;
+        for (char *c = pos; c < end; c++) {
+            if (*c != ' ' && *c != '\t' && *c != '+' && *c != '-' && (*c < '0' || *c > '9'))
+                isDouble = true;
+        }
+        COLUMN *column = &table->columns[i];
+        column->isDouble[row] = isDouble;
+        column->ival[row] = 0;
+        if (isDouble) {
+            column->val[row] = val;
+        }
+        else {
+            char *text = pos + strspn(pos, " \t");
+            RET_VAL cell = parseInt(text, end - text);
+            column->val[row] = asDouble(cell);
+            if (cell.isInt)
+                column->ival[row] = cell.ival;
+            column->intBound = fmax(column->intBound, intMagnitude(cell));
+        }
+
+        pos = end + strspn(end, " \t");
+        if (i < table->numColumns - 1 && *pos++ != ',')
+            return false;
+    }
+    return *pos == '\0' || *pos == '\n' || *pos == '\r';
+}
+
+// Loads a CSV file whose first line names the columns and whose other
+// lines hold one number per column. Returns NULL with a message on errors.
+COLUMN_TABLE *loadColumns(char *path)
+{
+    FILE *file;
+    if ((file = fopen(path, "r")) == NULL) {
+        perror(path);
+        return NULL;
+    }
+
+    COLUMN_TABLE *table;
+    if ((table = calloc(sizeof(COLUMN_TABLE), 1)) == NULL) {
+        yyerror("Memory allocation failed!");
+        fclose(file);
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t lineCap = 0;
+    bool ok = getline(&line, &lineCap, file) >= 0;
+    for (char *name = ok ? strtok(line, ", \t\r\n") : NULL; ok && name != NULL; name = strtok(NULL, ", \t\r\n"))
+        ok = addColumn(table, name);
+    if (ok && table->numColumns == 0) {
+        fprintf(OUTPUT, "ERROR: %s has no column names\n", path);
+        ok = false;
+    }
+
+    while (ok && getline(&line, &lineCap, file) >= 0) {
+        if (line[strspn(line, " \t\r\n")] == '\0')
+            continue;
+        if (!addRow(table)) {
+            yyerror("Memory allocation failed!");
+            ok = false;
+        }
+        else if (!parseRow(table, line)) {
+            fprintf(OUTPUT, "ERROR: line %zu of %s does not have %d numbers\n", table->numRows + 1, path, table->numColumns);
+            ok = false;
+        }
+    }
+    free(line);
+    fclose(file);
+
+    table->symbols = calloc(sizeof(SYMBOL_TABLE_NODE), table->numColumns);
+    table->scope.slots = calloc(sizeof(SYMBOL_TABLE_NODE *), table->numColumns);
+    if (ok && (table->symbols == NULL || table->scope.slots == NULL)) {
+        yyerror("Memory allocation failed!");
+        ok = false;
+    }
+    if (!ok) {
+        freeColumns(table);
+        return NULL;
+    }
+
+    table->scope.numSlots = table->numColumns;
+    for (int i = 0; i < table->numColumns; i++) {
+        table->symbols[i].type = VARIABLE_TYPE;
+        table->symbols[i].val_type = NO_TYPE;
+        table->symbols[i].ident = table->columns[i].name;
+        table->scope.slots[i] = &table->symbols[i];
+    }
+    return table;
+}
+
+void freeColumns(COLUMN_TABLE *table)
+{
+    if (table == NULL)
+        return;
+    for (int i = 0; i < table->numColumns; i++) {
+        free(table->columns[i].name);
+        free(table->columns[i].val);
+        free(table->columns[i].isDouble);
+        free(table->columns[i].ival);
+    }
+    free(table->columns);
+    free(table->symbols);
+    free(table->scope.slots);
+    free(table);
+}
+
+//*********************************
+// Kernels
+//*********************************
+
+// Every kernel computes one operator of evalFuncNode() for n rows, with the
+// same results; dst may be the same array as an operand.
+
+static void unaryScalar(OPER_TYPE oper, size_t n, double *dst, const double *a)
+{
+    switch (oper) {
+        case NEG_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = -a[i];
+            break;
+        case ABS_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = fabs(a[i]);
+            break;
+        case EXP_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = exp(a[i]);
+            break;
+        case SQRT_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = sqrt(a[i]);
+            break;
+        case LOG_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = log(a[i]);
+            break;
+        case EXP2_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = exp2(a[i]);
+            break;
+        case CBRT_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = cbrt(a[i]);
+            break;
+        default:
+            break;
+    }
+}
+
+static void binaryScalar(OPER_TYPE oper, size_t n, double *dst, const double *a, const double *b)
+{
+    switch (oper) {
+        case ADD_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = a[i] + b[i];
+            break;
+        case SUB_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = a[i] - b[i];
+            break;
+        case MULT_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = a[i] * b[i];
+            break;
+        case DIV_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = b[i] != 0 ? a[i] / b[i] : NAN;
+            break;
+        case REMAINDER_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = b[i] != 0 ? remainder(a[i], b[i]) : NAN;
+            break;
+        case POW_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = pow(a[i], b[i]);
+            break;
+        case MAX_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = fmax(a[i], b[i]);
+            break;
+        case MIN_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = fmin(a[i], b[i]);
+            break;
+        case HYPOT_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = hypot(a[i], b[i]);
+            break;
+        case EQUAL_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = a[i] == b[i];
+            break;
+        case LESS_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = a[i] < b[i];
+            break;
+        case GREATER_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst[i] = a[i] > b[i];
+            break;
+        default:
+            break;
+    }
+}
+
+// dst = cond != 0 ? a : b, where a NAN condition counts as nonzero
+static void selectScalar(size_t n, double *dst, const double *cond, const double *a, const double *b)
+{
+    for (size_t i = 0; i < n; i++)
+        dst[i] = cond[i] != 0 ? a[i] : b[i];
+}
+
+static void typeOrScalar(size_t n, unsigned char *dst, const unsigned char *a, const unsigned char *b)
+{
+    for (size_t i = 0; i < n; i++)
+        dst[i] = a[i] | b[i];
+}
+
+#ifdef COLUMN_AVX2
+
+// AVX2 versions of the kernels above. Each handles whole groups of 4 (or 32)
+// rows and returns how many rows it did; the scalar kernel does the rest.
+// Operators that call libm are left to the scalar kernels.
+
+__attribute__((target("avx2")))
+static size_t unaryAvx2(OPER_TYPE oper, size_t n, double *dst, const double *a)
+{
+    __m256d sign = _mm256_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        switch (oper) {
+            case NEG_OPER:
+                x = _mm256_xor_pd(x, sign);
+                break;
+            case ABS_OPER:
+                x = _mm256_andnot_pd(sign, x);
+                break;
+            case SQRT_OPER:
+                x = _mm256_sqrt_pd(x);
+                break;
+            default:
+                return 0;
+        }
+        _mm256_storeu_pd(dst + i, x);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t binaryAvx2(OPER_TYPE oper, size_t n, double *dst, const double *a, const double *b)
+{
+    __m256d zero = _mm256_setzero_pd();
+    __m256d one = _mm256_set1_pd(1.0);
+    __m256d nan = _mm256_set1_pd(NAN);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d y = _mm256_loadu_pd(b + i);
+        switch (oper) {
+            case ADD_OPER:
+                x = _mm256_add_pd(x, y);
+                break;
+            case SUB_OPER:
+                x = _mm256_sub_pd(x, y);
+                break;
+            case MULT_OPER:
+                x = _mm256_mul_pd(x, y);
+                break;
+            case DIV_OPER:
+                x = _mm256_blendv_pd(_mm256_div_pd(x, y), nan, _mm256_cmp_pd(y, zero, _CMP_EQ_OQ));
+                break;
+            // fmax and fmin ignore a NAN operand, max_pd returns its second operand then
+            case MAX_OPER:
+                x = _mm256_blendv_pd(_mm256_max_pd(y, x), y, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+                break;
+            case MIN_OPER:
+                x = _mm256_blendv_pd(_mm256_min_pd(y, x), y, _mm256_cmp_pd(x, x, _CMP_UNORD_Q));
+                break;
+            case EQUAL_OPER:
+                x = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_EQ_OQ), one);
+                break;
+            case LESS_OPER:
+                x = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_LT_OQ), one);
+                break;
+            case GREATER_OPER:
+                x = _mm256_and_pd(_mm256_cmp_pd(x, y, _CMP_GT_OQ), one);
+                break;
+            default:
+                return 0;
+        }
+        _mm256_storeu_pd(dst + i, x);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t selectAvx2(size_t n, double *dst, const double *cond, const double *a, const double *b)
+{
+    __m256d zero = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d mask = _mm256_cmp_pd(_mm256_loadu_pd(cond + i), zero, _CMP_NEQ_UQ);
+        _mm256_storeu_pd(dst + i, _mm256_blendv_pd(_mm256_loadu_pd(b + i), _mm256_loadu_pd(a + i), mask));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t typeOrAvx2(size_t n, unsigned char *dst, const unsigned char *a, const unsigned char *b)
+{
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_or_si256(x, y));
+    }
+    return i;
+}
+
+static bool hasAvx2(void)
+{
+    return __builtin_cpu_supports("avx2") != 0;
+}
+
+#endif
+
+static void unaryKernel(OPER_TYPE oper, size_t n, double *dst, const double *a)
+{
+    size_t done = 0;
+#ifdef COLUMN_AVX2
+    if (hasAvx2())
+        done = unaryAvx2(oper, n, dst, a);
+#endif
+    unaryScalar(oper, n - done, dst + done, a + done);
+}
+
+static void binaryKernel(OPER_TYPE oper, size_t n, double *dst, const double *a, const double *b)
+{
+    size_t done = 0;
+#ifdef COLUMN_AVX2
+    if (hasAvx2())
+        done = binaryAvx2(oper, n, dst, a, b);
+#endif
+    binaryScalar(oper, n - done, dst + done, a + done, b + done);
+}
+
+static void selectKernel(size_t n, double *dst, const double *cond, const double *a, const double *b)
+{
+    size_t done = 0;
+#ifdef COLUMN_AVX2
+    if (hasAvx2())
+        done = selectAvx2(n, dst, cond, a, b);
+#endif
+    selectScalar(n - done, dst + done, cond + done, a + done, b + done);
+}
+
+static void typeOrKernel(size_t n, unsigned char *dst, const unsigned char *a, const unsigned char *b)
+{
+    size_t done = 0;
+#ifdef COLUMN_AVX2
+    if (hasAvx2())
+        done = typeOrAvx2(n, dst, a, b);
+#endif
+    typeOrScalar(n - done, dst + done, a + done, b + done);
+}
+
+//*********************************
+// Batch Evaluation
+//*********************************
+
+// Finds the symbol that addr refers to from scope, and the scope holding it.
+static SYMBOL_TABLE_NODE *lookupAddress(SCOPE *scope, LEXICAL_ADDRESS *addr, SCOPE **found)
+{
+    *found = NULL;
+    if (addr->depth < 0)
+        return NULL;
+    for (int depth = addr->depth; depth > 0; depth--)
+        scope = scope->parent;
+    *found = scope;
+    return scope->slots[addr->slot];
+}
+
+// Returns true if node can be evaluated a batch at a time: numbers, columns,
+// let variables, conds and builtin operators with the right operand count.
+// Anything that prints (print, read, errors, precision warnings) or calls a
+// lambda has to be evaluated row by row to keep its output in order.
+static bool vecSupported(AST_NODE *node, SCOPE *scope, int depth)
+{
+    if (node == NULL || depth > MAX_BINDING_DEPTH)
+        return false;
+    if (node->scope != NULL)
+        scope = node->scope;
+
+    switch (node->type) {
+        case NUM_NODE_TYPE:
+            return true;
+        case SYMBOL_NODE_TYPE: {
+            SCOPE *found;
+            SYMBOL_TABLE_NODE *sym = lookupAddress(scope, &node->data.symbol.addr, &found);
+            if (sym == NULL || sym->type != VARIABLE_TYPE || sym->val_type == INT_TYPE)
+                return false;
+            return sym->val == NULL || vecSupported(sym->val, found, depth + 1);
+        }
+        case COND_NODE_TYPE:
+            return vecSupported(node->data.condition.cond, scope, depth)
+                   && vecSupported(node->data.condition.trueCond, scope, depth)
+                   && vecSupported(node->data.condition.falseCond, scope, depth);
+        case FUNC_NODE_TYPE:
+            break;
+        default:
+            return false;
+    }
+
+    FUNC_AST_NODE *func = &node->data.function;
+    switch (func->oper) {
+        case RAND_OPER:
+            return true;
+        case READ_OPER:
+        case PRINT_OPER:
+        case CUSTOM_OPER:
+            return false;
+        default:
+            break;
+    }
+    if (!validOperandCount(func->oper, func->numOps))
+        return false;
+    // add and mult fold every operand, the others use the ones they need
+    int numOps = func->oper == ADD_OPER || func->oper == MULT_OPER ? func->numOps : operArity(func->oper);
+    for (int i = 0; i < numOps; i++) {
+        if (!vecSupported(func->ops[i], scope, depth))
+            return false;
+    }
+    return true;
+}
+
+// Bounds the INT_TYPE values of node on every row, INFINITY if node or one
+// of its operands may leave the ints the batch kernels compute exactly.
+// Only called on nodes vecSupported accepted.
+static INT_RANGE intRange(COLUMN_TABLE *table, AST_NODE *node, SCOPE *scope)
+{
+    static const INT_RANGE wide = {INFINITY, false};
+    if (node->scope != NULL)
+        scope = node->scope;
+
+    switch (node->type) {
+        case NUM_NODE_TYPE: {
+            RET_VAL val = evalNumNode(&node->data.number);
+            if (val.type == DOUBLE_TYPE)
+                return (INT_RANGE){0, true};
+            // a folded (div 1 0) is an INT_TYPE nan, which the kernels keep as it is
+            if (!val.isInt && isnan(val.dval))
+                return (INT_RANGE){0, false};
+            return (INT_RANGE){val.isInt ? intMagnitude(val) : fabs(val.dval), val.isInt};
+        }
+        case SYMBOL_NODE_TYPE: {
+            SCOPE *found;
+            SYMBOL_TABLE_NODE *sym = lookupAddress(scope, &node->data.symbol.addr, &found);
+            if (found == &table->scope)
+                return (INT_RANGE){table->columns[node->data.symbol.addr.slot].intBound, true};
+            if (sym->val_type == DOUBLE_TYPE)
+                return (INT_RANGE){0, true};
+            return intRange(table, sym->val, found);
+        }
+        case COND_NODE_TYPE: {
+            INT_RANGE cond = intRange(table, node->data.condition.cond, scope);
+            INT_RANGE a = intRange(table, node->data.condition.trueCond, scope);
+            INT_RANGE b = intRange(table, node->data.condition.falseCond, scope);
+            if (!(cond.bound < COLUMN_INT_LIMIT))
+                return wide;
+            return (INT_RANGE){fmax(a.bound, b.bound), a.whole && b.whole};
+        }
+        default:
+            break;
+    }
+
+    FUNC_AST_NODE *func = &node->data.function;
+    if (func->oper == RAND_OPER)
+        return (INT_RANGE){1, true};
+
+    // a row is INT_TYPE only if its operands are, so their int bounds hold
+    int numOps = func->oper == ADD_OPER || func->oper == MULT_OPER ? func->numOps : operArity(func->oper);
+    INT_RANGE range = intRange(table, func->ops[0], scope);
+    for (int i = 1; i < numOps; i++) {
+        INT_RANGE b = intRange(table, func->ops[i], scope);
+        if (!(range.bound < COLUMN_INT_LIMIT && b.bound < COLUMN_INT_LIMIT))
+            return wide;
+        switch (func->oper) {
+            case ADD_OPER:
+            case SUB_OPER:
+                range.bound += b.bound;
+                break;
+            case MULT_OPER:
+                range.bound *= b.bound;
+                break;
+            // a divisor below 1 is a fraction that scales the quotient up
+            case DIV_OPER:
+                range.bound = b.whole ? range.bound : INFINITY;
+                break;
+            case REMAINDER_OPER:
+                range.bound = fmin(range.bound, b.bound);
+                break;
+            case POW_OPER:
+                range.bound = range.whole && b.whole ? pow(fmax(range.bound, 1), b.bound) : INFINITY;
+                break;
+            case HYPOT_OPER:
+                range.bound = hypot(range.bound, b.bound);
+                break;
+            case EQUAL_OPER:
+            case LESS_OPER:
+            case GREATER_OPER:
+                range.bound = 1;
+                break;
+            default: // max and min
+                range.bound = fmax(range.bound, b.bound);
+                break;
+        }
+        range.whole = range.whole && b.whole && func->oper != DIV_OPER && func->oper != POW_OPER
+                      && func->oper != HYPOT_OPER;
+    }
+    if (!(range.bound < COLUMN_INT_LIMIT))
+        return wide;
+
+    switch (func->oper) {
+        case EXP_OPER:
+            return (INT_RANGE){exp(range.bound), false};
+        case EXP2_OPER:
+            return (INT_RANGE){exp2(range.bound), false};
+        case SQRT_OPER:
+            return (INT_RANGE){sqrt(range.bound), false};
+        case CBRT_OPER:
+            return (INT_RANGE){cbrt(range.bound), false};
+        // a positive double is at least 2^-1074, whose log is about -745
+        case LOG_OPER:
+            return (INT_RANGE){fmax(log(range.bound), 746), false};
+        default:
+            return range;
+    }
+}
+
+static VEC newVec(VEC_CONTEXT *ctx)
+{
+    VEC vec = {arenaAlloc(&ctx->arena, ctx->n * sizeof(double)), arenaAlloc(&ctx->arena, ctx->n)};
+    if (vec.val == NULL || vec.isDouble == NULL)
+        yyerror("Memory allocation failed!");
+    return vec;
+}
+
+static VEC vecEval(VEC_CONTEXT *ctx, AST_NODE *node, SCOPE *scope);
+
+// Columns are used in place; a let binding is computed once per batch.
+static VEC vecSymbol(VEC_CONTEXT *ctx, AST_NODE *node, SCOPE *scope)
+{
+    SCOPE *found;
+    SYMBOL_TABLE_NODE *sym = lookupAddress(scope, &node->data.symbol.addr, &found);
+    if (found == &ctx->table->scope) {
+        COLUMN *column = &ctx->table->columns[node->data.symbol.addr.slot];
+        return (VEC){column->val + ctx->row, column->isDouble + ctx->row};
+    }
+
+    for (int i = 0; i < ctx->numBindings; i++) {
+        if (ctx->bindings[i].sym == sym)
+            return ctx->bindings[i].vec;
+    }
+
+    VEC vec = vecEval(ctx, sym->val, found);
+    if (sym->val_type == DOUBLE_TYPE) {
+        VEC typed = {vec.val, arenaAlloc(&ctx->arena, ctx->n)};
+        if (typed.isDouble == NULL)
+            yyerror("Memory allocation failed!");
+        memset(typed.isDouble, 1, ctx->n);
+        vec = typed;
+    }
+
+    if (ctx->numBindings == ctx->bindingCap) {
+        ctx->bindingCap = ctx->bindingCap ? ctx->bindingCap * 2 : 16;
+        if ((ctx->bindings = realloc(ctx->bindings, ctx->bindingCap * sizeof(VEC_BINDING))) == NULL)
+            yyerror("Memory allocation failed!");
+    }
+    ctx->bindings[ctx->numBindings++] = (VEC_BINDING){sym, vec};
+    return vec;
+}
+
+static VEC vecFunc(VEC_CONTEXT *ctx, FUNC_AST_NODE *func, SCOPE *scope)
+{
+    size_t n = ctx->n;
+    VEC dst = newVec(ctx);
+    AST_NODE *lhs = func->numOps > 0 ? func->ops[0] : NULL;
+
+    if (operArity(func->oper) == 1) {
+        VEC a = vecEval(ctx, lhs, scope);
+        unaryKernel(func->oper, n, dst.val, a.val);
+        memcpy(dst.isDouble, a.isDouble, n);
+        return dst;
+    }
+    switch (func->oper) {
+        case ADD_OPER:
+        case MULT_OPER: {
+            VEC acc = vecEval(ctx, lhs, scope);
+            for (int i = 1; i < func->numOps; i++) {
+                VEC b = vecEval(ctx, func->ops[i], scope);
+                binaryKernel(func->oper, n, dst.val, acc.val, b.val);
+                typeOrKernel(n, dst.isDouble, acc.isDouble, b.isDouble);
+                acc = dst;
+            }
+            break;
+        }
+        case RAND_OPER:
+            for (size_t i = 0; i < n; i++)
+                dst.val[i] = asDouble(randVal());
+            memset(dst.isDouble, 0, n);
+            break;
+        default: {
+            VEC a = vecEval(ctx, lhs, scope);
+            VEC b = vecEval(ctx, func->ops[1], scope);
+            binaryKernel(func->oper, n, dst.val, a.val, b.val);
+            if (func->oper == EQUAL_OPER || func->oper == LESS_OPER || func->oper == GREATER_OPER) {
+                memset(dst.isDouble, 0, n);
+                break;
+            }
+            typeOrKernel(n, dst.isDouble, a.isDouble, b.isDouble);
+            // division by zero leaves the initial INT_TYPE nan
+            if (func->oper == DIV_OPER) {
+                for (size_t i = 0; i < n; i++)
+                    dst.isDouble[i] &= b.val[i] != 0;
+            }
+        }
+    }
+    return dst;
+}
+
+static VEC vecEval(VEC_CONTEXT *ctx, AST_NODE *node, SCOPE *scope)
+{
+    if (node->scope != NULL)
+        scope = node->scope;
+
+    switch (node->type) {
+        case NUM_NODE_TYPE: {
+            VEC dst = newVec(ctx);
+            RET_VAL val = evalNumNode(&node->data.number);
+            for (size_t i = 0; i < ctx->n; i++)
+                dst.val[i] = asDouble(val);
+            memset(dst.isDouble, val.type == DOUBLE_TYPE, ctx->n);
+            return dst;
+        }
+        case SYMBOL_NODE_TYPE:
+            return vecSymbol(ctx, node, scope);
+        case FUNC_NODE_TYPE:
+            return vecFunc(ctx, &node->data.function, scope);
+        default: {
+            // both branches are pure, so compute both and select per row
+            VEC dst = newVec(ctx);
+            VEC cond = vecEval(ctx, node->data.condition.cond, scope);
+            VEC a = vecEval(ctx, node->data.condition.trueCond, scope);
+            VEC b = vecEval(ctx, node->data.condition.falseCond, scope);
+            selectKernel(ctx->n, dst.val, cond.val, a.val, b.val);
+            for (size_t i = 0; i < ctx->n; i++)
+                dst.isDouble[i] = cond.val[i] != 0 ? a.isDouble[i] : b.isDouble[i];
+            return dst;
+        }
+    }
+}
+
+static void printRow(RET_VAL val)
+{
+    printRetVal(val);
+    outputChar('\n');
+}
+
+static void evalBatches(COLUMN_TABLE *table, AST_NODE *root)
+{
+    VEC_CONTEXT ctx = {table};
+    for (ctx.row = 0; ctx.row < table->numRows; ctx.row += COLUMN_BATCH) {
+        ctx.n = table->numRows - ctx.row < COLUMN_BATCH ? table->numRows - ctx.row : COLUMN_BATCH;
+        ctx.numBindings = 0;
+        VEC result = vecEval(&ctx, root, &table->scope);
+        for (size_t i = 0; i < ctx.n; i++)
+            printRow(typedVal(result.isDouble[i] ? DOUBLE_TYPE : INT_TYPE, result.val[i]));
+        arenaReset(&ctx.arena);
+    }
+    arenaFree(&ctx.arena);
+    free(ctx.bindings);
+}
+
+// Fallback for programs with side effects: the tree evaluator runs once per
+// row in a frame holding that row's values.
+static void evalRows(COLUMN_TABLE *table, AST_NODE *root)
+{
+    ENV_FRAME *globals = pushFrame(&table->scope, NULL);
+    if (globals == NULL)
+        return;
+    for (size_t row = 0; row < table->numRows; row++) {
+        for (int i = 0; i < table->numColumns; i++) {
+            COLUMN *column = &table->columns[i];
+            RET_VAL val;
+            // ints past the int64 range are kept as doubles, like literals
+            if (column->isDouble[row] || fabs(column->val[row]) >= 0x1p63)
+                val = typedVal(column->isDouble[row] ? DOUBLE_TYPE : INT_TYPE, column->val[row]);
+            else
+                val = intVal(column->ival[row]);
+            globals->cells[i] = (ENV_CELL){val, true};
+        }
+        RET_VAL result = evalInFrame(root, globals);
+        printRow(result.type == DOUBLE_TYPE ? result : castVal(INT_TYPE, result));
+    }
+    popFrames(globals);
+}
+
+// Evaluates a parsed program once for every row of table, printing one
+// result per line. Free symbols of the program name columns.
+void evalColumns(COLUMN_TABLE *table, AST_NODE *root)
+{
+    // columns are matched by pointer like every other identifier
+    for (int i = 0; i < table->numColumns; i++)
+        table->symbols[i].ident = internIdent(table->columns[i].name);
+
+    prepareProgram(root, &table->scope);
+    cseProgram(root, &table->scope);
+    if (vecSupported(root, &table->scope, 0) && intRange(table, root, &table->scope).bound < COLUMN_INT_LIMIT) {
+        evalBatches(table, root);
+        return;
+    }
+    // pure lambdas see the same arguments again and again across rows
+    if (memoEnabled)
+        memoProgram(root, &programArena);
+    evalRows(table, root);
+}
@@ -0,0 +1,38 @@
+#ifndef __cilisp_columns_h_
+#define __cilisp_columns_h_
+
+#include "ciLisp.h"
+
+// Number of rows evaluated together by one pass over an expression.
+#define COLUMN_BATCH 1024
+
+// One named input column. isDouble[i] is 1 for DOUBLE_TYPE values, 0 for INT_TYPE.
+// ival[i] is the exact value of an INT_TYPE cell within the int64 range.
+// intBound is the largest magnitude of an INT_TYPE cell, INFINITY if one
+// of them is not exact as a double.
+typedef struct {
+    char *name;
+    double *val;
+    unsigned char *isDouble;
+    int64_t *ival;
+    double intBound;
+} COLUMN;
+
+// Input columns that the free symbols of every program are bound to.
+// scope holds one VARIABLE_TYPE symbol per column and is the outermost
+// scope the programs are resolved in.
+typedef struct {
+    COLUMN *columns;
+    int numColumns;
+    size_t numRows, rowCap;
+    SCOPE scope;
+    SYMBOL_TABLE_NODE *symbols;
+} COLUMN_TABLE;
+
+extern COLUMN_TABLE *columnTable;
+
+COLUMN_TABLE *loadColumns(char *path);
+void freeColumns(COLUMN_TABLE *table);
+void evalColumns(COLUMN_TABLE *table, AST_NODE *root);
+
+#endif
@@ -0,0 +1,465 @@
+#include "ciLispImage.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_MAGIC "CILISPIM"
+#define IMAGE_VERSION 2
+
+// Start of an image file. The struct sizes tie an image to the layout of the
+// build that wrote it.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t numPrograms;
+    uint32_t nodeSize, symbolSize, scopeSize, pointerSize;
+    uint64_t size;
+    uint64_t programs;  // numPrograms offsets of program roots
+    uint64_t relocs;    // numRelocs offsets of the pointers in the image
+    uint64_t numRelocs;
+} IMAGE_HEADER;
+
+typedef struct {
+    const void *ptr;
+    uint64_t offset;
+} IMAGE_ENTRY;
+
+// Image being compiled. Every pointer written into data is an offset from its
+// start (0 for NULL, which is the header) and its position is kept in relocs.
+typedef struct {
+    char *data;
+    size_t len, cap;
+    uint64_t *relocs;
+    size_t numRelocs, relocCap;
+    uint64_t *programs;
+    size_t numPrograms, programCap;
+    IMAGE_ENTRY *map;   // objects of the current program already in data
+    size_t mapLen, mapCap;
+    bool quit;
+    bool failed;
+} IMAGE_WRITER;
+
+bool imageCompiling = false;
+
+static IMAGE_WRITER writer;
+
+//*********************************
+// Writing
+//*********************************
+
+static void outOfMemory(void)
+{
+    if (!writer.failed)
+        yyerror("Memory allocation failed!");
+    writer.failed = true;
+}
+
+// Appends value to an array of uint64_t that grows as needed.
+static void appendOffset(uint64_t **array, size_t *len, size_t *cap, uint64_t value)
+{
+    if (*len == *cap) {
+        size_t newCap = *cap ? 2 * *cap : 256;
+        uint64_t *grown = realloc(*array, newCap * sizeof(uint64_t));
+        if (grown == NULL) {
+            outOfMemory();
+            return;
+        }
+        *array = grown;
+        *cap = newCap;
+    }
+    (*array)[(*len)++] = value;
+}
+
+// Returns the offset of size zeroed bytes appended to the image, or 0 if out of memory.
+static uint64_t reserve(size_t size, size_t align)
+{
+    size_t offset = (writer.len + align - 1) & ~(align - 1);
+    if (offset + size > writer.cap) {
+        size_t cap = writer.cap ? writer.cap : 4096;
+        while (cap < offset + size)
+            cap *= 2;
+        char *data = realloc(writer.data, cap);
+        if (data == NULL) {
+            outOfMemory();
+            return 0;
+        }
+        writer.data = data;
+        writer.cap = cap;
+    }
+    memset(writer.data + writer.len, 0, offset + size - writer.len);
+    writer.len = offset + size;
+    return offset;
+}
+
+static size_t hashPointer(const void *ptr)
+{
+    return (size_t) (((uintptr_t) ptr >> 4) * 0x9e3779b97f4a7c15u);
+}
+
+// Offset of an object of the current program that was already written, or 0.
+static uint64_t lookup(const void *ptr)
+{
+    if (ptr == NULL || writer.mapCap == 0)
+        return 0;
+    size_t mask = writer.mapCap - 1;
+    for (size_t i = hashPointer(ptr) & mask; writer.map[i].ptr != NULL; i = (i + 1) & mask) {
+        if (writer.map[i].ptr == ptr)
+            return writer.map[i].offset;
+    }
+    return 0;
+}
+
+static void insertEntry(IMAGE_ENTRY *map, size_t cap, const void *ptr, uint64_t offset)
+{
+    size_t i = hashPointer(ptr) & (cap - 1);
+    while (map[i].ptr != NULL)
+        i = (i + 1) & (cap - 1);
+    map[i] = (IMAGE_ENTRY){ptr, offset};
+}
+
+static void remember(const void *ptr, uint64_t offset)
+{
+    if (2 * (writer.mapLen + 1) > writer.mapCap) {
+        size_t cap = writer.mapCap ? 2 * writer.mapCap : 256;
+        IMAGE_ENTRY *map = calloc(cap, sizeof(IMAGE_ENTRY));
+        if (map == NULL) {
+            outOfMemory();
+            return;
+        }
+        for (size_t i = 0; i < writer.mapCap; i++) {
+            if (writer.map[i].ptr != NULL)
+                insertEntry(map, cap, writer.map[i].ptr, writer.map[i].offset);
+        }
+        free(writer.map);
+        writer.map = map;
+        writer.mapCap = cap;
+    }
+    insertEntry(writer.map, writer.mapCap, ptr, offset);
+    writer.mapLen++;
+}
+
+// Stores the offset target in the pointer at offset at.
+static void setPointer(uint64_t at, uint64_t target)
+{
+    if (writer.failed)
+        return;
+    uintptr_t value = target;
+    memcpy(writer.data + at, &value, sizeof(value));
+    if (target != 0)
+        appendOffset(&writer.relocs, &writer.numRelocs, &writer.relocCap, at);
+}
+
+static uint64_t writeString(const char *str)
+{
+    uint64_t offset = lookup(str);
+    if (str == NULL || offset != 0)
+        return offset;
+
+    size_t size = strlen(str) + 1;
+    if ((offset = reserve(size, 1)) != 0) {
+        memcpy(writer.data + offset, str, size);
+        remember(str, offset);
+    }
+    return offset;
+}
+
+static uint64_t writeOps(FUNC_AST_NODE *func);
+static uint64_t writeSymbols(SYMBOL_TABLE_NODE *head);
+static uint64_t writeScope(SCOPE *scope);
+
+static uint64_t writeNode(AST_NODE *node)
+{
+    uint64_t offset = lookup(node);
+    if (node == NULL || offset != 0)
+        return offset;
+    if ((offset = reserve(astNodeSize(node->type), _Alignof(AST_NODE))) == 0)
+        return 0;
+    remember(node, offset);
+
+    // pointers are written as offsets below; the ones a folded node keeps
+    // from its old type are dropped
+    AST_NODE copy = {.type = node->type};
+    switch (node->type) {
+        case NUM_NODE_TYPE:
+            copy.data.number = node->data.number;
+            break;
+        case FUNC_NODE_TYPE:
+            copy.data.function.oper = node->data.function.oper;
+            copy.data.function.numOps = node->data.function.numOps;
+            copy.data.function.addr = node->data.function.addr;
+            break;
+        case SYMBOL_NODE_TYPE:
+            copy.data.symbol.addr = node->data.symbol.addr;
+            break;
+        default:
+            break;
+    }
+    memcpy(writer.data + offset, &copy, astNodeSize(node->type));
+
+    setPointer(offset + offsetof(AST_NODE, table), writeSymbols(node->table));
+    setPointer(offset + offsetof(AST_NODE, scope), writeScope(node->scope));
+    switch (node->type) {
+        case FUNC_NODE_TYPE:
+            setPointer(offset + offsetof(AST_NODE, data.function.ident), writeString(node->data.function.ident));
+            setPointer(offset + offsetof(AST_NODE, data.function.ops), writeOps(&node->data.function));
+            break;
+        case COND_NODE_TYPE:
+            setPointer(offset + offsetof(AST_NODE, data.condition.cond), writeNode(node->data.condition.cond));
+            setPointer(offset + offsetof(AST_NODE, data.condition.trueCond), writeNode(node->data.condition.trueCond));
+            setPointer(offset + offsetof(AST_NODE, data.condition.falseCond), writeNode(node->data.condition.falseCond));
+            break;
+        case SYMBOL_NODE_TYPE:
+            setPointer(offset + offsetof(AST_NODE, data.symbol.ident), writeString(node->data.symbol.ident));
+            break;
+        default:
+            break;
+    }
+    return offset;
+}
+
+// Writes the operand array of a function and returns its offset.
+static uint64_t writeOps(FUNC_AST_NODE *func)
+{
+    if (func->numOps == 0)
+        return 0;
+    uint64_t offset = reserve(func->numOps * sizeof(AST_NODE *), _Alignof(AST_NODE *));
+    if (offset == 0)
+        return 0;
+    for (int i = 0; i < func->numOps; i++)
+        setPointer(offset + i * sizeof(AST_NODE *), writeNode(func->ops[i]));
+    return offset;
+}
+
+static uint64_t writeSymbol(SYMBOL_TABLE_NODE *sym)
+{
+    uint64_t offset = lookup(sym);
+    if (sym == NULL || offset != 0)
+        return offset;
+    if ((offset = reserve(sizeof(SYMBOL_TABLE_NODE), _Alignof(SYMBOL_TABLE_NODE))) == 0)
+        return 0;
+    remember(sym, offset);
+
+    // native code and memo caches belong to the arena of a run, not the image
+    SYMBOL_TABLE_NODE copy = *sym;
+    copy.ident = NULL;
+    copy.val = NULL;
+    copy.stack = NULL;
+    copy.scope = NULL;
+    copy.jit = NULL;
+    copy.memo = NULL;
+    copy.next = NULL;
+    memcpy(writer.data + offset, &copy, sizeof(copy));
+
+    setPointer(offset + offsetof(SYMBOL_TABLE_NODE, ident), writeString(sym->ident));
+    setPointer(offset + offsetof(SYMBOL_TABLE_NODE, val), writeNode(sym->val));
+    setPointer(offset + offsetof(SYMBOL_TABLE_NODE, stack), writeSymbols(sym->stack));
+    setPointer(offset + offsetof(SYMBOL_TABLE_NODE, scope), writeScope(sym->scope));
+    return offset;
+}
+
+// Writes a let_list or arg_list and returns the offset of its head.
+static uint64_t writeSymbols(SYMBOL_TABLE_NODE *head)
+{
+    uint64_t first = 0, prev = 0;
+    for (SYMBOL_TABLE_NODE *sym = head; sym != NULL; sym = sym->next) {
+        uint64_t offset = writeSymbol(sym);
+        if (prev != 0)
+            setPointer(prev + offsetof(SYMBOL_TABLE_NODE, next), offset);
+        else
+            first = offset;
+        prev = offset;
+    }
+    return first;
+}
+
+static uint64_t writeScope(SCOPE *scope)
+{
+    uint64_t offset = lookup(scope);
+    if (scope == NULL || offset != 0)
+        return offset;
+    if ((offset = reserve(sizeof(SCOPE), _Alignof(SCOPE))) == 0)
+        return 0;
+    remember(scope, offset);
+
+    SCOPE copy = {NULL, scope->numSlots, NULL};
+    memcpy(writer.data + offset, &copy, sizeof(copy));
+    setPointer(offset + offsetof(SCOPE, parent), writeScope(scope->parent));
+
+    // an empty slot array shares its address with whatever was allocated next
+    if (scope->numSlots > 0) {
+        uint64_t slots = reserve(scope->numSlots * sizeof(SYMBOL_TABLE_NODE *), _Alignof(SYMBOL_TABLE_NODE *));
+        if (slots == 0)
+            return 0;
+        for (int slot = 0; slot < scope->numSlots; slot++)
+            setPointer(slots + slot * sizeof(SYMBOL_TABLE_NODE *), writeSymbol(scope->slots[slot]));
+        setPointer(offset + offsetof(SCOPE, slots), slots);
+    }
+    return offset;
+}
+
+void imageBegin(void)
+{
+    memset(&writer, 0, sizeof(writer));
+    reserve(sizeof(IMAGE_HEADER), _Alignof(IMAGE_HEADER));
+    imageCompiling = true;
+}
+
+// Prepares a parsed program and adds it to the image. The program is
+// released afterwards, so nothing of it may be remembered for the next one.
+void imageAddProgram(AST_NODE *root)
+{
+    if (root == NULL || writer.quit || writer.failed)
+        return;
+
+    prepareProgram(root, NULL);
+    uint64_t offset = writeNode(root);
+    appendOffset(&writer.programs, &writer.numPrograms, &writer.programCap, offset);
+
+    writer.mapLen = 0;
+    if (writer.map != NULL)
+        memset(writer.map, 0, writer.mapCap * sizeof(IMAGE_ENTRY));
+}
+
+// quit ends the programs of an image like it ends a script.
+void imageQuit(void)
+{
+    writer.quit = true;
+}
+
+static void freeWriter(void)
+{
+    free(writer.data);
+    free(writer.relocs);
+    free(writer.programs);
+    free(writer.map);
+    memset(&writer, 0, sizeof(writer));
+}
+
+// The image is written to path.tmp and renamed, so path is never half written.
+bool imageWrite(const char *path)
+{
+    imageCompiling = false;
+
+    uint64_t programs = reserve(writer.numPrograms * sizeof(uint64_t), _Alignof(uint64_t));
+    if (!writer.failed)
+        memcpy(writer.data + programs, writer.programs, writer.numPrograms * sizeof(uint64_t));
+    uint64_t relocs = reserve(writer.numRelocs * sizeof(uint64_t), _Alignof(uint64_t));
+    if (!writer.failed)
+        memcpy(writer.data + relocs, writer.relocs, writer.numRelocs * sizeof(uint64_t));
+    if (writer.failed) {
+        freeWriter();
+        return false;
+    }
+
+    IMAGE_HEADER header = {IMAGE_MAGIC, IMAGE_VERSION, writer.numPrograms, sizeof(AST_NODE), sizeof(SYMBOL_TABLE_NODE),
+                           sizeof(SCOPE), sizeof(uintptr_t), writer.len, programs, relocs, writer.numRelocs};
+    memcpy(writer.data, &header, sizeof(header));
+
+    size_t len = strlen(path);
+    char tmpPath[len + 5];
+    memcpy(tmpPath, path, len);
+    memcpy(tmpPath + len, ".tmp", 5);
+
+    FILE *out = fopen(tmpPath, "wb");
+    if (out == NULL) {
+        perror(tmpPath);
+        freeWriter();
+        return false;
+    }
+    bool written = fwrite(writer.data, 1, writer.len, out) == writer.len;
+    written = fclose(out) == 0 && written && rename(tmpPath, path) == 0;
+    if (!written) {
+        perror(path);
+        remove(tmpPath);
+    }
+    freeWriter();
+    return written;
+}
+
+//*********************************
+// Loading
+//*********************************
+
+static bool validHeader(const IMAGE_HEADER *header, size_t size)
+{
+    return memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) == 0
+           && header->version == IMAGE_VERSION
+           && header->nodeSize == sizeof(AST_NODE)
+           && header->symbolSize == sizeof(SYMBOL_TABLE_NODE)
+           && header->scopeSize == sizeof(SCOPE)
+           && header->pointerSize == sizeof(uintptr_t)
+           && header->size == size
+           && header->programs <= size && header->numPrograms <= (size - header->programs) / sizeof(uint64_t)
+           && header->relocs <= size && header->numRelocs <= (size - header->relocs) / sizeof(uint64_t)
+           && header->programs % sizeof(uint64_t) == 0 && header->relocs % sizeof(uint64_t) == 0;
+}
+
+// Turns the offsets of a mapped image into pointers. Returns false if one of
+// them lies outside the image.
+static bool relocate(char *base, size_t size)
+{
+    const IMAGE_HEADER *header = (const IMAGE_HEADER *) base;
+    const uint64_t *relocs = (const uint64_t *) (base + header->relocs);
+    for (uint64_t i = 0; i < header->numRelocs; i++) {
+        if (relocs[i] < sizeof(IMAGE_HEADER) || relocs[i] > size - sizeof(uintptr_t) || relocs[i] % sizeof(uintptr_t) != 0)
+            return false;
+        uintptr_t *pointer = (uintptr_t *) (base + relocs[i]);
+        if (*pointer >= size)
+            return false;
+        *pointer += (uintptr_t) base;
+    }
+
+    const uint64_t *programs = (const uint64_t *) (base + header->programs);
+    for (uint32_t i = 0; i < header->numPrograms; i++) {
+        if (programs[i] > size - astNodeSize(NUM_NODE_TYPE) || programs[i] % _Alignof(AST_NODE) != 0)
+            return false;
+        if (astNodeSize(((const AST_NODE *) (base + programs[i]))->type) > size - programs[i])
+            return false;
+    }
+    return true;
+}
+
+// The image is mapped privately: relocation, native code and memo caches
+// write to its pages, never to the file.
+bool imageRun(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror(path);
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(IMAGE_HEADER)) {
+        fprintf(stderr, "%s is not a program image\n", path);
+        close(fd);
+        return false;
+    }
+
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror(path);
+        return false;
+    }
+    if (!validHeader((const IMAGE_HEADER *) base, size) || !relocate(base, size)) {
+        fprintf(stderr, "%s is not a program image of this build\n", path);
+        munmap(base, size);
+        return false;
+    }
+
+    const IMAGE_HEADER *header = (const IMAGE_HEADER *) base;
+    const uint64_t *programs = (const uint64_t *) (base + header->programs);
+    for (uint32_t i = 0; i < header->numPrograms; i++)
+        runProgram((AST_NODE *) (base + programs[i]), true);
+
+    munmap(base, size);
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef __cilisp_image_h_
+#define __cilisp_image_h_
+
+#include "ciLisp.h"
+
+// Program images: `cilisp --compile script -o file.cli` parses every program
+// of a script, runs prepareProgram() on it and writes the resulting ASTs,
+// with their let_lists, lambdas and scopes, to one file. Pointers in the
+// file are offsets from its start, listed in a relocation table, so
+// `cilisp --image file.cli` maps the file, adds its address to each of them
+// and evaluates the programs in place without running the scanner or parser.
+// An image is only valid for the build that wrote it.
+
+// Set while a script is compiled to an image: parsed programs are added to
+// it instead of being evaluated.
+extern bool imageCompiling;
+
+void imageAddProgram(AST_NODE *root);
+void imageQuit(void);
+
+// Starts an image; programs parsed until imageWrite() go into it.
+void imageBegin(void);
+// Writes the image to path. Returns false on errors.
+bool imageWrite(const char *path);
+
+// Evaluates every program of the image at path in order. Returns false if it
+// cannot be loaded.
+bool imageRun(const char *path);
+
+#endif
@@ -0,0 +1,498 @@
+#include "ciLispJIT.h"
+
+bool jitEnabled = false;
+
+#ifdef CILISP_JIT
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define JIT_BLOCK_SIZE (1 << 16)
+
+// Executable pages holding the native code of one program's lambdas.
+// Blocks hang off the program's ARENA and are unmapped with it.
+typedef struct jit_block {
+    struct jit_block *next;
+    unsigned char *code;
+    size_t size;
+    size_t used;
+} JIT_BLOCK;
+
+// Code is generated for a single expression tree using a simple stack
+// discipline: every node leaves its value in xmm0 and 1 in r13d if it is a
+// DOUBLE_TYPE (0 for INT_TYPE). Left operands are spilled to 16 byte slots
+// at [rsp + 16 * depth] while the right operand is computed.
+// rbx holds the argument array for the whole call.
+typedef struct {
+    unsigned char *code;
+    size_t len, cap;
+    int depth, maxDepth;
+    int letDepth;   // let frames entered inside the lambda body
+    int numArgs;
+    size_t bail;    // exit returning NO_TYPE, see emitIntCheck()
+    bool failed;
+} JIT_COMPILER;
+
+#define EMIT(jit, ...) \
+    emitBytes(jit, (const unsigned char []){__VA_ARGS__}, sizeof((const unsigned char []){__VA_ARGS__}))
+
+static void emitBytes(JIT_COMPILER *jit, const unsigned char *bytes, size_t n)
+{
+    if (jit->len + n > jit->cap) {
+        jit->cap = jit->cap ? jit->cap * 2 : 256;
+        if ((jit->code = realloc(jit->code, jit->cap)) == NULL) {
+            yyerror("Memory allocation failed!");
+            jit->failed = true;
+            jit->len = jit->cap = 0;
+            return;
+        }
+    }
+    memcpy(jit->code + jit->len, bytes, n);
+    jit->len += n;
+}
+
+static void emit32(JIT_COMPILER *jit, int32_t val)
+{
+    emitBytes(jit, (unsigned char *) &val, sizeof(val));
+}
+
+static void emit64(JIT_COMPILER *jit, uint64_t val)
+{
+    emitBytes(jit, (unsigned char *) &val, sizeof(val));
+}
+
+// Emits a jump with a 32 bit displacement and returns where to patch it.
+static size_t emitJump(JIT_COMPILER *jit, const unsigned char *op, size_t opLen)
+{
+    emitBytes(jit, op, opLen);
+    emit32(jit, 0);
+    return jit->len - 4;
+}
+
+// Points the jump at patch to the current end of the code.
+static void patchJump(JIT_COMPILER *jit, size_t patch)
+{
+    if (jit->failed)
+        return;
+    int32_t rel = (int32_t) (jit->len - (patch + 4));
+    memcpy(jit->code + patch, &rel, sizeof(rel));
+}
+
+// Emits a jump with a 32 bit displacement to target, earlier in the code.
+static void emitJumpBack(JIT_COMPILER *jit, const unsigned char *op, size_t opLen, size_t target)
+{
+    emitBytes(jit, op, opLen);
+    emit32(jit, (int32_t) (target - (jit->len + 4)));
+}
+
+static const unsigned char JMP[] = {0xE9};
+static const unsigned char JE[] = {0x0F, 0x84};
+static const unsigned char JNE[] = {0x0F, 0x85};
+static const unsigned char JP[] = {0x0F, 0x8A};
+static const unsigned char JAE[] = {0x0F, 0x83};
+
+// mov rax, imm64; movq xmm<reg>, rax
+static void emitLoadBits(JIT_COMPILER *jit, int reg, uint64_t bits)
+{
+    EMIT(jit, 0x48, 0xB8);
+    emit64(jit, bits);
+    EMIT(jit, 0x66, 0x48, 0x0F, 0x6E, 0xC0 | (reg << 3));
+}
+
+static void emitLoadDouble(JIT_COMPILER *jit, int reg, double val)
+{
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    emitLoadBits(jit, reg, bits);
+}
+
+// mov r13d, isDouble
+static void emitSetType(JIT_COMPILER *jit, bool isDouble)
+{
+    EMIT(jit, 0x41, 0xBD);
+    emit32(jit, isDouble);
+}
+
+// Loads args[slot] into xmm0 and r13d, converting an int64 to a double.
+static void emitLoadArg(JIT_COMPILER *jit, int slot)
+{
+    int32_t offset = slot * (int32_t) sizeof(RET_VAL);
+    EMIT(jit, 0x80, 0xBB);                  // cmp byte [rbx + isInt], 0
+    emit32(jit, offset + offsetof(RET_VAL, isInt));
+    EMIT(jit, 0x00);
+    EMIT(jit, 0x74, 0x0B);                  // je over the cvtsi2sd and jmp
+    EMIT(jit, 0xF2, 0x48, 0x0F, 0x2A, 0x83); // cvtsi2sd xmm0, qword [rbx + ival]
+    emit32(jit, offset + offsetof(RET_VAL, ival));
+    EMIT(jit, 0xEB, 0x08);                  // jmp over the movsd
+    EMIT(jit, 0xF2, 0x0F, 0x10, 0x83);      // movsd xmm0, [rbx + dval]
+    emit32(jit, offset + offsetof(RET_VAL, dval));
+    EMIT(jit, 0x83, 0xBB);                  // cmp dword [rbx + type], DOUBLE_TYPE
+    emit32(jit, offset + offsetof(RET_VAL, type));
+    EMIT(jit, DOUBLE_TYPE);
+    EMIT(jit, 0x0F, 0x94, 0xC0);            // sete al
+    EMIT(jit, 0x44, 0x0F, 0xB6, 0xE8);      // movzx r13d, al
+}
+
+// After an add, sub or mult: an INT_TYPE result that a double may no longer
+// hold exactly leaves the call to the interpreter, which computes it in
+// int64 like every int on the way to it.
+static void emitIntCheck(JIT_COMPILER *jit)
+{
+    EMIT(jit, 0x45, 0x85, 0xED);                // test r13d, r13d
+    size_t isDouble = emitJump(jit, JNE, sizeof(JNE));
+    emitLoadBits(jit, 1, INT64_MAX);
+    EMIT(jit, 0x66, 0x0F, 0x54, 0xC8);          // andpd xmm1, xmm0
+    emitLoadDouble(jit, 2, (double) JIT_INT_LIMIT);
+    EMIT(jit, 0x66, 0x0F, 0x2E, 0xCA);          // ucomisd xmm1, xmm2
+    emitJumpBack(jit, JAE, sizeof(JAE), jit->bail);
+    patchJump(jit, isDouble);
+}
+
+// Calls a libm function taking its arguments in xmm0 (and xmm1).
+static void emitCall(JIT_COMPILER *jit, void *func)
+{
+    EMIT(jit, 0x48, 0xB8);                  // mov rax, func
+    emit64(jit, (uint64_t) (uintptr_t) func);
+    EMIT(jit, 0xFF, 0xD0);                  // call rax
+}
+
+static void compileNode(JIT_COMPILER *jit, AST_NODE *node);
+
+// Computes a right operand with the current value spilled, leaving the left
+// operand in xmm0, the right one in xmm1 and both types or'ed in r13d.
+static void compileOperand(JIT_COMPILER *jit, AST_NODE *node)
+{
+    int32_t slot = jit->depth * 16;
+    EMIT(jit, 0xF2, 0x0F, 0x11, 0x84, 0x24);    // movsd [rsp + slot], xmm0
+    emit32(jit, slot);
+    EMIT(jit, 0x44, 0x89, 0xAC, 0x24);          // mov [rsp + slot + 8], r13d
+    emit32(jit, slot + 8);
+
+    if (++jit->depth > jit->maxDepth)
+        jit->maxDepth = jit->depth;
+    compileNode(jit, node);
+    jit->depth--;
+
+    EMIT(jit, 0x66, 0x0F, 0x28, 0xC8);          // movapd xmm1, xmm0
+    EMIT(jit, 0xF2, 0x0F, 0x10, 0x84, 0x24);    // movsd xmm0, [rsp + slot]
+    emit32(jit, slot);
+    EMIT(jit, 0x44, 0x0B, 0xAC, 0x24);          // or r13d, [rsp + slot + 8]
+    emit32(jit, slot + 8);
+}
+
+// Division and remainder by zero leave NAN, as evalFuncNode() does.
+// Division by zero also yields an INT_TYPE.
+static void compileDivide(JIT_COMPILER *jit, OPER_TYPE oper)
+{
+    EMIT(jit, 0x66, 0x0F, 0x57, 0xD2);          // xorpd xmm2, xmm2
+    EMIT(jit, 0x66, 0x0F, 0x2E, 0xCA);          // ucomisd xmm1, xmm2
+    size_t unordered = emitJump(jit, JP, sizeof(JP));
+    size_t nonZero = emitJump(jit, JNE, sizeof(JNE));
+    emitLoadDouble(jit, 0, NAN);
+    if (oper == DIV_OPER)
+        emitSetType(jit, false);
+    size_t done = emitJump(jit, JMP, sizeof(JMP));
+
+    patchJump(jit, unordered);
+    patchJump(jit, nonZero);
+    if (oper == DIV_OPER)
+        EMIT(jit, 0xF2, 0x0F, 0x5E, 0xC1);      // divsd xmm0, xmm1
+    else
+        emitCall(jit, (void *) remainder);
+    patchJump(jit, done);
+}
+
+// Sets xmm0 to the 0 or 1 in al, as an INT_TYPE.
+static void emitBoolResult(JIT_COMPILER *jit)
+{
+    EMIT(jit, 0x0F, 0xB6, 0xC0);                // movzx eax, al
+    EMIT(jit, 0xF2, 0x0F, 0x2A, 0xC0);          // cvtsi2sd xmm0, eax
+    EMIT(jit, 0x45, 0x31, 0xED);                // xor r13d, r13d
+}
+
+static void compileFunc(JIT_COMPILER *jit, FUNC_AST_NODE *func)
+{
+    // read, rand, print and lambda calls stay interpreted, and so do calls
+    // whose operand count prints a message
+    if (operArity(func->oper) == 0 || !validOperandCount(func->oper, func->numOps)) {
+        jit->failed = true;
+        return;
+    }
+    compileNode(jit, func->ops[0]);
+    if (operArity(func->oper) == 2)
+        compileOperand(jit, func->ops[1]);
+
+    switch (func->oper) {
+        case NEG_OPER:
+            emitLoadDouble(jit, 1, -0.0);
+            EMIT(jit, 0x66, 0x0F, 0x57, 0xC1);  // xorpd xmm0, xmm1
+            break;
+        case ABS_OPER:
+            emitLoadBits(jit, 1, INT64_MAX);
+            EMIT(jit, 0x66, 0x0F, 0x54, 0xC1);  // andpd xmm0, xmm1
+            break;
+        case EXP_OPER:
+            emitCall(jit, (void *) exp);
+            break;
+        case SQRT_OPER:
+            EMIT(jit, 0xF2, 0x0F, 0x51, 0xC0);  // sqrtsd xmm0, xmm0
+            break;
+        case LOG_OPER:
+            emitCall(jit, (void *) log);
+            break;
+        case EXP2_OPER:
+            emitCall(jit, (void *) exp2);
+            break;
+        case CBRT_OPER:
+            emitCall(jit, (void *) cbrt);
+            break;
+        case ADD_OPER:
+        case MULT_OPER:
+            for (int i = 2;; i++) {
+                if (func->oper == ADD_OPER)
+                    EMIT(jit, 0xF2, 0x0F, 0x58, 0xC1);  // addsd xmm0, xmm1
+                else
+                    EMIT(jit, 0xF2, 0x0F, 0x59, 0xC1);  // mulsd xmm0, xmm1
+                emitIntCheck(jit);
+                if (i == func->numOps)
+                    break;
+                compileOperand(jit, func->ops[i]);
+            }
+            break;
+        case SUB_OPER:
+            EMIT(jit, 0xF2, 0x0F, 0x5C, 0xC1);  // subsd xmm0, xmm1
+            emitIntCheck(jit);
+            break;
+        case DIV_OPER:
+        case REMAINDER_OPER:
+            compileDivide(jit, func->oper);
+            break;
+        case POW_OPER:
+            emitCall(jit, (void *) pow);
+            break;
+        case MAX_OPER:
+            emitCall(jit, (void *) fmax);
+            break;
+        case MIN_OPER:
+            emitCall(jit, (void *) fmin);
+            break;
+        case HYPOT_OPER:
+            emitCall(jit, (void *) hypot);
+            break;
+        case EQUAL_OPER:
+            EMIT(jit, 0x66, 0x0F, 0x2E, 0xC1);  // ucomisd xmm0, xmm1
+            EMIT(jit, 0x0F, 0x94, 0xC0);        // sete al
+            EMIT(jit, 0x0F, 0x9B, 0xC1);        // setnp cl
+            EMIT(jit, 0x20, 0xC8);              // and al, cl
+            emitBoolResult(jit);
+            break;
+        case LESS_OPER:
+            EMIT(jit, 0x66, 0x0F, 0x2E, 0xC8);  // ucomisd xmm1, xmm0
+            EMIT(jit, 0x0F, 0x97, 0xC0);        // seta al
+            emitBoolResult(jit);
+            break;
+        case GREATER_OPER:
+            EMIT(jit, 0x66, 0x0F, 0x2E, 0xC1);  // ucomisd xmm0, xmm1
+            EMIT(jit, 0x0F, 0x97, 0xC0);        // seta al
+            emitBoolResult(jit);
+            break;
+        default:
+            break;
+    }
+}
+
+static void compileCond(JIT_COMPILER *jit, COND_AST_NODE *cond)
+{
+    // a NAN condition is nonzero and takes the true branch
+    compileNode(jit, cond->cond);
+    EMIT(jit, 0x66, 0x0F, 0x57, 0xC9);          // xorpd xmm1, xmm1
+    EMIT(jit, 0x66, 0x0F, 0x2E, 0xC1);          // ucomisd xmm0, xmm1
+    EMIT(jit, 0x7A, 0x06);                      // jp over the je
+    size_t isFalse = emitJump(jit, JE, sizeof(JE));
+    compileNode(jit, cond->trueCond);
+    size_t done = emitJump(jit, JMP, sizeof(JMP));
+    patchJump(jit, isFalse);
+    compileNode(jit, cond->falseCond);
+    patchJump(jit, done);
+}
+
+static void compileNode(JIT_COMPILER *jit, AST_NODE *node)
+{
+    if (jit->failed)
+        return;
+
+    if (node->scope != NULL)
+        jit->letDepth++;
+
+    switch (node->type) {
+        case NUM_NODE_TYPE: {
+            RET_VAL val = evalNumNode(&node->data.number);
+            emitLoadDouble(jit, 0, asDouble(val));
+            emitSetType(jit, val.type == DOUBLE_TYPE);
+            break;
+        }
+        case SYMBOL_NODE_TYPE: {
+            // only the lambda's own arguments; let bindings and outer
+            // variables need the interpreter's frames
+            LEXICAL_ADDRESS *addr = &node->data.symbol.addr;
+            if (addr->depth != jit->letDepth || addr->slot >= jit->numArgs)
+                jit->failed = true;
+            else
+                emitLoadArg(jit, addr->slot);
+            break;
+        }
+        case FUNC_NODE_TYPE:
+            compileFunc(jit, &node->data.function);
+            break;
+        case COND_NODE_TYPE:
+            compileCond(jit, &node->data.condition);
+            break;
+        default:
+            jit->failed = true;
+    }
+
+    if (node->scope != NULL)
+        jit->letDepth--;
+}
+
+// Copies code into executable memory owned by arena.
+static void *installCode(ARENA *arena, unsigned char *code, size_t len)
+{
+    JIT_BLOCK *block = arena->jit;
+    if (block == NULL || block->used + len > block->size) {
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t size = len > JIT_BLOCK_SIZE ? (len + page - 1) / page * page : JIT_BLOCK_SIZE;
+        if ((block = malloc(sizeof(JIT_BLOCK))) == NULL) {
+            yyerror("Memory allocation failed!");
+            return NULL;
+        }
+        block->code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block->code == MAP_FAILED) {
+            free(block);
+            return NULL;
+        }
+        block->size = size;
+        block->used = 0;
+        block->next = arena->jit;
+        arena->jit = block;
+    }
+    else if (mprotect(block->code, block->size, PROT_READ | PROT_WRITE) != 0) {
+        return NULL;
+    }
+
+    void *entry = block->code + block->used;
+    memcpy(entry, code, len);
+    block->used += (len + 15) & ~(size_t) 15;
+    if (mprotect(block->code, block->size, PROT_READ | PROT_EXEC) != 0)
+        return NULL;
+    return entry;
+}
+
+// Returns native code for lambda, or NULL if its body uses anything other
+// than its arguments, numbers, conds and builtin arithmetic.
+static JIT_FUNC *compileLambda(SYMBOL_TABLE_NODE *lambda, ARENA *arena)
+{
+    JIT_COMPILER jit = {0};
+    jit.numArgs = lambda->scope->numSlots;
+
+    EMIT(&jit, 0x53);                           // push rbx
+    EMIT(&jit, 0x41, 0x55);                     // push r13
+    EMIT(&jit, 0x48, 0x81, 0xEC);               // sub rsp, frame
+    size_t frame = jit.len;
+    emit32(&jit, 0);
+    EMIT(&jit, 0x48, 0x89, 0xFB);               // mov rbx, rdi
+    size_t body = emitJump(&jit, JMP, sizeof(JMP));
+
+    // return JIT_RESULT {_, NO_TYPE}, reached with rsp where the body keeps it
+    jit.bail = jit.len;
+    EMIT(&jit, 0xB8);                           // mov eax, NO_TYPE
+    emit32(&jit, NO_TYPE);
+    EMIT(&jit, 0x48, 0x81, 0xC4);               // add rsp, frame
+    size_t bailFrame = jit.len;
+    emit32(&jit, 0);
+    EMIT(&jit, 0x41, 0x5D);                     // pop r13
+    EMIT(&jit, 0x5B);                           // pop rbx
+    EMIT(&jit, 0xC3);                           // ret
+    patchJump(&jit, body);
+
+    compileNode(&jit, lambda->val);
+
+    // return JIT_RESULT {xmm0, r13d + 1}, INT_TYPE or DOUBLE_TYPE in eax
+    int32_t frameSize = jit.maxDepth * 16 + 8; // keeps rsp 16 byte aligned for calls
+    EMIT(&jit, 0x41, 0x8D, 0x45, INT_TYPE);     // lea eax, [r13 + INT_TYPE]
+    EMIT(&jit, 0x48, 0x81, 0xC4);               // add rsp, frame
+    emit32(&jit, frameSize);
+    EMIT(&jit, 0x41, 0x5D);                     // pop r13
+    EMIT(&jit, 0x5B);                           // pop rbx
+    EMIT(&jit, 0xC3);                           // ret
+
+    JIT_FUNC *func = NULL;
+    if (!jit.failed) {
+        memcpy(jit.code + frame, &frameSize, sizeof(frameSize));
+        memcpy(jit.code + bailFrame, &frameSize, sizeof(frameSize));
+        void *entry = installCode(arena, jit.code, jit.len);
+        if (entry != NULL && (func = arenaAlloc(arena, sizeof(JIT_FUNC))) != NULL) {
+            func->entry = (JIT_ENTRY) entry;
+            func->numArgs = jit.numArgs;
+            TRACE(TRACE_EVAL, "jit: %s compiled to %zu bytes\n", lambda->ident, jit.len);
+        }
+    }
+    free(jit.code);
+    return func;
+}
+
+static void jitNode(AST_NODE *node, ARENA *arena)
+{
+    if (node == NULL)
+        return;
+
+    for (SYMBOL_TABLE_NODE *sym = node->table; sym != NULL; sym = sym->next) {
+        if (sym->type == LAMBDA_TYPE && sym->scope != NULL)
+            sym->jit = compileLambda(sym, arena);
+        jitNode(sym->val, arena);
+    }
+
+    switch (node->type) {
+        case FUNC_NODE_TYPE:
+            for (int i = 0; i < node->data.function.numOps; i++)
+                jitNode(node->data.function.ops[i], arena);
+            break;
+        case COND_NODE_TYPE:
+            jitNode(node->data.condition.cond, arena);
+            jitNode(node->data.condition.trueCond, arena);
+            jitNode(node->data.condition.falseCond, arena);
+            break;
+        default:
+            break;
+    }
+}
+
+// Compiles every lambda of a resolved program that can run natively.
+// The code lives until arena is reset or freed.
+void jitProgram(AST_NODE *root, ARENA *arena)
+{
+    jitNode(root, arena);
+}
+
+void jitFreeBlocks(JIT_BLOCK **blocks)
+{
+    while (*blocks != NULL) {
+        JIT_BLOCK *next = (*blocks)->next;
+        munmap((*blocks)->code, (*blocks)->size);
+        free(*blocks);
+        *blocks = next;
+    }
+}
+
+#else
+
+void jitProgram(AST_NODE *root, ARENA *arena)
+{
+}
+
+void jitFreeBlocks(struct jit_block **blocks)
+{
+}
+
+#endif
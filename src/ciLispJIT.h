@@ -0,0 +1,51 @@
+#ifndef __cilisp_jit_h_
+#define __cilisp_jit_h_
+
+#include "ciLisp.h"
+
+// Native x86-64 code is only generated on x86-64 hosts; elsewhere (or when
+// built with -DCILISP_NO_JIT) jitProgram() leaves every lambda interpreted.
+#if defined(__x86_64__) && !defined(CILISP_NO_JIT)
+#define CILISP_JIT
+#endif
+
+// What native code returns: its value is computed in doubles, and a struct
+// of a double and an int comes back in xmm0 and eax. The type is NO_TYPE if
+// an int add, sub or mult went past what a double holds exactly.
+typedef struct {
+    double val;
+    NUM_TYPE type;
+} JIT_RESULT;
+
+// Native code for a lambda. It takes the argument values in order and
+// returns the value the interpreter would, as long as ints fit in a double.
+typedef JIT_RESULT (*JIT_ENTRY)(const RET_VAL *args);
+
+// Doubles hold every int up to 2^53 exactly.
+#define JIT_INT_LIMIT (INT64_C(1) << 53)
+
+typedef struct jit_func {
+    JIT_ENTRY entry;
+    int numArgs;
+} JIT_FUNC;
+
+void jitProgram(AST_NODE *root, ARENA *arena);
+void jitFreeBlocks(struct jit_block **blocks);
+
+// Runs native code for a call into *result. Returns false, leaving the call
+// to the interpreter, if an int argument, an int computed on the way or the
+// int result is too large for a double to hold exactly.
+static inline bool jitCall(const JIT_FUNC *func, const RET_VAL *args, RET_VAL *result)
+{
+    for (int i = 0; i < func->numArgs; i++) {
+        if (args[i].isInt && (args[i].ival > JIT_INT_LIMIT || args[i].ival < -JIT_INT_LIMIT))
+            return false;
+    }
+    JIT_RESULT native = func->entry(args);
+    if (native.type == NO_TYPE || (native.type == INT_TYPE && fabs(native.val) >= JIT_INT_LIMIT))
+        return false;
+    *result = typedVal(native.type, native.val);
+    return true;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include "ciLispVM.h"
+#include "ciLispOutput.h"
+
+// An interpreter context: the settings its programs are compiled with and
+// where their output goes. Everything else a program needs is in its
+// CILISP_PROGRAM or in the calling thread.
+struct cilisp_context {
+    CILISP_OPTIONS options;
+};
+
+CILISP_CONTEXT *cilispCreateContext(const CILISP_OPTIONS *options)
+{
+    CILISP_CONTEXT *context;
+    if ((context = calloc(sizeof(CILISP_CONTEXT), 1)) == NULL)
+        return NULL;
+
+    if (options != NULL)
+        context->options = *options;
+    else
+        context->options = (CILISP_OPTIONS){TREE_EVAL_MODE, false, false, NULL, FIXED_NUMBER_FORMAT};
+    return context;
+}
+
+void cilispDestroyContext(CILISP_CONTEXT *context)
+{
+    free(context);
+}
+
+// What a call into the library changes in the calling thread, restored
+// when it returns.
+typedef struct {
+    FILE *output;
+    NUMBER_FORMAT format;
+} SAVED_OUTPUT;
+
+static SAVED_OUTPUT enterContext(CILISP_CONTEXT *context)
+{
+    SAVED_OUTPUT saved = {outputStream, numberFormat};
+    outputStream = context->options.output;
+    numberFormat = context->options.format;
+    return saved;
+}
+
+// Everything printed reaches the context's stream before the call returns.
+static void leaveContext(SAVED_OUTPUT saved)
+{
+    outputFlush();
+    outputStream = saved.output;
+    numberFormat = saved.format;
+}
+
+CILISP_PROGRAM *cilispCompile(CILISP_CONTEXT *context, const char *source, const char *const *names, int numNames)
+{
+    SAVED_OUTPUT saved = enterContext(context);
+    // the scanner only reads source, compileWithOptions() parses a copy
+    CILISP_PROGRAM *program = compileWithOptions((char *) source, &context->options, names, numNames);
+    leaveContext(saved);
+    return program;
+}
+
+RET_VAL cilispEvaluate(CILISP_CONTEXT *context, CILISP_PROGRAM *program, const RET_VAL *values)
+{
+    SAVED_OUTPUT saved = enterContext(context);
+    RET_VAL result = evalWithBindings(program, values);
+    leaveContext(saved);
+    return result;
+}
+
+bool cilispDefine(CILISP_CONTEXT *context, const char *source)
+{
+    SAVED_OUTPUT saved = enterContext(context);
+    bool defined = defineWithOptions((char *) source, &context->options);
+    leaveContext(saved);
+    return defined;
+}
+
+void cilispRelease(CILISP_PROGRAM *program)
+{
+    freeProgram(program);
+}
+
+void cilispReleaseThread(void)
+{
+    releaseProgram();
+    arenaFree(&programArena);
+    vmReleaseStack();
+    sessionFree();
+    outputRelease();
+}
@@ -0,0 +1,254 @@
+#include "ciLispMemo.h"
+
+#include <stdint.h>
+
+bool memoEnabled = false;
+bool memoStats = false;
+
+#define MEMO_SETS (MEMO_ENTRIES / MEMO_WAYS)
+
+//*********************************
+// Purity Analysis
+//*********************************
+
+// Every lambda of the program being analysed.
+typedef struct {
+    SYMBOL_TABLE_NODE **lambdas;
+    int numLambdas, cap;
+} MEMO_ANALYSIS;
+
+static bool pureNode(AST_NODE *node, SCOPE *scope, int letDepth);
+
+// A call is pure if it reaches a lambda that is still considered pure with
+// the right number of arguments; anything else prints an error every time.
+static bool pureCall(FUNC_AST_NODE *func, SCOPE *scope, int numArgs)
+{
+    if (func->addr.depth < 0)
+        return false;
+    for (int depth = func->addr.depth; depth > 0 && scope != NULL; depth--)
+        scope = scope->parent;
+    if (scope == NULL)
+        return false;
+
+    SYMBOL_TABLE_NODE *callee = scope->slots[func->addr.slot];
+    return callee->type == LAMBDA_TYPE && callee->memo != NULL && callee->scope->numSlots == numArgs;
+}
+
+// Whether node always gives the same value for the same lambda arguments
+// without printing anything. letDepth counts the let frames entered inside
+// the lambda body, so a symbol at that depth is one of its arguments.
+static bool pureNode(AST_NODE *node, SCOPE *scope, int letDepth)
+{
+    if (node == NULL)
+        return false;
+
+    if (node->scope != NULL) {
+        scope = node->scope;
+        letDepth++;
+        // nested lambdas are left alone, and int bindings may warn about precision loss
+        for (int slot = 0; slot < scope->numSlots; slot++) {
+            SYMBOL_TABLE_NODE *sym = scope->slots[slot];
+            if (sym->type != VARIABLE_TYPE || sym->val_type == INT_TYPE || !pureNode(sym->val, scope, letDepth))
+                return false;
+        }
+    }
+
+    switch (node->type) {
+        case NUM_NODE_TYPE:
+            return true;
+        case SYMBOL_NODE_TYPE: {
+            // arguments and let bindings inside the body, not outer variables
+            LEXICAL_ADDRESS *addr = &node->data.symbol.addr;
+            return addr->depth >= 0 && addr->depth <= letDepth;
+        }
+        case FUNC_NODE_TYPE: {
+            FUNC_AST_NODE *func = &node->data.function;
+            int count = func->numOps;
+            for (int i = 0; i < count; i++) {
+                if (!pureNode(func->ops[i], scope, letDepth))
+                    return false;
+            }
+            if (func->oper == CUSTOM_OPER)
+                return pureCall(func, scope, count);
+            if (func->oper == READ_OPER || func->oper == RAND_OPER || func->oper == PRINT_OPER)
+                return false;
+            return validOperandCount(func->oper, count);
+        }
+        case COND_NODE_TYPE:
+            return pureNode(node->data.condition.cond, scope, letDepth)
+                   && pureNode(node->data.condition.trueCond, scope, letDepth)
+                   && pureNode(node->data.condition.falseCond, scope, letDepth);
+        default:
+            return false;
+    }
+}
+
+// Gives every lambda of the program a cache, assuming it is pure for now.
+static void collectLambdas(MEMO_ANALYSIS *analysis, AST_NODE *node, ARENA *arena)
+{
+    if (node == NULL)
+        return;
+
+    for (SYMBOL_TABLE_NODE *sym = node->table; sym != NULL; sym = sym->next) {
+        if (sym->type == LAMBDA_TYPE && sym->scope != NULL) {
+            if (analysis->numLambdas == analysis->cap) {
+                analysis->cap = analysis->cap ? analysis->cap * 2 : 16;
+                SYMBOL_TABLE_NODE **grown = realloc(analysis->lambdas, analysis->cap * sizeof(SYMBOL_TABLE_NODE *));
+                if (grown == NULL) {
+                    yyerror("Memory allocation failed!");
+                    return;
+                }
+                analysis->lambdas = grown;
+            }
+            if ((sym->memo = arenaAlloc(arena, sizeof(MEMO_CACHE))) == NULL) {
+                yyerror("Memory allocation failed!");
+                return;
+            }
+            sym->memo->ident = sym->ident;
+            sym->memo->numArgs = sym->scope->numSlots;
+            analysis->lambdas[analysis->numLambdas++] = sym;
+        }
+        collectLambdas(analysis, sym->val, arena);
+    }
+
+    switch (node->type) {
+        case FUNC_NODE_TYPE:
+            for (int i = 0; i < node->data.function.numOps; i++)
+                collectLambdas(analysis, node->data.function.ops[i], arena);
+            break;
+        case COND_NODE_TYPE:
+            collectLambdas(analysis, node->data.condition.cond, arena);
+            collectLambdas(analysis, node->data.condition.trueCond, arena);
+            collectLambdas(analysis, node->data.condition.falseCond, arena);
+            break;
+        default:
+            break;
+    }
+}
+
+// Gives every pure lambda of a resolved program a result cache.
+// Lambdas start out pure and lose their cache until nothing changes, so
+// (mutually) recursive lambdas stay pure unless something else spoils them.
+// The caches hang off arena and are released with it.
+void memoProgram(AST_NODE *root, ARENA *arena)
+{
+    MEMO_ANALYSIS analysis = {0};
+    collectLambdas(&analysis, root, arena);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < analysis.numLambdas; i++) {
+            SYMBOL_TABLE_NODE *sym = analysis.lambdas[i];
+            if (sym->memo != NULL && !pureNode(sym->val, sym->scope, 0)) {
+                sym->memo = NULL;
+                changed = true;
+            }
+        }
+    }
+
+    for (int i = 0; i < analysis.numLambdas; i++) {
+        MEMO_CACHE *memo = analysis.lambdas[i]->memo;
+        if (memo != NULL) {
+            TRACE(TRACE_EVAL, "memo: %s is pure\n", memo->ident);
+            memo->next = arena->memo;
+            arena->memo = memo;
+        }
+    }
+    free(analysis.lambdas);
+}
+
+// Prints the counters of every cache if --memo-stats was given and frees
+// their entries. The caches themselves belong to the arena.
+void memoRelease(MEMO_CACHE **caches)
+{
+    for (MEMO_CACHE *memo = *caches; memo != NULL; memo = memo->next) {
+        if (memoStats)
+            fprintf(stderr, "memo: %s hits %zu misses %zu evictions %zu\n",
+                    memo->ident, memo->hits, memo->misses, memo->evictions);
+        free(memo->entries);
+        free(memo->used);
+    }
+    *caches = NULL;
+}
+
+//*********************************
+// Cache Lookups
+//*********************************
+
+static size_t hashArgs(const RET_VAL *args, int numArgs)
+{
+    // small whole numbers differ only in the high bits of a double,
+    // so every value is mixed all the way down to the low bits
+    uint64_t hash = 0;
+    for (int i = 0; i < numArgs; i++) {
+        uint64_t bits;
+        memcpy(&bits, &args[i].ival, sizeof(bits));
+        hash = (hash ^ bits ^ args[i].type ^ (uint64_t) args[i].isInt << 8) * 0x9E3779B97F4A7C15;
+        hash ^= hash >> 29;
+        hash *= 0xBF58476D1CE4E5B9;
+        hash ^= hash >> 32;
+    }
+    return (size_t) (hash % MEMO_SETS) * MEMO_WAYS;
+}
+
+// Arguments match bit for bit, so -0 and 0 or two NANs are told apart
+// exactly as they would be printed. Values are canonical, so an int64 and a
+// double never hold the same number.
+static bool sameArgs(const RET_VAL *key, const RET_VAL *args, int numArgs)
+{
+    for (int i = 0; i < numArgs; i++) {
+        if (key[i].type != args[i].type || key[i].isInt != args[i].isInt
+            || memcmp(&key[i].ival, &args[i].ival, sizeof(int64_t)) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Sets *result to the cached value for args, if there is one.
+// result may point at args.
+bool memoLookup(MEMO_CACHE *memo, const RET_VAL *args, RET_VAL *result)
+{
+    if (memo->entries != NULL) {
+        size_t set = hashArgs(args, memo->numArgs);
+        for (size_t entry = set; entry < set + MEMO_WAYS; entry++) {
+            RET_VAL *key = &memo->entries[entry * (memo->numArgs + 1)];
+            if (memo->used[entry] && sameArgs(key, args, memo->numArgs)) {
+                memo->hits++;
+                *result = key[memo->numArgs];
+                return true;
+            }
+        }
+    }
+    memo->misses++;
+    return false;
+}
+
+// Caches result for args, replacing the ways of a full set in turn.
+void memoStore(MEMO_CACHE *memo, const RET_VAL *args, RET_VAL result)
+{
+    if (memo->entries == NULL) {
+        memo->entries = malloc(MEMO_ENTRIES * (memo->numArgs + 1) * sizeof(RET_VAL));
+        memo->used = calloc(MEMO_ENTRIES, sizeof(bool));
+        if (memo->entries == NULL || memo->used == NULL) {
+            free(memo->entries);
+            free(memo->used);
+            memo->entries = NULL;
+            memo->used = NULL;
+            return;
+        }
+    }
+
+    size_t set = hashArgs(args, memo->numArgs);
+    size_t entry = set;
+    while (entry < set + MEMO_WAYS && memo->used[entry]
+           && !sameArgs(&memo->entries[entry * (memo->numArgs + 1)], args, memo->numArgs))
+        entry++;
+    if (entry == set + MEMO_WAYS)
+        entry = set + memo->evictions++ % MEMO_WAYS;
+
+    RET_VAL *key = &memo->entries[entry * (memo->numArgs + 1)];
+    memcpy(key, args, memo->numArgs * sizeof(RET_VAL));
+    key[memo->numArgs] = result;
+    memo->used[entry] = true;
+}
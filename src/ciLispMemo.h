@@ -0,0 +1,33 @@
+#ifndef __cilisp_memo_h_
+#define __cilisp_memo_h_
+
+#include "ciLisp.h"
+
+// Set by --memo: calls to pure lambdas are answered from a cache of recent
+// results keyed on the argument values. --memo-stats also sets memoStats,
+// which prints every cache's counters when its program is released.
+extern bool memoEnabled;
+extern bool memoStats;
+
+// Entries per cache, in sets of MEMO_WAYS that an argument tuple hashes to.
+#define MEMO_ENTRIES 512
+#define MEMO_WAYS 4
+
+// Result cache of one pure lambda, allocated in the program's arena.
+// Each entry is numArgs argument values followed by the result.
+typedef struct memo_cache {
+    struct memo_cache *next; // other caches of the same arena
+    char *ident;
+    int numArgs;
+    RET_VAL *entries;        // allocated on the first store
+    bool *used;
+    ARENA *arena;
+    size_t hits, misses, evictions;
+} MEMO_CACHE;
+
+void memoProgram(AST_NODE *root, ARENA *arena);
+void memoRelease(MEMO_CACHE **caches);
+bool memoLookup(MEMO_CACHE *memo, const RET_VAL *args, RET_VAL *result);
+void memoStore(MEMO_CACHE *memo, const RET_VAL *args, RET_VAL result);
+
+#endif
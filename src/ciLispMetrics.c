@@ -0,0 +1,174 @@
+#include "ciLispMetrics.h"
+
+#include <pthread.h>
+#include <time.h>
+
+bool metricsEnabled = false;
+char *metricsPath = NULL;
+volatile sig_atomic_t metricsDumpRequested = 0;
+
+_Thread_local METRICS *threadMetrics;
+
+// Every thread's counters, newest first.
+static METRICS *metricsBlocks;
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counts of a thread that could not get a block of its own.
+static METRICS spareMetrics;
+
+// Upper bounds of the program latency buckets in seconds; the last is +Inf.
+static const double bucketBounds[METRICS_BUCKETS - 1] = {1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1, 10};
+
+static const char *const nodeTypeNames[METRICS_NODE_TYPES] = {
+        "number",
+        "function",
+        "symbol",
+        "cond"
+};
+
+// Gives this thread a block of counters.
+METRICS *metricsRegister(void)
+{
+    if ((threadMetrics = calloc(sizeof(METRICS), 1)) == NULL)
+        return &spareMetrics;
+
+    pthread_mutex_lock(&metricsLock);
+    threadMetrics->next = metricsBlocks;
+    metricsBlocks = threadMetrics;
+    pthread_mutex_unlock(&metricsLock);
+    return threadMetrics;
+}
+
+static void requestDump(int sig)
+{
+    metricsDumpRequested = 1;
+}
+
+static void dumpAtExit(void)
+{
+    metricsDump();
+}
+
+// Enables metrics, written to path at exit (quit included) and on SIGUSR1.
+bool metricsInit(char *path)
+{
+    struct sigaction action = {0};
+    action.sa_handler = requestDump;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &action, NULL) != 0) {
+        perror("sigaction");
+        return false;
+    }
+    metricsPath = path;
+    metricsEnabled = true;
+    atexit(dumpAtExit);
+    return true;
+}
+
+double metricsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Records a top level program whose evaluation began at start (metricsNow()).
+void metricsProgramDone(double start)
+{
+    if (!metricsEnabled)
+        return;
+
+    double seconds = metricsNow() - start;
+    METRICS *metrics = metricsForThread();
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && seconds > bucketBounds[bucket])
+        bucket++;
+    metrics->programBuckets[bucket]++;
+    metrics->programs++;
+    metrics->programSeconds += seconds;
+}
+
+// Writes the metrics if SIGUSR1 arrived since the last call.
+void metricsPoll(void)
+{
+    if (metricsDumpRequested) {
+        metricsDumpRequested = 0;
+        metricsDump();
+    }
+}
+
+static void printCounter(FILE *out, const char *name, const char *help, size_t val)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %zu\n", name, help, name, name, val);
+}
+
+// Writes the totals of every thread to metricsPath, replacing it in one
+// rename so a scraper never sees half a file. Other threads keep counting
+// while this runs, so a total may miss their latest few events.
+bool metricsDump(void)
+{
+    if (!metricsEnabled)
+        return false;
+
+    // one dump at a time, even if several threads saw the signal
+    METRICS total = {0};
+    pthread_mutex_lock(&metricsLock);
+    for (METRICS *metrics = metricsBlocks; metrics != NULL; metrics = metrics->next) {
+        for (int i = 0; i < METRICS_OPERS; i++)
+            total.operCalls[i] += metrics->operCalls[i];
+        for (int i = 0; i < METRICS_NODE_TYPES; i++)
+            total.nodeVisits[i] += metrics->nodeVisits[i];
+        for (int i = 0; i < METRICS_BUCKETS; i++)
+            total.programBuckets[i] += metrics->programBuckets[i];
+        total.lookups += metrics->lookups;
+        total.lookupDepth += metrics->lookupDepth;
+        total.lambdaCalls += metrics->lambdaCalls;
+        total.bytesAllocated += metrics->bytesAllocated;
+        total.programs += metrics->programs;
+        total.programSeconds += metrics->programSeconds;
+    }
+
+    size_t len = strlen(metricsPath);
+    char tmpPath[len + 5];
+    memcpy(tmpPath, metricsPath, len);
+    memcpy(tmpPath + len, ".tmp", 5);
+    FILE *out;
+    if ((out = fopen(tmpPath, "w")) == NULL) {
+        perror(tmpPath);
+        pthread_mutex_unlock(&metricsLock);
+        return false;
+    }
+
+    fprintf(out, "# HELP cilisp_oper_calls_total Builtin operator calls, or VM instructions for them.\n");
+    fprintf(out, "# TYPE cilisp_oper_calls_total counter\n");
+    for (int i = 0; i < METRICS_OPERS; i++)
+        fprintf(out, "cilisp_oper_calls_total{oper=\"%s\"} %zu\n", funcNames[i], total.operCalls[i]);
+
+    fprintf(out, "# HELP cilisp_eval_nodes_total AST nodes evaluated by the tree evaluator.\n");
+    fprintf(out, "# TYPE cilisp_eval_nodes_total counter\n");
+    for (int i = 0; i < METRICS_NODE_TYPES; i++)
+        fprintf(out, "cilisp_eval_nodes_total{type=\"%s\"} %zu\n", nodeTypeNames[i], total.nodeVisits[i]);
+
+    printCounter(out, "cilisp_lookups_total", "Symbol and lambda lookups.", total.lookups);
+    printCounter(out, "cilisp_lookup_depth_total", "Frames walked by symbol and lambda lookups.", total.lookupDepth);
+    printCounter(out, "cilisp_lambda_calls_total", "Lambda calls, including native and cached ones.", total.lambdaCalls);
+    printCounter(out, "cilisp_allocated_bytes_total", "Bytes allocated from program arenas.", total.bytesAllocated);
+
+    fprintf(out, "# HELP cilisp_program_seconds Time to evaluate one top level program.\n");
+    fprintf(out, "# TYPE cilisp_program_seconds histogram\n");
+    size_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+        cumulative += total.programBuckets[i];
+        fprintf(out, "cilisp_program_seconds_bucket{le=\"%g\"} %zu\n", bucketBounds[i], cumulative);
+    }
+    fprintf(out, "cilisp_program_seconds_bucket{le=\"+Inf\"} %zu\n", total.programs);
+    fprintf(out, "cilisp_program_seconds_sum %.9f\n", total.programSeconds);
+    fprintf(out, "cilisp_program_seconds_count %zu\n", total.programs);
+
+    bool written = fclose(out) == 0 && rename(tmpPath, metricsPath) == 0;
+    if (!written)
+        perror(metricsPath);
+    pthread_mutex_unlock(&metricsLock);
+    return written;
+}
@@ -0,0 +1,55 @@
+#ifndef __cilisp_metrics_h_
+#define __cilisp_metrics_h_
+
+#include "ciLisp.h"
+
+#include <signal.h>
+
+// Set by --metrics FILE: the evaluators count what they do and the totals
+// are written to metricsPath in the Prometheus text format on SIGUSR1 (at
+// the next program boundary) and at exit.
+extern bool metricsEnabled;
+extern char *metricsPath;
+extern volatile sig_atomic_t metricsDumpRequested;
+
+#define METRICS_OPERS NUM_OPERS
+#define METRICS_NODE_TYPES (COND_NODE_TYPE + 1)
+#define METRICS_BUCKETS 9
+
+// Counters of one thread. Every thread that evaluates gets its own block,
+// which stays on metricsBlocks when the thread exits, so nothing is shared
+// while counting; metricsDump() adds them all up.
+typedef struct metrics {
+    size_t operCalls[METRICS_OPERS];     // builtin calls and VM instructions by operator
+    size_t nodeVisits[METRICS_NODE_TYPES]; // nodes eval() took a step on
+    size_t lookups;                      // symbol and lambda lookups
+    size_t lookupDepth;                  // frames walked by those lookups
+    size_t lambdaCalls;
+    size_t bytesAllocated;               // arena allocations
+    size_t programs;
+    double programSeconds;
+    size_t programBuckets[METRICS_BUCKETS]; // latency of each program, not cumulative
+    struct metrics *next;
+} METRICS;
+
+extern _Thread_local METRICS *threadMetrics;
+
+METRICS *metricsRegister(void);
+
+// This thread's counters; only valid while metricsEnabled.
+static inline METRICS *metricsForThread(void)
+{
+    return threadMetrics != NULL ? threadMetrics : metricsRegister();
+}
+
+// Adds n to field of this thread's counters if metrics are enabled.
+#define METRIC_ADD(field, n) \
+    do { if (metricsEnabled) metricsForThread()->field += (n); } while (0)
+
+bool metricsInit(char *path);
+double metricsNow(void);
+void metricsProgramDone(double start);
+void metricsPoll(void);
+bool metricsDump(void);
+
+#endif
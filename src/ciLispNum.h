@@ -0,0 +1,166 @@
+#ifndef __cilisp_num_h_
+#define __cilisp_num_h_
+
+#include <math.h>
+#include <stdint.h>
+
+#include "libcilisp.h"
+
+// Arithmetic on values, shared by both evaluators and constant folding.
+// INT_TYPE whole numbers are int64s: add, sub, mult, div, remainder, max, min,
+// neg, abs and the comparisons work on them exactly and fall back to doubles
+// on overflow or when an operand is not an int64. Results of type INT_TYPE
+// go back to int64s whenever they are whole numbers.
+
+#define NAN_VAL ((RET_VAL){INT_TYPE, false, {NAN}})
+
+static inline RET_VAL intVal(int64_t ival)
+{
+    RET_VAL val = {INT_TYPE, true};
+    val.ival = ival;
+    return val;
+}
+
+// Returns dval as a value of type, held as an int64 if it is an INT_TYPE whole number.
+static inline RET_VAL typedVal(NUM_TYPE type, double dval)
+{
+    // 0x1p63 is the first double past INT64_MAX
+    if (type == INT_TYPE && dval >= -0x1p63 && dval < 0x1p63 && dval == (double) (int64_t) dval)
+        return intVal((int64_t) dval);
+    return (RET_VAL){type, false, {dval}};
+}
+
+static inline double asDouble(RET_VAL val)
+{
+    return val.isInt ? (double) val.ival : val.dval;
+}
+
+// Returns val as a value of type.
+static inline RET_VAL castVal(NUM_TYPE type, RET_VAL val)
+{
+    if (val.isInt && type == INT_TYPE)
+        return val;
+    return typedVal(type, asDouble(val));
+}
+
+// The int64 path of a binary operator applies if the result is an INT_TYPE
+// and both operands are int64s.
+static inline bool intOperands(NUM_TYPE type, RET_VAL lhs, RET_VAL rhs)
+{
+    return type == INT_TYPE && lhs.isInt && rhs.isInt;
+}
+
+static inline RET_VAL numNeg(RET_VAL val)
+{
+    if (val.isInt && val.ival != INT64_MIN)
+        return intVal(-val.ival);
+    return typedVal(val.type, -asDouble(val));
+}
+
+static inline RET_VAL numAbs(RET_VAL val)
+{
+    if (val.isInt && val.ival != INT64_MIN)
+        return intVal(val.ival < 0 ? -val.ival : val.ival);
+    return typedVal(val.type, fabs(asDouble(val)));
+}
+
+static inline RET_VAL numAdd(NUM_TYPE type, RET_VAL lhs, RET_VAL rhs)
+{
+    int64_t ival;
+    if (intOperands(type, lhs, rhs) && !__builtin_add_overflow(lhs.ival, rhs.ival, &ival))
+        return intVal(ival);
+    return typedVal(type, asDouble(lhs) + asDouble(rhs));
+}
+
+static inline RET_VAL numSub(NUM_TYPE type, RET_VAL lhs, RET_VAL rhs)
+{
+    int64_t ival;
+    if (intOperands(type, lhs, rhs) && !__builtin_sub_overflow(lhs.ival, rhs.ival, &ival))
+        return intVal(ival);
+    return typedVal(type, asDouble(lhs) - asDouble(rhs));
+}
+
+static inline RET_VAL numMult(NUM_TYPE type, RET_VAL lhs, RET_VAL rhs)
+{
+    int64_t ival;
+    if (intOperands(type, lhs, rhs) && !__builtin_mul_overflow(lhs.ival, rhs.ival, &ival))
+        return intVal(ival);
+    return typedVal(type, asDouble(lhs) * asDouble(rhs));
+}
+
+// Division by zero is an INT_TYPE NAN. An int64 quotient with a
+// remainder is a double, as (div 7 2) has always been 3.5.
+static inline RET_VAL numDiv(NUM_TYPE type, RET_VAL lhs, RET_VAL rhs)
+{
+    if (asDouble(rhs) == 0)
+        return NAN_VAL;
+    if (intOperands(type, lhs, rhs) && rhs.ival != -1 && lhs.ival % rhs.ival == 0)
+        return intVal(lhs.ival / rhs.ival);
+    if (intOperands(type, lhs, rhs) && rhs.ival == -1)
+        return numNeg(lhs);
+    return typedVal(type, asDouble(lhs) / asDouble(rhs));
+}
+
+// remainder() for int64s: lhs - n * rhs where n is lhs / rhs rounded to the
+// nearest integer, ties to even.
+static inline int64_t intRemainder(int64_t lhs, int64_t rhs)
+{
+    if (rhs == 1 || rhs == -1)
+        return 0;
+
+    int64_t quot = lhs / rhs;
+    int64_t rem = lhs % rhs;
+    uint64_t absRem = rem < 0 ? -(uint64_t) rem : (uint64_t) rem;
+    uint64_t absRhs = rhs < 0 ? -(uint64_t) rhs : (uint64_t) rhs;
+    if (2 * absRem > absRhs || (2 * absRem == absRhs && (quot & 1)))
+        rem = rem > 0 ? (int64_t) ((uint64_t) rem - absRhs) : (int64_t) ((uint64_t) rem + absRhs);
+    return rem;
+}
+
+// Remainder by zero is a NAN of type.
+static inline RET_VAL numRemainder(NUM_TYPE type, RET_VAL lhs, RET_VAL rhs)
+{
+    if (asDouble(rhs) == 0)
+        return typedVal(type, NAN);
+    if (intOperands(type, lhs, rhs))
+        return intVal(intRemainder(lhs.ival, rhs.ival));
+    return typedVal(type, remainder(asDouble(lhs), asDouble(rhs)));
+}
+
+static inline RET_VAL numMax(NUM_TYPE type, RET_VAL lhs, RET_VAL rhs)
+{
+    if (intOperands(type, lhs, rhs))
+        return lhs.ival > rhs.ival ? lhs : rhs;
+    return typedVal(type, fmax(asDouble(lhs), asDouble(rhs)));
+}
+
+static inline RET_VAL numMin(NUM_TYPE type, RET_VAL lhs, RET_VAL rhs)
+{
+    if (intOperands(type, lhs, rhs))
+        return lhs.ival < rhs.ival ? lhs : rhs;
+    return typedVal(type, fmin(asDouble(lhs), asDouble(rhs)));
+}
+
+// Comparisons are INT_TYPE 0 or 1 whatever the operand types.
+static inline RET_VAL numEqual(RET_VAL lhs, RET_VAL rhs)
+{
+    if (lhs.isInt && rhs.isInt)
+        return intVal(lhs.ival == rhs.ival);
+    return intVal(asDouble(lhs) == asDouble(rhs));
+}
+
+static inline RET_VAL numLess(RET_VAL lhs, RET_VAL rhs)
+{
+    if (lhs.isInt && rhs.isInt)
+        return intVal(lhs.ival < rhs.ival);
+    return intVal(asDouble(lhs) < asDouble(rhs));
+}
+
+static inline RET_VAL numGreater(RET_VAL lhs, RET_VAL rhs)
+{
+    if (lhs.isInt && rhs.isInt)
+        return intVal(lhs.ival > rhs.ival);
+    return intVal(asDouble(lhs) > asDouble(rhs));
+}
+
+#endif
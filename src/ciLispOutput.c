@@ -0,0 +1,268 @@
+#include "ciLispOutput.h"
+
+#include <float.h>
+
+// Bytes a formatted number can take: "%.2f" of DBL_MAX has 309 digits.
+#define FORMAT_MAX 400
+// Scaled values below this are rounded and printed as integers, which a
+// double holds exactly.
+#define FIXED_LIMIT 1e15
+// 2^50: for a value below 1e15 scaled under it, the nearest integer to the
+// computed product is the nearest integer to the exact one.
+#define SHORTEST_LIMIT 1125899906842624.0
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+    FILE *stream; // where the buffered text goes
+} OUTPUT_BUFFER;
+
+_Thread_local NUMBER_FORMAT numberFormat = FIXED_NUMBER_FORMAT;
+
+static _Thread_local OUTPUT_BUFFER buffer;
+
+static const double powersOf10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static const char digitPairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+
+//*********************************
+// Formatting
+//*********************************
+
+// Writes the decimal digits of val, two at a time.
+static size_t formatUnsigned(char *dst, uint64_t val)
+{
+    char digits[20];
+    char *p = digits + sizeof(digits);
+    while (val >= 100) {
+        const char *pair = &digitPairs[val % 100 * 2];
+        val /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (val >= 10) {
+        *--p = digitPairs[val * 2 + 1];
+        *--p = digitPairs[val * 2];
+    }
+    else
+        *--p = (char) ('0' + val);
+
+    size_t len = digits + sizeof(digits) - p;
+    memcpy(dst, p, len);
+    return len;
+}
+
+static size_t formatInt(char *dst, int64_t val)
+{
+    if (val < 0) {
+        *dst = '-';
+        return 1 + formatUnsigned(dst + 1, -(uint64_t) val);
+    }
+    return formatUnsigned(dst, val);
+}
+
+// nan, inf and their negatives, spelled like glibc's printf.
+static size_t formatSpecial(char *dst, double val)
+{
+    size_t len = 0;
+    if (signbit(val))
+        dst[len++] = '-';
+    memcpy(dst + len, isnan(val) ? "nan" : "inf", 3);
+    return len + 3;
+}
+
+// "%.*f" for up to 15 decimals. The value is scaled and rounded to an
+// integer; when the product lands too close to a halfway point for its
+// rounding error to be ruled out, snprintf rounds the exact value instead.
+static size_t formatFixed(char *dst, double val, int decimals)
+{
+    if (!isfinite(val))
+        return formatSpecial(dst, val);
+
+    double scaled = fabs(val) * powersOf10[decimals];
+    double whole = rint(scaled);
+    if (scaled >= FIXED_LIMIT || (decimals > 0 && fabs(fabs(scaled - whole) - 0.5) <= scaled * DBL_EPSILON))
+        return snprintf(dst, FORMAT_MAX, "%.*f", decimals, val);
+
+    size_t len = 0;
+    if (signbit(val))
+        dst[len++] = '-';
+    uint64_t digits = (uint64_t) whole;
+    uint64_t unit = (uint64_t) powersOf10[decimals];
+    len += formatUnsigned(dst + len, digits / unit);
+    if (decimals > 0) {
+        dst[len++] = '.';
+        uint64_t fraction = digits % unit;
+        for (int i = decimals; i > 0; i--) {
+            dst[len + i - 1] = (char) ('0' + fraction % 10);
+            fraction /= 10;
+        }
+        len += decimals;
+    }
+    return len;
+}
+
+// Lays out digits, the first of which is in the 10^exponent place, the way
+// JavaScript's Number.prototype.toString() does: plain below 1e21 and down
+// to 1e-6, with an exponent otherwise.
+static size_t layoutDigits(char *dst, bool negative, const char *digits, int numDigits, int exponent)
+{
+    size_t len = 0;
+    if (negative)
+        dst[len++] = '-';
+
+    int point = exponent + 1; // digits before the decimal point
+    if (numDigits <= point && point <= 21) {
+        memcpy(dst + len, digits, numDigits);
+        memset(dst + len + numDigits, '0', point - numDigits);
+        len += point;
+    }
+    else if (0 < point && point <= 21) {
+        memcpy(dst + len, digits, point);
+        dst[len + point] = '.';
+        memcpy(dst + len + point + 1, digits + point, numDigits - point);
+        len += numDigits + 1;
+    }
+    else if (-6 < point && point <= 0) {
+        memcpy(dst + len, "0.", 2);
+        memset(dst + len + 2, '0', -point);
+        memcpy(dst + len + 2 - point, digits, numDigits);
+        len += 2 - point + numDigits;
+    }
+    else {
+        dst[len++] = digits[0];
+        if (numDigits > 1) {
+            dst[len++] = '.';
+            memcpy(dst + len, digits + 1, numDigits - 1);
+            len += numDigits - 1;
+        }
+        dst[len++] = 'e';
+        dst[len++] = exponent < 0 ? '-' : '+';
+        len += formatUnsigned(dst + len, exponent < 0 ? -exponent : exponent);
+    }
+    return len;
+}
+
+// The fewest significant digits that read back as val. Values from 1e-5 to
+// 1e15 with up to 15 of them, which is nearly every result, are found with
+// exact double arithmetic: the smallest k for which the integer nearest to
+// val * 10^k divided by 10^k gives val again. The others take the shortest
+// "%.*e" that strtod() turns back into val.
+static size_t formatShortest(char *dst, double val)
+{
+    if (!isfinite(val))
+        return formatSpecial(dst, val);
+
+    double mag = fabs(val);
+    char digits[24];
+    int numDigits = 0, exponent = 0, precision = 1;
+    if (mag == 0) {
+        digits[numDigits++] = '0';
+    }
+    else if (mag >= 1e-5 && mag < FIXED_LIMIT) {
+        for (int k = 0; k < 23 && mag * powersOf10[k] < SHORTEST_LIMIT; k++) {
+            double n = rint(mag * powersOf10[k]);
+            if (n / powersOf10[k] == mag) {
+                numDigits = formatUnsigned(digits, (uint64_t) n);
+                exponent = numDigits - 1 - k;
+                break;
+            }
+        }
+        precision = 16;
+    }
+
+    if (numDigits == 0) {
+        char text[32];
+        for (; precision < 17; precision++) {
+            snprintf(text, sizeof(text), "%.*e", precision - 1, mag);
+            if (strtod(text, NULL) == mag)
+                break;
+        }
+        if (precision == 17)
+            snprintf(text, sizeof(text), "%.16e", mag);
+
+        // d.ddde+x
+        char *e = strchr(text, 'e');
+        digits[numDigits++] = text[0];
+        for (char *c = text + 2; c < e; c++)
+            digits[numDigits++] = *c;
+        exponent = atoi(e + 1);
+    }
+
+    while (numDigits > 1 && digits[numDigits - 1] == '0')
+        numDigits--;
+    return layoutDigits(dst, signbit(val), digits, numDigits, exponent);
+}
+
+//*********************************
+// Buffer
+//*********************************
+
+static FILE *currentStream(void)
+{
+    return outputStream != NULL ? outputStream : stdout;
+}
+
+void outputFlush(void)
+{
+    if (buffer.len > 0)
+        fwrite(buffer.data, 1, buffer.len, buffer.stream);
+    buffer.len = 0;
+}
+
+FILE *outputFile(void)
+{
+    outputFlush();
+    return currentStream();
+}
+
+void outputRelease(void)
+{
+    outputFlush();
+    free(buffer.data);
+    buffer = (OUTPUT_BUFFER){0};
+}
+
+void outputWrite(const char *text, size_t len)
+{
+    FILE *stream = currentStream();
+    if (stream != buffer.stream || len > buffer.cap - buffer.len) {
+        outputFlush();
+        buffer.stream = stream;
+    }
+    // without a buffer the text is written as it comes
+    if (buffer.cap == 0 && (buffer.data = malloc(OUTPUT_CHUNK)) != NULL)
+        buffer.cap = OUTPUT_CHUNK;
+    if (len > buffer.cap - buffer.len) {
+        fwrite(text, 1, len, stream);
+        return;
+    }
+    memcpy(buffer.data + buffer.len, text, len);
+    buffer.len += len;
+}
+
+void outputChar(char c)
+{
+    if (buffer.len < buffer.cap && buffer.stream == currentStream())
+        buffer.data[buffer.len++] = c;
+    else
+        outputWrite(&c, 1);
+}
+
+void outputInt(RET_VAL val)
+{
+    char text[FORMAT_MAX];
+    outputWrite(text, val.isInt ? formatInt(text, val.ival) : formatFixed(text, val.dval, 0));
+}
+
+void outputDouble(double val)
+{
+    char text[FORMAT_MAX];
+    outputWrite(text, numberFormat == SHORTEST_NUMBER_FORMAT ? formatShortest(text, val) : formatFixed(text, val, 2));
+}
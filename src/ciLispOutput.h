@@ -0,0 +1,36 @@
+#ifndef __cilisp_output_h_
+#define __cilisp_output_h_
+
+#include "ciLisp.h"
+
+// Output layer: results and print output are formatted here without
+// printf and collected in a per-thread buffer, which goes to the thread's
+// OUTPUT stream in writes of up to OUTPUT_CHUNK bytes. Everything printed
+// with fprintf(OUTPUT, ...) flushes the buffer first (see outputFile()),
+// so messages and results stay in order.
+#define OUTPUT_CHUNK (1 << 16)
+
+// How DOUBLE_TYPE values are printed, set by --format=fixed|shortest or the
+// format of a library context.
+extern _Thread_local NUMBER_FORMAT numberFormat;
+
+void outputWrite(const char *text, size_t len);
+void outputChar(char c);
+
+static inline void outputString(const char *text)
+{
+    outputWrite(text, strlen(text));
+}
+
+// An int valued RET_VAL: exactly if it is an int64, otherwise the double
+// rounded to a whole number like "%.f".
+void outputInt(RET_VAL val);
+// A double in numberFormat.
+void outputDouble(double val);
+
+// Writes what is buffered to the stream it was printed for.
+void outputFlush(void);
+// Flushes and frees the calling thread's buffer.
+void outputRelease(void);
+
+#endif
@@ -0,0 +1,419 @@
+#include "ciLispSession.h"
+#include "ciLispJIT.h"
+#include "ciLispMemo.h"
+#include "ciLispCSE.h"
+
+#define SESSION_MIN_CAP 64
+
+_Thread_local bool sessionDisabled = false;
+
+struct session_block {
+    ARENA arena;
+    size_t bytes;
+    int refs;     // definitions still installed plus VM programs using them
+    int replaced; // of those, the ones the define being installed replaces
+};
+
+// A definition that refers to an entry, as long as the entry it belongs to
+// still has the same version.
+typedef struct {
+    int entry;
+    unsigned version;
+} SESSION_DEP;
+
+typedef struct {
+    char *ident;
+    SYMBOL_TABLE_NODE *sym; // current definition, NULL until there is one
+    SESSION_BLOCK *block;
+    unsigned version;       // counts the definitions installed
+    SESSION_DEP *deps;      // definitions that refer to this one
+    int numDeps, depCap;
+    unsigned stamp;         // last invalidation that reached the entry
+    RET_VAL val;            // value of a variable once ready is set
+    bool ready;
+    bool forcing;
+} SESSION_ENTRY;
+
+typedef struct {
+    SESSION_ENTRY *entries;
+    int numEntries, entryCap;
+    int *buckets;           // entry + 1, or 0 for an empty bucket
+    size_t cap;
+    size_t bytes;
+    unsigned long generation;
+    unsigned long id;       // 0 until sessionId() gives it one
+    unsigned stamp;
+    bool resolving;         // names without an entry get one
+} SESSION;
+
+static _Thread_local SESSION session;
+
+// Last id given to a session of any thread.
+static unsigned long lastSessionId;
+
+//*********************************
+// Hash Table
+//*********************************
+
+static size_t hashName(const char *ident)
+{
+    size_t hash = 2166136261u;
+    while (*ident != '\0')
+        hash = (hash ^ (unsigned char) *ident++) * 16777619u;
+    return hash;
+}
+
+static bool growBuckets(void)
+{
+    size_t cap = session.cap ? session.cap * 2 : SESSION_MIN_CAP;
+    int *buckets;
+    if ((buckets = calloc(cap, sizeof(int))) == NULL)
+        return false;
+
+    for (int i = 0; i < session.numEntries; i++) {
+        size_t j = hashName(session.entries[i].ident) & (cap - 1);
+        while (buckets[j] != 0)
+            j = (j + 1) & (cap - 1);
+        buckets[j] = i + 1;
+    }
+    free(session.buckets);
+    session.buckets = buckets;
+    session.cap = cap;
+    return true;
+}
+
+static int addEntry(const char *ident, size_t bucket)
+{
+    if (session.numEntries == session.entryCap) {
+        int cap = session.entryCap ? session.entryCap * 2 : SESSION_MIN_CAP;
+        SESSION_ENTRY *entries;
+        if ((entries = realloc(session.entries, cap * sizeof(SESSION_ENTRY))) == NULL) {
+            yyerror("Memory allocation failed!");
+            return -1;
+        }
+        session.entries = entries;
+        session.entryCap = cap;
+    }
+
+    SESSION_ENTRY *entry = &session.entries[session.numEntries];
+    *entry = (SESSION_ENTRY){0};
+    if ((entry->ident = strdup(ident)) == NULL) {
+        yyerror("Memory allocation failed!");
+        return -1;
+    }
+    session.buckets[bucket] = ++session.numEntries;
+    return session.numEntries - 1;
+}
+
+int sessionLookup(const char *ident)
+{
+    if (session.numEntries == 0 && !session.resolving)
+        return -1;
+    if ((size_t) (session.numEntries + 1) * 2 > session.cap && session.resolving && !growBuckets()) {
+        yyerror("Memory allocation failed!");
+        return -1;
+    }
+
+    size_t i = hashName(ident) & (session.cap - 1);
+    while (session.buckets[i] != 0) {
+        if (strcmp(session.entries[session.buckets[i] - 1].ident, ident) == 0)
+            return session.buckets[i] - 1;
+        i = (i + 1) & (session.cap - 1);
+    }
+    return session.resolving ? addEntry(ident, i) : -1;
+}
+
+//*********************************
+// Definitions
+//*********************************
+
+// Bytes that installing table frees, counting the blocks whose every
+// reference it replaces.
+static size_t replacedBytes(SYMBOL_TABLE_NODE *table)
+{
+    for (SYMBOL_TABLE_NODE *sym = table; sym != NULL; sym = sym->next) {
+        SESSION_BLOCK *block = session.entries[sessionLookup(sym->ident)].block;
+        bool repeated = false;
+        for (SYMBOL_TABLE_NODE *prev = table; prev != sym; prev = prev->next)
+            repeated |= prev->ident == sym->ident;
+        if (block != NULL && !repeated)
+            block->replaced++;
+    }
+
+    size_t bytes = 0;
+    for (SYMBOL_TABLE_NODE *sym = table; sym != NULL; sym = sym->next) {
+        SESSION_BLOCK *block = session.entries[sessionLookup(sym->ident)].block;
+        if (block != NULL && block->replaced > 0) {
+            if (block->replaced == block->refs)
+                bytes += block->bytes;
+            block->replaced = 0;
+        }
+    }
+    return bytes;
+}
+
+//*********************************
+// Dependencies
+//*********************************
+
+static void addDep(int target, int entry)
+{
+    SESSION_ENTRY *to = &session.entries[target];
+    unsigned version = session.entries[entry].version;
+    // the references of one definition are added together
+    if (to->numDeps > 0 && to->deps[to->numDeps - 1].entry == entry && to->deps[to->numDeps - 1].version == version)
+        return;
+
+    if (to->numDeps == to->depCap) {
+        int cap = to->depCap ? to->depCap * 2 : 4;
+        SESSION_DEP *deps;
+        if ((deps = realloc(to->deps, cap * sizeof(SESSION_DEP))) == NULL) {
+            yyerror("Memory allocation failed!");
+            return;
+        }
+        to->deps = deps;
+        to->depCap = cap;
+    }
+    to->deps[to->numDeps++] = (SESSION_DEP){entry, version};
+}
+
+// Records that the definition of entry refers to the session names in node.
+static void collectDeps(AST_NODE *node, int entry)
+{
+    if (node == NULL)
+        return;
+
+    for (SYMBOL_TABLE_NODE *sym = node->table; sym != NULL; sym = sym->next)
+        collectDeps(sym->val, entry);
+
+    switch (node->type) {
+        case SYMBOL_NODE_TYPE:
+            if (node->data.symbol.addr.depth == SESSION_DEPTH)
+                addDep(node->data.symbol.addr.slot, entry);
+            break;
+        case FUNC_NODE_TYPE:
+            if (node->data.function.oper == CUSTOM_OPER && node->data.function.addr.depth == SESSION_DEPTH)
+                addDep(node->data.function.addr.slot, entry);
+            for (int i = 0; i < node->data.function.numOps; i++)
+                collectDeps(node->data.function.ops[i], entry);
+            break;
+        case COND_NODE_TYPE:
+            collectDeps(node->data.condition.cond, entry);
+            collectDeps(node->data.condition.trueCond, entry);
+            collectDeps(node->data.condition.falseCond, entry);
+            break;
+        default:
+            break;
+    }
+}
+
+// Marks the values computed from entry, directly or through other variables
+// and lambdas, to be evaluated again on their next use. References from
+// definitions that were replaced since are dropped on the way.
+static void invalidate(int entry)
+{
+    SESSION_ENTRY *from = &session.entries[entry];
+    if (from->stamp == session.stamp)
+        return;
+    from->stamp = session.stamp;
+
+    if (from->ready) {
+        from->ready = false;
+        TRACE(TRACE_EVAL, "session: %s invalidated\n", from->ident);
+    }
+    int live = 0;
+    for (int i = 0; i < from->numDeps; i++) {
+        SESSION_DEP dep = from->deps[i];
+        if (session.entries[dep.entry].version == dep.version) {
+            from->deps[live++] = dep;
+            invalidate(dep.entry);
+        }
+    }
+    from->numDeps = live;
+}
+
+bool sessionDefine(SYMBOL_TABLE_NODE *defs, const CILISP_OPTIONS *options)
+{
+    // the define_list is built last to first
+    SYMBOL_TABLE_NODE *table = NULL;
+    while (defs != NULL) {
+        SYMBOL_TABLE_NODE *next = defs->next;
+        defs->next = table;
+        table = defs;
+        defs = next;
+    }
+
+    // every name gets its entry before the values are resolved, so the
+    // definitions can refer to themselves and to each other
+    session.resolving = true;
+    for (SYMBOL_TABLE_NODE *sym = table; sym != NULL; sym = sym->next) {
+        if (sessionLookup(sym->ident) < 0) {
+            session.resolving = false;
+            return false;
+        }
+    }
+    for (SYMBOL_TABLE_NODE *sym = table; sym != NULL; sym = sym->next) {
+        if (sym->type == LAMBDA_TYPE)
+            sym->scope = createScope(sym->stack, NULL);
+        prepareProgram(sym->val, sym->scope);
+        cseProgram(sym->val, sym->scope);
+    }
+    session.resolving = false;
+
+    AST_NODE root = {.table = table};
+    if (options->jit)
+        jitProgram(&root, &programArena);
+    if (options->memo)
+        memoProgram(&root, &programArena);
+
+    size_t bytes = 0;
+    for (ARENA_BLOCK *block = programArena.head; block != NULL; block = block->next)
+        bytes += sizeof(ARENA_BLOCK) + block->size;
+    if (session.bytes - replacedBytes(table) + bytes > SESSION_MAX_BYTES) {
+        fprintf(OUTPUT, "ERROR: define ignored, the session would exceed %zu bytes\n", SESSION_MAX_BYTES);
+        return false;
+    }
+
+    SESSION_BLOCK *block;
+    if ((block = calloc(sizeof(SESSION_BLOCK), 1)) == NULL) {
+        yyerror("Memory allocation failed!");
+        return false;
+    }
+    block->arena = programArena;
+    block->bytes = bytes;
+    programArena = (ARENA){0};
+    session.bytes += bytes;
+
+    for (SYMBOL_TABLE_NODE *sym = table; sym != NULL; sym = sym->next) {
+        SESSION_ENTRY *entry = &session.entries[sessionLookup(sym->ident)];
+        // taken first, a name defined twice in one define keeps the block alive
+        block->refs++;
+        if (entry->block != NULL)
+            sessionRelease(entry->block);
+        entry->sym = sym;
+        entry->block = block;
+        entry->version++;
+        entry->ready = false;
+        TRACE(TRACE_EVAL, "session: %s defined\n", sym->ident);
+    }
+
+    // only what depends on the new definitions is evaluated again
+    session.stamp++;
+    for (SYMBOL_TABLE_NODE *sym = table; sym != NULL; sym = sym->next)
+        collectDeps(sym->val, sessionLookup(sym->ident));
+    for (SYMBOL_TABLE_NODE *sym = table; sym != NULL; sym = sym->next)
+        invalidate(sessionLookup(sym->ident));
+    session.generation++;
+    return true;
+}
+
+SYMBOL_TABLE_NODE *sessionSymbol(int entry)
+{
+    if (entry < 0 || entry >= session.numEntries)
+        return NULL;
+    return session.entries[entry].sym;
+}
+
+SESSION_BLOCK *sessionBlock(int entry)
+{
+    return session.entries[entry].block;
+}
+
+RET_VAL sessionValue(int entry, char *ident)
+{
+    SESSION_ENTRY *var = entry >= 0 && entry < session.numEntries ? &session.entries[entry] : NULL;
+    if (var == NULL || var->sym == NULL || var->sym->type == LAMBDA_TYPE) {
+        fprintf(OUTPUT, "Symbol Not Declared: %s\n", ident);
+        return NAN_VAL;
+    }
+    if (var->forcing) {
+        fprintf(OUTPUT, "ERROR: circular definition of %s\n", ident);
+        return NAN_VAL;
+    }
+
+    if (!var->ready) {
+        SYMBOL_TABLE_NODE *sym = var->sym;
+        var->forcing = true;
+        RET_VAL val = eval(sym->val, NULL);
+        var->forcing = false;
+        var->val = checkType(sym->val_type, val, sym->ident);
+        var->ready = true;
+    }
+    return var->val;
+}
+
+int sessionCount(void)
+{
+    return session.numEntries;
+}
+
+unsigned long sessionGeneration(void)
+{
+    return session.generation;
+}
+
+unsigned long sessionId(void)
+{
+    if (session.id == 0)
+        session.id = __atomic_add_fetch(&lastSessionId, 1, __ATOMIC_RELAXED);
+    return session.id;
+}
+
+bool sessionReferenced(AST_NODE *node)
+{
+    if (node == NULL)
+        return false;
+
+    for (SYMBOL_TABLE_NODE *sym = node->table; sym != NULL; sym = sym->next) {
+        if (sessionReferenced(sym->val))
+            return true;
+    }
+
+    switch (node->type) {
+        case SYMBOL_NODE_TYPE:
+            return node->data.symbol.addr.depth == SESSION_DEPTH;
+        case FUNC_NODE_TYPE:
+            if (node->data.function.oper == CUSTOM_OPER && node->data.function.addr.depth == SESSION_DEPTH)
+                return true;
+            for (int i = 0; i < node->data.function.numOps; i++) {
+                if (sessionReferenced(node->data.function.ops[i]))
+                    return true;
+            }
+            return false;
+        case COND_NODE_TYPE:
+            return sessionReferenced(node->data.condition.cond)
+                   || sessionReferenced(node->data.condition.trueCond)
+                   || sessionReferenced(node->data.condition.falseCond);
+        default:
+            return false;
+    }
+}
+
+void sessionRetain(SESSION_BLOCK *block)
+{
+    block->refs++;
+}
+
+void sessionRelease(SESSION_BLOCK *block)
+{
+    if (--block->refs > 0)
+        return;
+    session.bytes -= block->bytes;
+    arenaFree(&block->arena);
+    free(block);
+}
+
+// Blocks that VM programs still use are freed with the last of them. A
+// session started afterwards gets a new id.
+void sessionFree(void)
+{
+    for (int i = 0; i < session.numEntries; i++) {
+        if (session.entries[i].block != NULL)
+            sessionRelease(session.entries[i].block);
+        free(session.entries[i].ident);
+        free(session.entries[i].deps);
+    }
+    free(session.entries);
+    free(session.buckets);
+    session = (SESSION){.bytes = session.bytes, .generation = session.generation};
+}
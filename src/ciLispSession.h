@@ -0,0 +1,68 @@
+#ifndef __cilisp_session_h_
+#define __cilisp_session_h_
+
+#include "ciLisp.h"
+
+// Session environment: `(define (name s_expr) ...)` on a line of its own
+// installs variables and lambdas, written like the let_elems of a let_list,
+// that every later program of the thread can use. Names a program does not
+// bind itself are looked up here after its let_lists and arg_lists, and get
+// the address {SESSION_DEPTH, entry}.
+//
+// Entries are kept in an open-addressing hash table keyed on the name, and
+// stay in place for the rest of the session, so defining the same name
+// again replaces the definition every reference sees. Variables are
+// evaluated lazily like let bindings and keep their value until a
+// definition they depend on, directly or through lambdas and other
+// variables, is replaced; then they are evaluated again on their next use.
+// The arena a define was parsed into holds its definitions and is freed
+// once all of them were replaced.
+
+// Bytes of definitions a session may hold. A define that would go over it
+// is ignored with an error.
+#define SESSION_MAX_BYTES ((size_t) 64 << 20)
+
+// Set in --threads workers, where every line runs on its own and a define
+// could not be seen by the lines after it.
+extern _Thread_local bool sessionDisabled;
+
+// A define's arena, shared by its definitions and the VM programs that
+// were compiled with them.
+typedef struct session_block SESSION_BLOCK;
+
+// Installs the definitions parsed into programArena, which the session
+// takes over, and prepares them with the jit and memo settings of options.
+// Returns false if nothing was defined.
+bool sessionDefine(SYMBOL_TABLE_NODE *defs, const CILISP_OPTIONS *options);
+
+// Returns the entry of ident, or -1 if the session has none. While a define
+// is resolved, names it refers to get an entry that is defined later.
+int sessionLookup(const char *ident);
+
+// The current definition of an entry, or NULL if it has none.
+SYMBOL_TABLE_NODE *sessionSymbol(int entry);
+SESSION_BLOCK *sessionBlock(int entry);
+
+// The value of a variable, evaluated on first use. Prints an error and
+// returns NAN if the entry is not a variable.
+RET_VAL sessionValue(int entry, char *ident);
+
+int sessionCount(void);
+// Counts the defines installed so far.
+unsigned long sessionGeneration(void);
+
+// Identifies the session of the calling thread among those of every thread,
+// past and present. Entries are only meaningful in the session that gave
+// them out.
+unsigned long sessionId(void);
+
+// Returns true if node or a lambda it defines refers to a session entry.
+bool sessionReferenced(AST_NODE *node);
+
+void sessionRetain(SESSION_BLOCK *block);
+void sessionRelease(SESSION_BLOCK *block);
+
+// Frees every definition of the calling thread.
+void sessionFree(void);
+
+#endif
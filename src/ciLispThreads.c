@@ -0,0 +1,243 @@
+#include "ciLispThreads.h"
+#include "ciLispMetrics.h"
+#include "ciLispVM.h"
+#include "ciLispOutput.h"
+
+#include <pthread.h>
+
+// Workers need room for deep eval() recursion next to their frame pools.
+#define WORKER_STACK_SIZE (64 * 1024 * 1024)
+#define INPUT_CHUNK (1 << 16)
+
+typedef struct {
+    char *source;       // the line in the input, without its newline
+    size_t sourceLen;
+    char *output;       // everything evaluating it printed
+    size_t outputLen;
+    bool done;
+} BATCH_TASK;
+
+// Tasks [next, end) of a worker's share that nobody has taken yet.
+// The owner takes them from the front, idle workers steal the back half.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next, end;
+} WORK_QUEUE;
+
+typedef struct {
+    BATCH_TASK *tasks;
+    size_t numTasks;
+    WORK_QUEUE *queues;
+    int numWorkers;
+    pthread_mutex_t doneLock;
+    pthread_cond_t doneCond; // signalled whenever a task is done
+    NUMBER_FORMAT format;    // of the thread that runs the script
+} WORK_POOL;
+
+typedef struct {
+    WORK_POOL *pool;
+    int index;
+} WORKER;
+
+// Finds the next task for worker self, stealing from the other workers once
+// its own share is used up. Returns false when there is nothing left.
+static bool takeTask(WORK_POOL *pool, int self, size_t *task)
+{
+    WORK_QUEUE *own = &pool->queues[self];
+    pthread_mutex_lock(&own->lock);
+    bool found = own->next < own->end;
+    if (found)
+        *task = own->next++;
+    pthread_mutex_unlock(&own->lock);
+    if (found)
+        return true;
+
+    for (int i = 1; i < pool->numWorkers; i++) {
+        WORK_QUEUE *victim = &pool->queues[(self + i) % pool->numWorkers];
+        pthread_mutex_lock(&victim->lock);
+        size_t to = victim->end;
+        size_t from = to - (to - victim->next + 1) / 2;
+        victim->end = from;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (from < to) {
+            // nobody else adds to an empty share, so it is safe to refill
+            pthread_mutex_lock(&own->lock);
+            own->next = from + 1;
+            own->end = to;
+            pthread_mutex_unlock(&own->lock);
+            *task = from;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses and evaluates one line, collecting what it prints.
+static void runTask(BATCH_TASK *task)
+{
+    char *source;
+    if ((source = malloc(task->sourceLen + 2)) == NULL
+        || (outputStream = open_memstream(&task->output, &task->outputLen)) == NULL) {
+        yyerror("Memory allocation failed!");
+        free(source);
+        return;
+    }
+    memcpy(source, task->source, task->sourceLen);
+    source[task->sourceLen] = '\n';
+    source[task->sourceLen + 1] = '\0';
+
+    parseString(source);
+
+    outputFlush();
+    fclose(outputStream);
+    outputStream = NULL;
+    free(source);
+}
+
+static void *runWorker(void *arg)
+{
+    WORKER *worker = arg;
+    WORK_POOL *pool = worker->pool;
+    size_t index;
+    sessionDisabled = true;
+    numberFormat = pool->format;
+    while (takeTask(pool, worker->index, &index)) {
+        runTask(&pool->tasks[index]);
+
+        pthread_mutex_lock(&pool->doneLock);
+        pool->tasks[index].done = true;
+        pthread_cond_broadcast(&pool->doneCond);
+        pthread_mutex_unlock(&pool->doneLock);
+    }
+    arenaFree(&programArena);
+    vmReleaseStack();
+    outputRelease();
+    return NULL;
+}
+
+// Reads all of in into one NUL terminated buffer.
+static char *readInput(FILE *in, size_t *len)
+{
+    char *input = NULL;
+    size_t cap = 0;
+    *len = 0;
+    do {
+        if (*len + INPUT_CHUNK + 1 > cap) {
+            cap = cap ? cap * 2 : INPUT_CHUNK * 2;
+            char *grown = realloc(input, cap);
+            if (grown == NULL) {
+                free(input);
+                return NULL;
+            }
+            input = grown;
+        }
+        *len += fread(input + *len, 1, INPUT_CHUNK, in);
+    } while (!feof(in) && !ferror(in));
+    input[*len] = '\0';
+    return input;
+}
+
+// One task per line, up to a line that is just quit.
+static BATCH_TASK *splitLines(char *input, size_t len, size_t *numTasks)
+{
+    size_t cap = 0;
+    BATCH_TASK *tasks = NULL;
+    *numTasks = 0;
+    for (char *line = input; line < input + len;) {
+        char *end = memchr(line, '\n', input + len - line);
+        if (end == NULL)
+            end = input + len;
+
+        char *first = line + strspn(line, " \t\r");
+        if (end - first >= 4 && strncmp(first, "quit", 4) == 0 && first + 4 + strspn(first + 4, " \t\r") == end)
+            break;
+
+        if (*numTasks == cap) {
+            cap = cap ? cap * 2 : 1024;
+            BATCH_TASK *grown = realloc(tasks, cap * sizeof(BATCH_TASK));
+            if (grown == NULL) {
+                free(tasks);
+                return NULL;
+            }
+            tasks = grown;
+        }
+        tasks[(*numTasks)++] = (BATCH_TASK){line, end - line, NULL, 0, false};
+        line = end + 1;
+    }
+    return tasks;
+}
+
+bool evalThreaded(FILE *in, int numThreads)
+{
+    size_t len, numTasks;
+    char *input = readInput(in, &len);
+    BATCH_TASK *tasks = input != NULL ? splitLines(input, len, &numTasks) : NULL;
+    WORK_QUEUE *queues = calloc(sizeof(WORK_QUEUE), numThreads);
+    WORKER *workers = calloc(sizeof(WORKER), numThreads);
+    pthread_t *threads = calloc(sizeof(pthread_t), numThreads);
+    if (input == NULL || (tasks == NULL && len > 0) || queues == NULL || workers == NULL || threads == NULL) {
+        yyerror("Memory allocation failed!");
+        free(input);
+        free(tasks);
+        free(queues);
+        free(workers);
+        free(threads);
+        return false;
+    }
+
+    // each worker starts with an even, contiguous share of the lines
+    WORK_POOL pool = {tasks, numTasks, queues, numThreads};
+    pool.format = numberFormat;
+    pthread_mutex_init(&pool.doneLock, NULL);
+    pthread_cond_init(&pool.doneCond, NULL);
+    for (int i = 0; i < numThreads; i++) {
+        pthread_mutex_init(&queues[i].lock, NULL);
+        queues[i].next = numTasks * i / numThreads;
+        queues[i].end = numTasks * (i + 1) / numThreads;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
+    int started = 0;
+    for (; started < numThreads; started++) {
+        workers[started] = (WORKER){&pool, started};
+        if (pthread_create(&threads[started], &attr, runWorker, &workers[started]) != 0)
+            break;
+    }
+    pthread_attr_destroy(&attr);
+    if (started == 0) {
+        // no threads at all: do the work here
+        workers[0] = (WORKER){&pool, 0};
+        for (int i = 1; i < numThreads; i++)
+            queues[0].end = queues[i].end;
+        pool.numWorkers = 1;
+        runWorker(&workers[0]);
+    }
+
+    // print in input order as soon as each result is ready
+    for (size_t i = 0; i < numTasks; i++) {
+        pthread_mutex_lock(&pool.doneLock);
+        while (!tasks[i].done)
+            pthread_cond_wait(&pool.doneCond, &pool.doneLock);
+        pthread_mutex_unlock(&pool.doneLock);
+
+        fwrite(tasks[i].output, 1, tasks[i].outputLen, stdout);
+        free(tasks[i].output);
+        metricsPoll();
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < numThreads; i++)
+        pthread_mutex_destroy(&queues[i].lock);
+    pthread_mutex_destroy(&pool.doneLock);
+    pthread_cond_destroy(&pool.doneCond);
+    free(input);
+    free(tasks);
+    free(queues);
+    free(workers);
+    free(threads);
+    return true;
+}
@@ -0,0 +1,10 @@
+#ifndef __cilisp_threads_h_
+#define __cilisp_threads_h_
+
+#include "ciLisp.h"
+
+// Evaluates every line of in as an independent program on numThreads worker
+// threads and prints the results in input order. Returns false on errors.
+bool evalThreaded(FILE *in, int numThreads);
+
+#endif
@@ -0,0 +1,870 @@
+#include "ciLispVM.h"
+#include "ciLispMetrics.h"
+#include "ciLispOutput.h"
+
+// Errors that are detected while compiling but reported when the code runs,
+// so the VM prints the same messages at the same point as eval() does.
+typedef enum {
+    VM_ERR_UNDECLARED,
+    VM_ERR_NOT_FUNC,
+    VM_ERR_TOO_MANY_ARGS,
+    VM_ERR_TOO_FEW_ARGS,
+    VM_ERR_NO_OPERAND,
+    VM_ERR_EXTRA_OPERANDS, // a warning, the first operand is used
+    VM_ERR_TOO_FEW_OPERANDS,
+    VM_ERR_INVALID_FUNC
+} VM_ERROR;
+
+static const char *vmErrors[] = {
+        "Symbol Not Declared: %s\n",
+        "Function not defined %s\n",
+        "Too many arguments calling %s\n",
+        "Too few arguments calling %s\n",
+        "No arguments given\n",
+        "Too many arguments: Taking first val\n",
+        "ERROR: too few parameters for the function %s\n",
+        "Invalid function or not implemented yet..."
+};
+
+// Opcode for each builtin arithmetic operator.
+static const VM_OPCODE operOpcodes[] = {
+        [NEG_OPER] = OP_NEG,
+        [ABS_OPER] = OP_ABS,
+        [EXP_OPER] = OP_EXP,
+        [SQRT_OPER] = OP_SQRT,
+        [ADD_OPER] = OP_ADD,
+        [SUB_OPER] = OP_SUB,
+        [MULT_OPER] = OP_MULT,
+        [DIV_OPER] = OP_DIV,
+        [REMAINDER_OPER] = OP_REMAINDER,
+        [LOG_OPER] = OP_LOG,
+        [POW_OPER] = OP_POW,
+        [MAX_OPER] = OP_MAX,
+        [MIN_OPER] = OP_MIN,
+        [EXP2_OPER] = OP_EXP2,
+        [CBRT_OPER] = OP_CBRT,
+        [HYPOT_OPER] = OP_HYPOT,
+        [EQUAL_OPER] = OP_EQUAL,
+        [LESS_OPER] = OP_LESS,
+        [GREATER_OPER] = OP_GREATER
+};
+
+//*********************************
+// Compiler
+//*********************************
+
+// A let_list or lambda arg_list with the slot (or, for lambdas, the function)
+// each of its entries was assigned.
+typedef struct vm_scope {
+    SYMBOL_TABLE_NODE *table;
+    int *index;
+    int depth; // lambda nesting depth of the function owning the slots
+    struct vm_scope *parent;
+    struct vm_scope *nextAlloc;
+} VM_SCOPE;
+
+// A chunk waiting to be compiled.
+typedef struct vm_pending {
+    int chunk;
+    int func;
+    int depth;
+    AST_NODE *expr;
+    VM_SCOPE *scope;
+    NUM_TYPE castType;
+    int castName; // -1 when the result is not assigned to a variable
+    struct vm_pending *next;
+} VM_PENDING;
+
+typedef struct {
+    VM_PROGRAM *prog;
+    VM_PENDING *pending;
+    VM_PENDING *pendingTail;
+    VM_SCOPE *scopes;
+    int func;
+    int depth;
+    int maxReg;
+    int *sessionFuncs; // function of each session lambda + 1, once compiled
+} VM_COMPILER;
+
+static void compileExpr(VM_COMPILER *comp, AST_NODE *node, VM_SCOPE *scope, int dst, bool tail);
+
+static void *vmGrow(void *array, int *cap, int len, size_t elemSize)
+{
+    if (len < *cap)
+        return array;
+
+    *cap = *cap ? *cap * 2 : 16;
+    if ((array = realloc(array, *cap * elemSize)) == NULL)
+        yyerror("Memory allocation failed!");
+    return array;
+}
+
+static int emit(VM_COMPILER *comp, VM_OPCODE op, int a, int b, int c)
+{
+    VM_PROGRAM *prog = comp->prog;
+    prog->code = vmGrow(prog->code, &prog->codeCap, prog->codeLen, sizeof(VM_INSTR));
+    prog->code[prog->codeLen] = (VM_INSTR){op, a, b, c};
+    return prog->codeLen++;
+}
+
+static int addConst(VM_PROGRAM *prog, RET_VAL val)
+{
+    prog->consts = vmGrow(prog->consts, &prog->constCap, prog->constLen, sizeof(RET_VAL));
+    prog->consts[prog->constLen] = val;
+    return prog->constLen++;
+}
+
+static int addName(VM_PROGRAM *prog, char *name)
+{
+    for (int i = 0; i < prog->nameLen; i++) {
+        if (strcmp(prog->names[i], name) == 0)
+            return i;
+    }
+    prog->names = vmGrow(prog->names, &prog->nameCap, prog->nameLen, sizeof(char *));
+    prog->names[prog->nameLen] = strdup(name);
+    return prog->nameLen++;
+}
+
+static int addChunk(VM_PROGRAM *prog)
+{
+    prog->chunks = vmGrow(prog->chunks, &prog->chunkCap, prog->chunkLen, sizeof(VM_CHUNK));
+    prog->chunks[prog->chunkLen] = (VM_CHUNK){-1, 0};
+    return prog->chunkLen++;
+}
+
+static int addFunc(VM_PROGRAM *prog)
+{
+    prog->funcs = vmGrow(prog->funcs, &prog->funcCap, prog->funcLen, sizeof(VM_FUNC));
+    memset(&prog->funcs[prog->funcLen], 0, sizeof(VM_FUNC));
+    prog->funcs[prog->funcLen].body = addChunk(prog);
+    return prog->funcLen++;
+}
+
+static int addSlot(VM_PROGRAM *prog, int func, int thunk, int name)
+{
+    VM_FUNC *fn = &prog->funcs[func];
+    fn->slots = vmGrow(fn->slots, &fn->slotCap, fn->numSlots, sizeof(VM_SLOT));
+    fn->slots[fn->numSlots] = (VM_SLOT){thunk, name};
+    return fn->numSlots++;
+}
+
+static void addPending(VM_COMPILER *comp, int chunk, int func, int depth, AST_NODE *expr, VM_SCOPE *scope,
+                       NUM_TYPE castType, int castName)
+{
+    VM_PENDING *pending;
+    if ((pending = calloc(sizeof(VM_PENDING), 1)) == NULL)
+        yyerror("Memory allocation failed!");
+
+    *pending = (VM_PENDING){chunk, func, depth, expr, scope, castType, castName, NULL};
+    if (comp->pendingTail == NULL)
+        comp->pending = pending;
+    else
+        comp->pendingTail->next = pending;
+    comp->pendingTail = pending;
+}
+
+static VM_SCOPE *addScope(VM_COMPILER *comp, SYMBOL_TABLE_NODE *table, VM_SCOPE *parent, int depth)
+{
+    VM_SCOPE *scope;
+    int count = 0;
+    for (SYMBOL_TABLE_NODE *sym = table; sym != NULL; sym = sym->next)
+        count++;
+
+    if ((scope = calloc(sizeof(VM_SCOPE), 1)) == NULL || (scope->index = calloc(sizeof(int), count + 1)) == NULL)
+        yyerror("Memory allocation failed!");
+
+    scope->table = table;
+    scope->parent = parent;
+    scope->depth = depth;
+    scope->nextAlloc = comp->scopes;
+    comp->scopes = scope;
+    return scope;
+}
+
+// Assigns a slot in the current function to every variable of a let_list and
+// a new function to every lambda, queueing their code for compilation.
+static VM_SCOPE *openLetScope(VM_COMPILER *comp, SYMBOL_TABLE_NODE *table, VM_SCOPE *parent)
+{
+    VM_PROGRAM *prog = comp->prog;
+    VM_SCOPE *scope = addScope(comp, table, parent, comp->depth);
+
+    int i = 0;
+    for (SYMBOL_TABLE_NODE *sym = table; sym != NULL; sym = sym->next, i++) {
+        int name = addName(prog, sym->ident);
+        if (sym->type == LAMBDA_TYPE) {
+            int func = addFunc(prog);
+            VM_SCOPE *args = addScope(comp, sym->stack, scope, comp->depth + 1);
+            int j = 0;
+            for (STACK_NODE *arg = sym->stack; arg != NULL; arg = arg->next, j++)
+                args->index[j] = addSlot(prog, func, -1, addName(prog, arg->ident));
+            prog->funcs[func].numArgs = j;
+            prog->funcs[func].jit = sym->jit;
+            prog->funcs[func].memo = sym->memo;
+
+            addPending(comp, prog->funcs[func].body, func, comp->depth + 1, sym->val, args, NO_TYPE, -1);
+            scope->index[i] = func;
+        }
+        else {
+            int thunk = addChunk(prog);
+            scope->index[i] = addSlot(prog, comp->func, thunk, name);
+            addPending(comp, thunk, comp->func, comp->depth, sym->val, scope, sym->val_type, name);
+        }
+    }
+    return scope;
+}
+
+// Returns the function of a session lambda, compiling it into the program the
+// first time it is called. It is defined by the top level function, and the
+// program keeps the definition's block for its native code and cache.
+static int sessionFunc(VM_COMPILER *comp, int entry, SYMBOL_TABLE_NODE *sym)
+{
+    VM_PROGRAM *prog = comp->prog;
+    if (comp->sessionFuncs == NULL && (comp->sessionFuncs = calloc(sessionCount(), sizeof(int))) == NULL)
+        yyerror("Memory allocation failed!");
+    if (comp->sessionFuncs[entry] > 0)
+        return comp->sessionFuncs[entry] - 1;
+
+    int func = addFunc(prog);
+    VM_SCOPE *args = addScope(comp, sym->stack, NULL, 1);
+    int j = 0;
+    for (STACK_NODE *arg = sym->stack; arg != NULL; arg = arg->next, j++)
+        args->index[j] = addSlot(prog, func, -1, addName(prog, arg->ident));
+    prog->funcs[func].numArgs = j;
+    prog->funcs[func].jit = sym->jit;
+    prog->funcs[func].memo = sym->memo;
+    addPending(comp, prog->funcs[func].body, func, 1, sym->val, args, NO_TYPE, -1);
+
+    prog->blocks = vmGrow(prog->blocks, &prog->blockCap, prog->blockLen, sizeof(SESSION_BLOCK *));
+    prog->blocks[prog->blockLen++] = sessionBlock(entry);
+    sessionRetain(sessionBlock(entry));
+    comp->sessionFuncs[entry] = func + 1;
+    return func;
+}
+
+static SYMBOL_TABLE_NODE *lookupScope(VM_SCOPE *scope, char *ident, int *index, int *depth)
+{
+    for (; scope != NULL; scope = scope->parent) {
+        int i = 0;
+        for (SYMBOL_TABLE_NODE *sym = scope->table; sym != NULL; sym = sym->next, i++) {
+            if (strcmp(ident, sym->ident) == 0) {
+                *index = scope->index[i];
+                *depth = scope->depth;
+                return sym;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void useReg(VM_COMPILER *comp, int reg)
+{
+    if (reg > comp->maxReg)
+        comp->maxReg = reg;
+}
+
+static void emitNan(VM_COMPILER *comp, int dst)
+{
+    emit(comp, OP_LOADK, dst, addConst(comp->prog, NAN_VAL), 0);
+}
+
+static void emitFail(VM_COMPILER *comp, int dst, char *name, VM_ERROR err)
+{
+    emit(comp, OP_FAIL, dst, addName(comp->prog, name), err);
+}
+
+static void compileSymbol(VM_COMPILER *comp, AST_NODE *node, VM_SCOPE *scope, int dst)
+{
+    int index, depth;
+    SYMBOL_TABLE_NODE *sym = lookupScope(scope, node->data.symbol.ident, &index, &depth);
+    if (sym == NULL && node->data.symbol.addr.depth == SESSION_DEPTH)
+        emit(comp, OP_LOADSESSION, dst, node->data.symbol.addr.slot, addName(comp->prog, node->data.symbol.ident));
+    else if (sym == NULL || sym->type == LAMBDA_TYPE)
+        emitFail(comp, dst, node->data.symbol.ident, VM_ERR_UNDECLARED);
+    else
+        emit(comp, OP_LOADVAR, dst, index, comp->depth - depth);
+}
+
+static void compileCall(VM_COMPILER *comp, FUNC_AST_NODE *func, VM_SCOPE *scope, int dst, bool tail)
+{
+    int index, depth, argc = 0;
+    SYMBOL_TABLE_NODE *sym = lookupScope(scope, func->ident, &index, &depth);
+    if (sym == NULL && func->addr.depth == SESSION_DEPTH && (sym = sessionSymbol(func->addr.slot)) != NULL) {
+        depth = 0;
+        if (sym->type == LAMBDA_TYPE)
+            index = sessionFunc(comp, func->addr.slot, sym);
+    }
+    if (sym == NULL) {
+        emitFail(comp, dst, func->ident, VM_ERR_UNDECLARED);
+        return;
+    }
+    if (sym->type != LAMBDA_TYPE) {
+        emitFail(comp, dst, func->ident, VM_ERR_NOT_FUNC);
+        return;
+    }
+
+    for (; argc < func->numOps; argc++)
+        compileExpr(comp, func->ops[argc], scope, dst + argc, false);
+
+    if (argc != comp->prog->funcs[index].numArgs)
+        emitFail(comp, dst, func->ident, argc > comp->prog->funcs[index].numArgs ? VM_ERR_TOO_MANY_ARGS : VM_ERR_TOO_FEW_ARGS);
+    else
+        emit(comp, tail ? OP_TAILCALL : OP_CALL, dst, index, comp->depth - depth);
+}
+
+static void compilePrint(VM_COMPILER *comp, FUNC_AST_NODE *func, VM_SCOPE *scope, int dst)
+{
+    if (func->numOps == 0) {
+        emitNan(comp, dst);
+        return;
+    }
+
+    emit(comp, OP_PRINTBEGIN, 0, 0, 0);
+    for (int i = 0; i < func->numOps; i++) {
+        AST_NODE *op = func->ops[i];
+        int index, depth, name = -1;
+        NUM_TYPE type = NO_TYPE;
+        compileExpr(comp, op, scope, dst, false);
+        if (op->type == SYMBOL_NODE_TYPE) {
+            SYMBOL_TABLE_NODE *sym = lookupScope(scope, op->data.symbol.ident, &index, &depth);
+            if (sym == NULL && op->data.symbol.addr.depth == SESSION_DEPTH)
+                sym = sessionSymbol(op->data.symbol.addr.slot);
+            if (sym != NULL) {
+                name = addName(comp->prog, sym->ident);
+                type = sym->val_type;
+            }
+        }
+        emit(comp, OP_PRINT, dst, name, type);
+    }
+    emit(comp, OP_PRINTEND, 0, 0, 0);
+}
+
+static void compileUnary(VM_COMPILER *comp, FUNC_AST_NODE *func, VM_SCOPE *scope, int dst)
+{
+    if (func->numOps == 0) {
+        emitFail(comp, dst, funcNames[func->oper], VM_ERR_NO_OPERAND);
+        return;
+    }
+    // dst is loaded with the operand right after the warning
+    if (func->numOps > 1)
+        emitFail(comp, dst, funcNames[func->oper], VM_ERR_EXTRA_OPERANDS);
+    compileExpr(comp, func->ops[0], scope, dst, false);
+    emit(comp, operOpcodes[func->oper], dst, dst, 0);
+}
+
+static void compileBinary(VM_COMPILER *comp, FUNC_AST_NODE *func, VM_SCOPE *scope, int dst)
+{
+    if (func->numOps < 2) {
+        emitFail(comp, dst, funcNames[func->oper], VM_ERR_TOO_FEW_OPERANDS);
+        return;
+    }
+    compileExpr(comp, func->ops[0], scope, dst, false);
+    // only add and mult fold the whole operand list, the others use two operands
+    for (int i = 1; i < (func->oper == ADD_OPER || func->oper == MULT_OPER ? func->numOps : 2); i++) {
+        compileExpr(comp, func->ops[i], scope, dst + 1, false);
+        emit(comp, operOpcodes[func->oper], dst, dst, dst + 1);
+    }
+}
+
+static void compileFunc(VM_COMPILER *comp, FUNC_AST_NODE *func, VM_SCOPE *scope, int dst, bool tail)
+{
+    switch (func->oper) {
+        case READ_OPER:
+            emit(comp, OP_READ, dst, 0, 0);
+            break;
+        case RAND_OPER:
+            emit(comp, OP_RAND, dst, 0, 0);
+            break;
+        case PRINT_OPER:
+            compilePrint(comp, func, scope, dst);
+            break;
+        case CUSTOM_OPER:
+            compileCall(comp, func, scope, dst, tail);
+            break;
+        default:
+            if (operArity(func->oper) == 1)
+                compileUnary(comp, func, scope, dst);
+            else if (operArity(func->oper) == 2)
+                compileBinary(comp, func, scope, dst);
+            else
+                emitFail(comp, dst, funcNames[func->oper], VM_ERR_INVALID_FUNC);
+            break;
+    }
+}
+
+// Compiles node so that its value ends up in register dst.
+// tail is set for the value a lambda body returns, where calls become tail calls.
+static void compileExpr(VM_COMPILER *comp, AST_NODE *node, VM_SCOPE *scope, int dst, bool tail)
+{
+    useReg(comp, dst);
+    if (node == NULL) {
+        emitNan(comp, dst);
+        return;
+    }
+
+    if (node->table != NULL)
+        scope = openLetScope(comp, node->table, scope);
+
+    switch (node->type) {
+        case NUM_NODE_TYPE:
+            emit(comp, OP_LOADK, dst, addConst(comp->prog, evalNumNode(&node->data.number)), 0);
+            break;
+        case FUNC_NODE_TYPE:
+            compileFunc(comp, &node->data.function, scope, dst, tail);
+            break;
+        case SYMBOL_NODE_TYPE:
+            compileSymbol(comp, node, scope, dst);
+            break;
+        case COND_NODE_TYPE: {
+            compileExpr(comp, node->data.condition.cond, scope, dst, false);
+            int jumpFalse = emit(comp, OP_JMPZ, dst, 0, 0);
+            compileExpr(comp, node->data.condition.trueCond, scope, dst, tail);
+            int jumpEnd = emit(comp, OP_JMP, 0, 0, 0);
+            comp->prog->code[jumpFalse].b = comp->prog->codeLen;
+            compileExpr(comp, node->data.condition.falseCond, scope, dst, tail);
+            comp->prog->code[jumpEnd].b = comp->prog->codeLen;
+            break;
+        }
+        default:
+            yyerror("Invalid AST_NODE_TYPE, probably invalid writes somewhere!");
+            emitNan(comp, dst);
+    }
+}
+
+// Lowers an AST into bytecode.
+// The top level expression, every let binding and every lambda body become a
+// chunk; let bindings are compiled as thunks that LOADVAR forces on first use,
+// just like evalSymbolNode does.
+// The variables of globals, if any, are the arguments of the top level
+// function, which vmRun() gets the values of.
+VM_PROGRAM *vmCompile(AST_NODE *node, SCOPE *globals)
+{
+    VM_PROGRAM *prog;
+    if ((prog = calloc(sizeof(VM_PROGRAM), 1)) == NULL)
+        yyerror("Memory allocation failed!");
+
+    VM_COMPILER comp = {prog};
+    int top = addFunc(prog);
+    VM_SCOPE *scope = NULL;
+    if (globals != NULL && globals->numSlots > 0) {
+        // the slots of a scope are its symbol table in order
+        scope = addScope(&comp, globals->slots[0], NULL, 0);
+        for (int i = 0; i < globals->numSlots; i++)
+            scope->index[i] = addSlot(prog, top, -1, addName(prog, globals->slots[i]->ident));
+        prog->funcs[top].numArgs = globals->numSlots;
+    }
+    addPending(&comp, prog->funcs[top].body, top, 0, node, scope, NO_TYPE, -1);
+
+    while (comp.pending != NULL) {
+        VM_PENDING *pending = comp.pending;
+        comp.pending = pending->next;
+        if (comp.pending == NULL)
+            comp.pendingTail = NULL;
+
+        comp.func = pending->func;
+        comp.depth = pending->depth;
+        comp.maxReg = 0;
+        prog->chunks[pending->chunk].entry = prog->codeLen;
+        bool lambdaBody = pending->func != 0 && pending->chunk == prog->funcs[pending->func].body;
+        compileExpr(&comp, pending->expr, pending->scope, 0, lambdaBody);
+        if (pending->castName >= 0)
+            emit(&comp, OP_CAST, 0, pending->castName, pending->castType);
+        emit(&comp, OP_RET, 0, 0, 0);
+        prog->chunks[pending->chunk].numRegs = comp.maxReg + 1;
+        free(pending);
+    }
+
+    while (comp.scopes != NULL) {
+        VM_SCOPE *next = comp.scopes->nextAlloc;
+        free(comp.scopes->index);
+        free(comp.scopes);
+        comp.scopes = next;
+    }
+    free(comp.sessionFuncs);
+
+    return prog;
+}
+
+void vmFreeProgram(VM_PROGRAM *prog)
+{
+    if (!prog)
+        return;
+
+    for (int i = 0; i < prog->funcLen; i++)
+        free(prog->funcs[i].slots);
+    for (int i = 0; i < prog->nameLen; i++)
+        free(prog->names[i]);
+    for (int i = 0; i < prog->blockLen; i++)
+        sessionRelease(prog->blocks[i]);
+
+    free(prog->code);
+    free(prog->consts);
+    free(prog->chunks);
+    free(prog->funcs);
+    free(prog->names);
+    free(prog->blocks);
+    free(prog);
+}
+
+//*********************************
+// Virtual Machine
+//*********************************
+
+#define VM_MAX_REGS (1 << 16)
+#define VM_MAX_CELLS (1 << 16)
+#define VM_MAX_CALLS (1 << 12)
+
+typedef enum { CELL_EMPTY, CELL_FORCING, CELL_READY } VM_CELL_STATE;
+
+// Storage for one slot of an environment frame.
+typedef struct {
+    RET_VAL val;
+    VM_CELL_STATE state;
+} VM_CELL;
+
+typedef struct vm_frame {
+    struct vm_frame *parent; // frame of the function the lambda was defined in
+    VM_FUNC *func;
+    VM_CELL *cells;
+} VM_FRAME;
+
+// Saved caller state for a lambda call or a let binding being forced.
+typedef struct {
+    const VM_INSTR *pc;
+    RET_VAL *regs;
+    int numRegs;
+    VM_FRAME *env;
+    RET_VAL *dst;   // caller register receiving a call result
+    VM_CELL *cell;  // binding receiving a thunk result
+    MEMO_CACHE *memo; // cache receiving a call result, keyed on the arguments at dst
+    VM_FRAME *frameTop;
+    VM_CELL *cellTop;
+} VM_ACTIVATION;
+
+typedef struct {
+    RET_VAL regs[VM_MAX_REGS];
+    VM_CELL cells[VM_MAX_CELLS];
+    VM_FRAME frames[VM_MAX_CALLS];
+    VM_ACTIVATION calls[VM_MAX_CALLS];
+} VM_STACK;
+
+static _Thread_local VM_STACK *vmStack;
+
+// Frees the calling thread's stack; vmRun() allocates a new one if needed.
+void vmReleaseStack(void)
+{
+    free(vmStack);
+    vmStack = NULL;
+}
+
+// Counts an instruction under the operator it implements, or as a lookup.
+static void countInstruction(const VM_INSTR *ins)
+{
+    static const OPER_TYPE opers[] = {
+            [OP_NEG] = NEG_OPER, [OP_ABS] = ABS_OPER, [OP_EXP] = EXP_OPER, [OP_SQRT] = SQRT_OPER,
+            [OP_LOG] = LOG_OPER, [OP_EXP2] = EXP2_OPER, [OP_CBRT] = CBRT_OPER, [OP_ADD] = ADD_OPER,
+            [OP_SUB] = SUB_OPER, [OP_MULT] = MULT_OPER, [OP_DIV] = DIV_OPER, [OP_REMAINDER] = REMAINDER_OPER,
+            [OP_POW] = POW_OPER, [OP_MAX] = MAX_OPER, [OP_MIN] = MIN_OPER, [OP_HYPOT] = HYPOT_OPER,
+            [OP_EQUAL] = EQUAL_OPER, [OP_LESS] = LESS_OPER, [OP_GREATER] = GREATER_OPER,
+            [OP_READ] = READ_OPER, [OP_RAND] = RAND_OPER, [OP_PRINTBEGIN] = PRINT_OPER
+    };
+    METRICS *metrics = metricsForThread();
+    switch (ins->op) {
+        case OP_LOADVAR:
+            metrics->lookups++;
+            metrics->lookupDepth += ins->c;
+            break;
+        case OP_CALL:
+        case OP_TAILCALL:
+            metrics->lambdaCalls++;
+            metrics->lookups++;
+            metrics->lookupDepth += ins->c;
+            break;
+        default:
+            // OP_NEG up to OP_PRINTBEGIN are all operators
+            if (ins->op >= OP_NEG && ins->op <= OP_PRINTBEGIN)
+                metrics->operCalls[opers[ins->op]]++;
+            break;
+    }
+}
+
+static inline NUM_TYPE promoteType(RET_VAL lhs, RET_VAL rhs)
+{
+    return (lhs.type == DOUBLE_TYPE || rhs.type == DOUBLE_TYPE) ? DOUBLE_TYPE : INT_TYPE;
+}
+
+static VM_FRAME *vmPushFrame(VM_FRAME **frameTop, VM_CELL **cellTop, VM_FUNC *func, VM_FRAME *parent)
+{
+    if (*frameTop == vmStack->frames + VM_MAX_CALLS || *cellTop + func->numSlots > vmStack->cells + VM_MAX_CELLS)
+        return NULL;
+
+    VM_FRAME *frame = (*frameTop)++;
+    frame->parent = parent;
+    frame->func = func;
+    frame->cells = *cellTop;
+    *cellTop += func->numSlots;
+    for (int i = func->numArgs; i < func->numSlots; i++)
+        frame->cells[i].state = CELL_EMPTY;
+    return frame;
+}
+
+// Runs a compiled program.
+// Lambda calls and thunk forcing push an activation instead of recursing in C,
+// so the whole evaluation is a single dispatch loop.
+// args holds the values of the globals the program was compiled with.
+RET_VAL vmRun(VM_PROGRAM *prog, const RET_VAL *args)
+{
+    if (vmStack == NULL && (vmStack = calloc(sizeof(VM_STACK), 1)) == NULL) {
+        yyerror("Memory allocation failed!");
+        return NAN_VAL;
+    }
+
+    const VM_INSTR *code = prog->code;
+    const RET_VAL *consts = prog->consts;
+    VM_FRAME *frameTop = vmStack->frames;
+    VM_CELL *cellTop = vmStack->cells;
+    VM_ACTIVATION *call = vmStack->calls;
+    VM_ACTIVATION *callEnd = vmStack->calls + VM_MAX_CALLS;
+    RET_VAL *regEnd = vmStack->regs + VM_MAX_REGS;
+
+    VM_CHUNK *chunk = &prog->chunks[prog->funcs[0].body];
+    VM_FRAME *env = vmPushFrame(&frameTop, &cellTop, &prog->funcs[0], NULL);
+    RET_VAL *regs = vmStack->regs;
+    int numRegs = chunk->numRegs;
+    const VM_INSTR *pc = code + chunk->entry;
+    *call = (VM_ACTIVATION){NULL, regs, numRegs, env, NULL, NULL, NULL, frameTop, cellTop};
+
+    if (env == NULL || regs + numRegs > regEnd)
+        goto overflow;
+    for (int i = 0; i < prog->funcs[0].numArgs; i++)
+        env->cells[i] = (VM_CELL){args[i], CELL_READY};
+
+    for (;;) {
+        const VM_INSTR *ins = pc++;
+        RET_VAL *r = regs;
+        TRACE(TRACE_EVAL, "vm: %ld op %d a %d b %d c %d\n",
+              (long) (ins - code), ins->op, ins->a, ins->b, ins->c);
+        if (metricsEnabled)
+            countInstruction(ins);
+
+        switch (ins->op) {
+            case OP_LOADK:
+                r[ins->a] = consts[ins->b];
+                break;
+            case OP_LOADVAR: {
+                VM_FRAME *frame = env;
+                for (int hops = ins->c; hops > 0; hops--)
+                    frame = frame->parent;
+                VM_CELL *cell = &frame->cells[ins->b];
+
+                if (cell->state == CELL_READY) {
+                    r[ins->a] = cell->val;
+                    break;
+                }
+                if (cell->state == CELL_FORCING) {
+                    fprintf(OUTPUT, "ERROR: circular definition of %s\n", prog->names[frame->func->slots[ins->b].name]);
+                    r[ins->a] = NAN_VAL;
+                    break;
+                }
+
+                // run the binding, then execute this LOADVAR again
+                VM_CHUNK *thunk = &prog->chunks[frame->func->slots[ins->b].thunk];
+                if (call + 1 == callEnd || regs + numRegs + thunk->numRegs > regEnd)
+                    goto overflow;
+                cell->state = CELL_FORCING;
+                *++call = (VM_ACTIVATION){ins, regs, numRegs, env, NULL, cell, NULL, frameTop, cellTop};
+                regs += numRegs;
+                numRegs = thunk->numRegs;
+                env = frame;
+                pc = code + thunk->entry;
+                break;
+            }
+            case OP_NEG:
+                r[ins->a] = numNeg(r[ins->b]);
+                break;
+            case OP_ABS:
+                r[ins->a] = numAbs(r[ins->b]);
+                break;
+            case OP_EXP:
+                r[ins->a] = typedVal(r[ins->b].type, exp(asDouble(r[ins->b])));
+                break;
+            case OP_SQRT:
+                r[ins->a] = typedVal(r[ins->b].type, sqrt(asDouble(r[ins->b])));
+                break;
+            case OP_LOG:
+                r[ins->a] = typedVal(r[ins->b].type, log(asDouble(r[ins->b])));
+                break;
+            case OP_EXP2:
+                r[ins->a] = typedVal(r[ins->b].type, exp2(asDouble(r[ins->b])));
+                break;
+            case OP_CBRT:
+                r[ins->a] = typedVal(r[ins->b].type, cbrt(asDouble(r[ins->b])));
+                break;
+            case OP_ADD:
+                r[ins->a] = numAdd(promoteType(r[ins->b], r[ins->c]), r[ins->b], r[ins->c]);
+                break;
+            case OP_SUB:
+                r[ins->a] = numSub(promoteType(r[ins->b], r[ins->c]), r[ins->b], r[ins->c]);
+                break;
+            case OP_MULT:
+                r[ins->a] = numMult(promoteType(r[ins->b], r[ins->c]), r[ins->b], r[ins->c]);
+                break;
+            case OP_DIV:
+                r[ins->a] = numDiv(promoteType(r[ins->b], r[ins->c]), r[ins->b], r[ins->c]);
+                break;
+            case OP_REMAINDER:
+                r[ins->a] = numRemainder(promoteType(r[ins->b], r[ins->c]), r[ins->b], r[ins->c]);
+                break;
+            case OP_POW:
+                r[ins->a] = typedVal(promoteType(r[ins->b], r[ins->c]), pow(asDouble(r[ins->b]), asDouble(r[ins->c])));
+                break;
+            case OP_MAX:
+                r[ins->a] = numMax(promoteType(r[ins->b], r[ins->c]), r[ins->b], r[ins->c]);
+                break;
+            case OP_MIN:
+                r[ins->a] = numMin(promoteType(r[ins->b], r[ins->c]), r[ins->b], r[ins->c]);
+                break;
+            case OP_HYPOT:
+                r[ins->a] = typedVal(promoteType(r[ins->b], r[ins->c]), hypot(asDouble(r[ins->b]), asDouble(r[ins->c])));
+                break;
+            case OP_EQUAL:
+                r[ins->a] = numEqual(r[ins->b], r[ins->c]);
+                break;
+            case OP_LESS:
+                r[ins->a] = numLess(r[ins->b], r[ins->c]);
+                break;
+            case OP_GREATER:
+                r[ins->a] = numGreater(r[ins->b], r[ins->c]);
+                break;
+            case OP_READ:
+                r[ins->a] = readVal();
+                break;
+            case OP_RAND:
+                r[ins->a] = randVal();
+                break;
+            case OP_PRINTBEGIN:
+                outputString("=> ");
+                break;
+            case OP_PRINT: {
+                bool isInt = ins->b >= 0 ? ins->c == INT_TYPE : r[ins->a].type == INT_TYPE;
+                if (ins->b >= 0) {
+                    outputString("Symbol: ");
+                    outputString(prog->names[ins->b]);
+                    outputString(" = ");
+                }
+                else
+                    outputString("Number: ");
+                if (isInt)
+                    outputInt(r[ins->a]);
+                else
+                    outputDouble(asDouble(r[ins->a]));
+                outputChar(' ');
+                break;
+            }
+            case OP_PRINTEND:
+                outputChar('\n');
+                break;
+            case OP_CAST:
+                r[ins->a] = checkType(ins->c, r[ins->a], prog->names[ins->b]);
+                break;
+            case OP_JMP:
+                pc = code + ins->b;
+                break;
+            case OP_JMPZ:
+                if (asDouble(r[ins->a]) == 0)
+                    pc = code + ins->b;
+                break;
+            case OP_CALL:
+            case OP_TAILCALL: {
+                VM_FUNC *func = &prog->funcs[ins->b];
+                if (func->memo != NULL && memoLookup(func->memo, &r[ins->a], &r[ins->a])) {
+                    if (ins->op == OP_TAILCALL)
+                        goto ret;
+                    break;
+                }
+                RET_VAL val;
+                if (func->jit != NULL && jitCall(func->jit, &r[ins->a], &val)) {
+                    if (func->memo != NULL)
+                        memoStore(func->memo, &r[ins->a], val);
+                    r[ins->a] = val;
+                    if (ins->op == OP_TAILCALL)
+                        goto ret;
+                    break;
+                }
+
+                VM_CHUNK *body = &prog->chunks[func->body];
+                VM_FRAME *parent = env;
+                for (int hops = ins->c; hops > 0; hops--)
+                    parent = parent->parent;
+
+                // reuse the activation, registers and frame of the calling lambda
+                // unless the callee was defined inside it; the activation's cache
+                // still gets the right value since the callee's result is the caller's
+                if (ins->op == OP_TAILCALL && parent != env && env == frameTop - 1) {
+                    frameTop = env;
+                    cellTop = env->cells;
+                    VM_FRAME *frame = vmPushFrame(&frameTop, &cellTop, func, parent);
+                    if (frame == NULL || regs + body->numRegs > regEnd)
+                        goto overflow;
+                    for (int i = 0; i < func->numArgs; i++)
+                        frame->cells[i] = (VM_CELL){r[ins->a + i], CELL_READY};
+
+                    numRegs = body->numRegs;
+                    env = frame;
+                    pc = code + body->entry;
+                    break;
+                }
+
+                VM_FRAME *savedFrameTop = frameTop;
+                VM_CELL *savedCellTop = cellTop;
+                VM_FRAME *frame = vmPushFrame(&frameTop, &cellTop, func, parent);
+                if (frame == NULL || call + 1 == callEnd || regs + numRegs + body->numRegs > regEnd)
+                    goto overflow;
+                for (int i = 0; i < func->numArgs; i++)
+                    frame->cells[i] = (VM_CELL){r[ins->a + i], CELL_READY};
+
+                *++call = (VM_ACTIVATION){pc, regs, numRegs, env, &r[ins->a], NULL, func->memo, savedFrameTop, savedCellTop};
+                regs += numRegs;
+                numRegs = body->numRegs;
+                env = frame;
+                pc = code + body->entry;
+                break;
+            }
+            case OP_RET:
+            ret: {
+                RET_VAL val = r[ins->a];
+                if (call == vmStack->calls)
+                    return val;
+
+                if (call->cell != NULL) {
+                    call->cell->val = val;
+                    call->cell->state = CELL_READY;
+                }
+                else {
+                    // the arguments are still in the caller's registers from dst on
+                    if (call->memo != NULL)
+                        memoStore(call->memo, call->dst, val);
+                    *call->dst = val;
+                }
+                frameTop = call->frameTop;
+                cellTop = call->cellTop;
+                pc = call->pc;
+                regs = call->regs;
+                numRegs = call->numRegs;
+                env = call->env;
+                call--;
+                break;
+            }
+            case OP_LOADSESSION:
+                r[ins->a] = sessionValue(ins->b, prog->names[ins->c]);
+                break;
+            case OP_FAIL:
+                fprintf(OUTPUT, vmErrors[ins->c], prog->names[ins->b]);
+                r[ins->a] = NAN_VAL;
+                break;
+        }
+    }
+
+    overflow:
+    fprintf(OUTPUT, "ERROR: stack overflow\n");
+    return NAN_VAL;
+}
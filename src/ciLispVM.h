@@ -0,0 +1,99 @@
+#ifndef __cilisp_vm_h_
+#define __cilisp_vm_h_
+
+#include "ciLisp.h"
+#include "ciLispJIT.h"
+#include "ciLispMemo.h"
+#include "ciLispSession.h"
+
+// Bytecode instruction set.
+// Operands a, b and c are register indices, constant indices, slots or jump
+// targets depending on the opcode (see the comment next to each one).
+typedef enum {
+    OP_LOADK,       // r[a] = k[b]
+    OP_LOADVAR,     // r[a] = slot b of the frame c static links up (forced once)
+    OP_LOADSESSION, // r[a] = session variable b, named c
+    OP_NEG,         // r[a] = op r[b]
+    OP_ABS,
+    OP_EXP,
+    OP_SQRT,
+    OP_LOG,
+    OP_EXP2,
+    OP_CBRT,
+    OP_ADD,         // r[a] = r[b] op r[c]
+    OP_SUB,
+    OP_MULT,
+    OP_DIV,
+    OP_REMAINDER,
+    OP_POW,
+    OP_MAX,
+    OP_MIN,
+    OP_HYPOT,
+    OP_EQUAL,
+    OP_LESS,
+    OP_GREATER,
+    OP_READ,        // r[a] = value read from stdin
+    OP_RAND,        // r[a] = 0 or 1
+    OP_PRINTBEGIN,  // prints "=> "
+    OP_PRINT,       // prints r[a], named b (or -1 for a number) declared as type c
+    OP_PRINTEND,    // prints "\n"
+    OP_CAST,        // r[a] = checkType(c, r[a]) for variable named b
+    OP_JMP,         // pc = b
+    OP_JMPZ,        // if r[a] == 0 then pc = b
+    OP_CALL,        // r[a] = lambda b(r[a] ... ), defined c static links up
+    OP_TAILCALL,    // return lambda b(r[a] ... ), defined c static links up
+    OP_RET,         // return r[a]
+    OP_FAIL         // print error c about name b, r[a] = NAN
+} VM_OPCODE;
+
+typedef struct {
+    VM_OPCODE op;
+    int a;
+    int b;
+    int c;
+} VM_INSTR;
+
+// A straight run of code with its own register window.
+// Lambda bodies, let bindings and the top level expression are each a chunk.
+typedef struct {
+    int entry;
+    int numRegs;
+} VM_CHUNK;
+
+typedef struct {
+    int thunk;  // chunk computing the value, -1 for lambda arguments
+    int name;
+} VM_SLOT;
+
+// Layout of an environment frame: lambda arguments first, then every
+// let binding that is introduced inside the function body.
+typedef struct {
+    int body;   // chunk index
+    int numArgs;
+    VM_SLOT *slots;
+    int numSlots, slotCap;
+    struct jit_func *jit; // native code, if the lambda has any
+    struct memo_cache *memo; // result cache, if the lambda is pure
+} VM_FUNC;
+
+typedef struct vm_program {
+    VM_INSTR *code;
+    int codeLen, codeCap;
+    RET_VAL *consts;
+    int constLen, constCap;
+    VM_CHUNK *chunks;
+    int chunkLen, chunkCap;
+    VM_FUNC *funcs; // funcs[0] is the top level expression
+    int funcLen, funcCap;
+    char **names;
+    int nameLen, nameCap;
+    SESSION_BLOCK **blocks; // session definitions compiled into the program
+    int blockLen, blockCap;
+} VM_PROGRAM;
+
+VM_PROGRAM *vmCompile(AST_NODE *node, SCOPE *globals);
+RET_VAL vmRun(VM_PROGRAM *prog, const RET_VAL *args);
+void vmReleaseStack(void);
+void vmFreeProgram(VM_PROGRAM *prog);
+
+#endif
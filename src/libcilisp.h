@@ -0,0 +1,110 @@
+#ifndef __libcilisp_h_
+#define __libcilisp_h_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Embedding API of the interpreter (libcilisp).
+//
+// A context holds the settings programs are compiled and run with. Programs
+// are compiled once into a handle that owns everything parsed for them and
+// can be evaluated any number of times with new values for their free
+// symbols. All evaluation state lives in the calling thread, so contexts can
+// be used concurrently from different threads; a context and the programs
+// compiled with it must only be used by one thread at a time. A program that
+// uses definitions of the session only evaluates in the thread and session it
+// was compiled in; elsewhere, or after cilispReleaseThread(), it prints an
+// error and returns NAN.
+
+// Types of numeric values
+typedef enum {
+    NO_TYPE,
+    INT_TYPE,
+    DOUBLE_TYPE
+} NUM_TYPE;
+
+// Node to store a number. INT_TYPE whole numbers are held exactly in ival
+// with isInt set; every other value, including the fractions that sqrt or
+// div leave in an INT_TYPE and ints past the int64 range, is in dval.
+typedef struct {
+    NUM_TYPE type;
+    bool isInt;
+    union {
+        double dval;
+        int64_t ival;
+    };
+} NUM_AST_NODE;
+
+// Values returned by eval function will be numbers with a type.
+// They have the same structure as a NUM_AST_NODE.
+// The line below allows us to give this struct another name for readability.
+typedef NUM_AST_NODE RET_VAL;
+
+// Values to bind to the names of a program, and the value of a result.
+static inline RET_VAL cilispInt(int64_t ival)
+{
+    RET_VAL val = {INT_TYPE, true};
+    val.ival = ival;
+    return val;
+}
+
+static inline RET_VAL cilispDouble(double dval)
+{
+    return (RET_VAL){DOUBLE_TYPE, false, {dval}};
+}
+
+static inline double cilispToDouble(RET_VAL val)
+{
+    return val.isInt ? (double) val.ival : val.dval;
+}
+
+// Selects how program s_exprs are evaluated: by walking the AST with eval()
+// (the reference) or by compiling them to bytecode for the VM in ciLispVM.c.
+typedef enum {
+    TREE_EVAL_MODE,
+    VM_EVAL_MODE
+} EVAL_MODE;
+
+// How print shows DOUBLE_TYPE values: with two decimals like "%.2f", or with
+// the fewest digits that read back as the same double.
+typedef enum {
+    FIXED_NUMBER_FORMAT,
+    SHORTEST_NUMBER_FORMAT
+} NUMBER_FORMAT;
+
+typedef struct {
+    EVAL_MODE mode;
+    bool jit;     // native code for arithmetic lambdas, see ciLispJIT.c
+    bool memo;    // result caches for pure lambdas, see ciLispMemo.c
+    FILE *output; // where print and error messages go, stdout if NULL
+    NUMBER_FORMAT format;
+} CILISP_OPTIONS;
+
+typedef struct cilisp_context CILISP_CONTEXT;
+typedef struct cilisp_program CILISP_PROGRAM;
+
+// Returns a context with options (or the defaults if NULL), or NULL if out of memory.
+CILISP_CONTEXT *cilispCreateContext(const CILISP_OPTIONS *options);
+void cilispDestroyContext(CILISP_CONTEXT *context);
+
+// Compiles one s_expr. Symbols that it does not bind itself may be among
+// names, which get their values when it is evaluated.
+// Returns NULL if source has no valid s_expr.
+CILISP_PROGRAM *cilispCompile(CILISP_CONTEXT *context, const char *source, const char *const *names, int numNames);
+
+// Evaluates program with values[i] bound to the i-th of its names.
+RET_VAL cilispEvaluate(CILISP_CONTEXT *context, CILISP_PROGRAM *program, const RET_VAL *values);
+
+// Installs the definitions of a `(define ...)` in the session of the calling
+// thread, where the programs it compiles and evaluates afterwards look up the
+// names they do not bind themselves. Returns false if nothing was defined.
+// Programs compiled before call the new definitions too.
+bool cilispDefine(CILISP_CONTEXT *context, const char *source);
+
+void cilispRelease(CILISP_PROGRAM *program);
+
+// Frees what the calling thread keeps between evaluations, before it exits.
+void cilispReleaseThread(void);
+
+#endif
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Differential tests of the evaluators. Every script in tests/cases runs in
+# each evaluation mode and what it prints on stdout must match
+# tests/expected/NAME.out, the output of --tree, the reference evaluator.
+# tests/expected/NAME.MODE.out takes its place for a mode whose output
+# differs by design, like define being rejected with --threads and in images.
+# A script with a NAME.csv next to it is run with --columns NAME.csv instead,
+# in the modes that support it.
+#
+# usage: tests/run_tests.sh path/to/cilisp
+
+cilisp=${1:?usage: $0 path/to/cilisp}
+dir=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+modes="tree vm vm-jit tree-jit tree-memo vm-jit-memo threads image"
+columnModes="tree vm vm-jit tree-memo"
+
+flags()
+{
+    case $1 in
+        tree) echo --tree ;;
+        vm) echo --vm ;;
+        vm-jit) echo --vm --jit ;;
+        tree-jit) echo --tree --jit ;;
+        tree-memo) echo --tree --memo ;;
+        vm-jit-memo) echo --vm --jit --memo ;;
+        threads) echo --threads 4 ;;
+    esac
+}
+
+# run MODE NAME prints what the script NAME prints in MODE
+run()
+{
+    script=$dir/cases/$2.txt
+    if [ -f "$dir/cases/$2.csv" ]; then
+        "$cilisp" $(flags "$1") --columns "$dir/cases/$2.csv" "$script"
+    elif [ "$1" = image ]; then
+        "$cilisp" --compile "$script" -o "$work/image.cli" && "$cilisp" --image "$work/image.cli"
+    else
+        "$cilisp" $(flags "$1") "$script"
+    fi
+}
+
+runs=0
+failed=0
+for script in "$dir"/cases/*.txt; do
+    name=$(basename "$script" .txt)
+    caseModes=$modes
+    [ -f "$dir/cases/$name.csv" ] && caseModes=$columnModes
+
+    for mode in $caseModes; do
+        expected=$dir/expected/$name.$mode.out
+        [ -f "$expected" ] || expected=$dir/expected/$name.out
+
+        runs=$((runs + 1))
+        run "$mode" "$name" > "$work/out" 2> /dev/null
+        if ! diff -u "$expected" "$work/out" > "$work/diff"; then
+            failed=$((failed + 1))
+            echo "FAIL: $name ($mode)"
+            head -n 20 "$work/diff"
+        fi
+    done
+done
+
+echo "$runs runs, $failed failed"
+[ "$failed" -eq 0 ]